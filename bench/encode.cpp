@@ -0,0 +1,240 @@
+#include "BC.h"
+#include "texture.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <cmath>
+
+// Encoder throughput over a fixed synthetic corpus, printed as JSON so runs can be compared between releases.
+// Every image is encoded whole on the thread pool to measure megapixels per second,
+// block compressed paths are also run block by block on one thread to measure the latency of a single block.
+
+struct bench_image {
+	const char *name;
+	i32 width;
+	i32 height;
+	std::vector<u8> rgba;
+};
+
+struct bench_encoding {
+	const char *name;
+	texture_encoding encoding;
+};
+
+static const bench_encoding bench_encodings[] = {
+    {"RGB", TEXTURE_ENCODING_RGB},
+    {"RGBA", TEXTURE_ENCODING_RGBA},
+    {"BC3", TEXTURE_ENCODING_BC3},
+    {"BC5_YCBCR", TEXTURE_ENCODING_BC5_YCBCR},
+    {"BC7", TEXTURE_ENCODING_BC7},
+};
+
+// Sizes above the limit given on the command line are skipped, BC7 takes seconds per megapixel
+static const i32 bench_sizes[] = {64, 256, 1024};
+
+// Minimum time spent on each case, repeats stop once it is reached
+static const f64 bench_min_seconds = 0.5;
+static const i32 bench_min_runs    = 3;
+// Blocks encoded one at a time for the latency, spread over the whole image
+static const u64 bench_latency_blocks = 1024;
+
+static u32
+bench_random (u32 *state) {
+	u32 x  = *state;
+	x     ^= x << 13;
+	x     ^= x >> 17;
+	x     ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static void
+bench_set_pixel (bench_image &image, i32 x, i32 y, u8 r, u8 g, u8 b, u8 a) {
+	u8 *pixel = &image.rgba[((u64)y * image.width + x) * 4];
+	pixel[0]  = r;
+	pixel[1]  = g;
+	pixel[2]  = b;
+	pixel[3]  = a;
+}
+
+static bench_image
+bench_make_image (const char *name, i32 size) {
+	bench_image image = {name, size, size, std::vector<u8> ((u64)size * size * 4)};
+	u32 state         = 0x9E3779B9 ^ (u32)size;
+
+	if (strcmp (name, "gradient") == 0) {
+		for (i32 y = 0; y < size; y++)
+			for (i32 x = 0; x < size; x++)
+				bench_set_pixel (image, x, y, x * 255 / size, y * 255 / size, (x + y) * 127 / size, 255);
+	} else if (strcmp (name, "noise") == 0) {
+		for (i32 y = 0; y < size; y++)
+			for (i32 x = 0; x < size; x++) {
+				u32 value = bench_random (&state);
+				bench_set_pixel (image, x, y, value, value >> 8, value >> 16, value >> 24);
+			}
+	} else if (strcmp (name, "flat_ui") == 0) {
+		// Flat panels with one pixel borders on a plain background, like menu sprites
+		for (i32 y = 0; y < size; y++)
+			for (i32 x = 0; x < size; x++)
+				bench_set_pixel (image, x, y, 32, 36, 48, 255);
+		for (i32 panel = 0; panel < 24; panel++) {
+			i32 x0    = bench_random (&state) % size;
+			i32 y0    = bench_random (&state) % size;
+			i32 x1    = std::min (size, x0 + 8 + (i32)(bench_random (&state) % (size / 4)));
+			i32 y1    = std::min (size, y0 + 8 + (i32)(bench_random (&state) % (size / 4)));
+			u32 color = bench_random (&state);
+			for (i32 y = y0; y < y1; y++)
+				for (i32 x = x0; x < x1; x++) {
+					bool border = x == x0 || y == y0 || x == x1 - 1 || y == y1 - 1;
+					bench_set_pixel (image, x, y, border ? 255 : color, border ? 255 : color >> 8, border ? 255 : color >> 16, 255);
+				}
+		}
+	} else {
+		// Opaque discs with antialiased edges on a transparent background
+		for (i32 y = 0; y < size; y++)
+			for (i32 x = 0; x < size; x++)
+				bench_set_pixel (image, x, y, 0, 0, 0, 0);
+		for (i32 disc = 0; disc < 16; disc++) {
+			f32 cx    = bench_random (&state) % size;
+			f32 cy    = bench_random (&state) % size;
+			f32 r     = 4 + bench_random (&state) % (size / 8);
+			u32 color = bench_random (&state);
+			for (i32 y = std::max (0, (i32)(cy - r - 1)); y < std::min (size, (i32)(cy + r + 1)); y++)
+				for (i32 x = std::max (0, (i32)(cx - r - 1)); x < std::min (size, (i32)(cx + r + 1)); x++) {
+					f32 coverage = std::clamp (r - std::sqrt ((x - cx) * (x - cx) + (y - cy) * (y - cy)), 0.0f, 1.0f);
+					if (coverage > 0) bench_set_pixel (image, x, y, color, color >> 8, color >> 16, coverage * 255);
+				}
+		}
+	}
+
+	return image;
+}
+
+static f64
+bench_seconds_since (std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<f64> (std::chrono::steady_clock::now () - start).count ();
+}
+
+// Median seconds of one whole image encode, over at least bench_min_runs runs and bench_min_seconds
+static f64
+bench_encode (const bench_image &image, texture_encoding encoding, i32 *runs) {
+	const u8 *layer = image.rgba.data ();
+	std::vector<f64> times;
+	f64 total = 0;
+
+	// The first run warms the thread pool and scratch arenas and is only counted when it alone takes long enough
+	for (bool warmup = true; total < bench_min_seconds || (i32)times.size () < bench_min_runs; warmup = false) {
+		txp texture;
+		auto start = std::chrono::steady_clock::now ();
+		texture_encode (&texture, &layer, 1, image.width, image.height, encoding, 1);
+		f64 seconds = bench_seconds_since (start);
+		if (warmup && seconds < bench_min_seconds) continue;
+		times.push_back (seconds);
+		total += seconds;
+	}
+
+	std::sort (times.begin (), times.end ());
+	*runs = times.size ();
+	return times[times.size () / 2];
+}
+
+// Nanoseconds to encode one BC5_YCBCR block on the calling thread. Goes through the same steps as texture_encode
+// for every 8x8 pixels: the YCbCr conversion, four Y/A blocks and one block of the half size CbCr plane.
+static f64
+bench_block_latency_ycbcr (const bench_image &image) {
+	u64 count  = (u64)(image.width / 8) * (image.height / 8);
+	u64 step   = std::max<u64> (count / (bench_latency_blocks / 4), 1);
+	u64 blocks = 0;
+	u8 rgba[8 * 8 * 4];
+	u8 ya[8 * 8 * 2];
+	u8 cbcr[8 * 8 * 2];
+	u8 out[16];
+	auto start = std::chrono::steady_clock::now ();
+	for (u64 block = 0; block < count; block += step) {
+		i32 x = block % (image.width / 8) * 8;
+		i32 y = block / (image.width / 8) * 8;
+		for (i32 row = 0; row < 8; row++)
+			memcpy (&rgba[row * 8 * 4], &image.rgba[((u64)(y + row) * image.width + x) * 4], 8 * 4);
+		texture_convert_ycbcr (ya, cbcr, rgba, 8 * 8);
+
+		for (i32 quarter = 0; quarter < 4; quarter++) {
+			XMFLOAT2 color[16];
+			for (i32 i = 0; i < 16; i++) {
+				const u8 *pixel = &ya[((quarter / 2 * 4 + i / 4) * 8 + quarter % 2 * 4 + i % 4) * 2];
+				color[i]        = {pixel[0] / 255.0f, pixel[1] / 255.0f};
+			}
+			D3DXEncodeBC5U (out, color);
+		}
+
+		XMFLOAT2 half[16];
+		for (i32 i = 0; i < 16; i++) {
+			const u8 *pixel = &cbcr[((i / 4 * 2) * 8 + i % 4 * 2) * 2];
+			half[i]         = {(pixel[0] + pixel[2] + pixel[16] + pixel[18]) / 255.0f / 4, (pixel[1] + pixel[3] + pixel[17] + pixel[19]) / 255.0f / 4};
+		}
+		D3DXEncodeBC5U (out, half);
+		blocks += 4;
+	}
+
+	return bench_seconds_since (start) * 1e9 / blocks;
+}
+
+// Nanoseconds to encode one block on the calling thread, averaged over blocks from all over the image, 0 for uncompressed encodings
+static f64
+bench_block_latency (const bench_image &image, texture_encoding encoding) {
+	if (encoding == TEXTURE_ENCODING_RGB || encoding == TEXTURE_ENCODING_RGBA) return 0;
+	if (encoding == TEXTURE_ENCODING_BC5_YCBCR) return bench_block_latency_ycbcr (image);
+
+	u64 count  = (u64)(image.width / 4) * (image.height / 4);
+	u64 step   = std::max<u64> (count / bench_latency_blocks, 1);
+	u64 blocks = 0;
+	u8 out[16];
+	auto start = std::chrono::steady_clock::now ();
+	for (u64 block = 0; block < count; block += step) {
+		i32 x = block % (image.width / 4) * 4;
+		i32 y = block / (image.width / 4) * 4;
+
+		HDRColorA color[16];
+		for (i32 i = 0; i < 16; i++) {
+			const u8 *pixel = &image.rgba[((u64)(y + i / 4) * image.width + x + i % 4) * 4];
+			color[i]        = HDRColorA (pixel[0] / 255.0f, pixel[1] / 255.0f, pixel[2] / 255.0f, pixel[3] / 255.0f);
+		}
+
+		if (encoding == TEXTURE_ENCODING_BC3) D3DXEncodeBC3 (out, color, BC_FLAGS_DITHER_RGB | BC_FLAGS_DITHER_A);
+		else D3DXEncodeBC7 (out, color, 0);
+		blocks++;
+	}
+
+	return bench_seconds_since (start) * 1e9 / blocks;
+}
+
+int
+main (int argc, char **argv) {
+	const char *images[] = {"gradient", "noise", "flat_ui", "alpha_cutout"};
+	i32 max_size         = argc > 1 ? atoi (argv[1]) : 1024;
+
+	printf ("{\n\t\"threads\": %u,\n\t\"results\": [", thread_pool::get ().get_concurrency ());
+	bool first = true;
+	for (i32 size : bench_sizes) {
+		if (size > max_size) continue;
+		for (const char *name : images) {
+			bench_image image = bench_make_image (name, size);
+			for (const auto &encoding : bench_encodings) {
+				i32 runs;
+				f64 seconds = bench_encode (image, encoding.encoding, &runs);
+				f64 pixels  = (f64)image.width * image.height;
+				f64 blocks  = pixels / 16;
+				f64 latency = bench_block_latency (image, encoding.encoding);
+
+				printf ("%s\n\t\t{\"encoding\": \"%s\", \"image\": \"%s\", \"width\": %d, \"height\": %d, \"runs\": %d, \"median_ms\": %.6g, "
+				        "\"mpix_per_s\": %.6g, \"ns_per_block\": %.6g, \"block_latency_ns\": %.6g}",
+				        first ? "" : ",", encoding.name, name, image.width, image.height, runs, seconds * 1e3, pixels / seconds / 1e6,
+				        seconds * 1e9 / blocks, latency);
+				fflush (stdout);
+				first = false;
+			}
+		}
+	}
+	printf ("\n\t]\n}\n");
+
+	return 0;
+}
@@ -0,0 +1,292 @@
+#include "aes_accel.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+struct aes_funcs {
+	void (*ecb_encrypt) (const u8 *key, u8 *data, u64 size);
+	void (*ecb_decrypt) (const u8 *key, u8 *data, u64 size);
+	void (*cbc_encrypt) (const u8 *key, const u8 *iv, u8 *data, u64 size);
+	void (*cbc_decrypt) (const u8 *key, const u8 *iv, u8 *data, u64 size);
+};
+
+static void
+aes_ecb_encrypt_portable (const u8 *key, u8 *data, u64 size) {
+	aes128_ctx ctx;
+	aes128_init_ctx (&ctx, key);
+	aes128_ecb_encrypt_buffer (&ctx, data, size);
+}
+
+static void
+aes_ecb_decrypt_portable (const u8 *key, u8 *data, u64 size) {
+	aes128_ctx ctx;
+	aes128_init_ctx (&ctx, key);
+	aes128_ecb_decrypt_buffer (&ctx, data, size);
+}
+
+static void
+aes_cbc_encrypt_portable (const u8 *key, const u8 *iv, u8 *data, u64 size) {
+	aes128_ctx ctx;
+	aes128_init_ctx_iv (&ctx, key, iv);
+	aes128_cbc_encrypt_buffer (&ctx, data, size);
+}
+
+static void
+aes_cbc_decrypt_portable (const u8 *key, const u8 *iv, u8 *data, u64 size) {
+	aes128_ctx ctx;
+	aes128_init_ctx_iv (&ctx, key, iv);
+	aes128_cbc_decrypt_buffer (&ctx, data, size);
+}
+
+#ifdef __x86_64__
+__attribute__ ((target ("aes"))) static inline __m128i
+aes_expand_step (__m128i key, __m128i assist) {
+	assist = _mm_shuffle_epi32 (assist, 0xFF);
+	key    = _mm_xor_si128 (key, _mm_slli_si128 (key, 4));
+	key    = _mm_xor_si128 (key, _mm_slli_si128 (key, 4));
+	key    = _mm_xor_si128 (key, _mm_slli_si128 (key, 4));
+	return _mm_xor_si128 (key, assist);
+}
+
+// Round keys for aesenc, and when dec is given the inverse ones for aesdec in the order they are applied
+__attribute__ ((target ("aes"))) static void
+aes_expand_key (const u8 *key, __m128i *enc, __m128i *dec) {
+	enc[0]  = _mm_loadu_si128 ((const __m128i *)key);
+	enc[1]  = aes_expand_step (enc[0], _mm_aeskeygenassist_si128 (enc[0], 0x01));
+	enc[2]  = aes_expand_step (enc[1], _mm_aeskeygenassist_si128 (enc[1], 0x02));
+	enc[3]  = aes_expand_step (enc[2], _mm_aeskeygenassist_si128 (enc[2], 0x04));
+	enc[4]  = aes_expand_step (enc[3], _mm_aeskeygenassist_si128 (enc[3], 0x08));
+	enc[5]  = aes_expand_step (enc[4], _mm_aeskeygenassist_si128 (enc[4], 0x10));
+	enc[6]  = aes_expand_step (enc[5], _mm_aeskeygenassist_si128 (enc[5], 0x20));
+	enc[7]  = aes_expand_step (enc[6], _mm_aeskeygenassist_si128 (enc[6], 0x40));
+	enc[8]  = aes_expand_step (enc[7], _mm_aeskeygenassist_si128 (enc[7], 0x80));
+	enc[9]  = aes_expand_step (enc[8], _mm_aeskeygenassist_si128 (enc[8], 0x1B));
+	enc[10] = aes_expand_step (enc[9], _mm_aeskeygenassist_si128 (enc[9], 0x36));
+	if (dec == nullptr) return;
+
+	dec[0] = enc[10];
+	for (i32 i = 1; i < 10; i++)
+		dec[i] = _mm_aesimc_si128 (enc[10 - i]);
+	dec[10] = enc[0];
+}
+
+__attribute__ ((target ("aes"))) static inline __m128i
+aes_encrypt_block (const __m128i *keys, __m128i block) {
+	block = _mm_xor_si128 (block, keys[0]);
+	for (i32 i = 1; i < 10; i++)
+		block = _mm_aesenc_si128 (block, keys[i]);
+	return _mm_aesenclast_si128 (block, keys[10]);
+}
+
+__attribute__ ((target ("aes"))) static inline __m128i
+aes_decrypt_block (const __m128i *keys, __m128i block) {
+	block = _mm_xor_si128 (block, keys[0]);
+	for (i32 i = 1; i < 10; i++)
+		block = _mm_aesdec_si128 (block, keys[i]);
+	return _mm_aesdeclast_si128 (block, keys[10]);
+}
+
+// 8 independent blocks per iteration to cover the aesenc latency
+__attribute__ ((target ("aes"))) static void
+aes_ecb_encrypt_ni (const u8 *key, u8 *data, u64 size) {
+	__m128i keys[11];
+	aes_expand_key (key, keys, nullptr);
+
+	u64 i = 0;
+	for (; i + 0x80 <= size; i += 0x80) {
+		__m128i blocks[8];
+		for (i32 j = 0; j < 8; j++)
+			blocks[j] = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *)(data + i) + j), keys[0]);
+		for (i32 r = 1; r < 10; r++)
+			for (i32 j = 0; j < 8; j++)
+				blocks[j] = _mm_aesenc_si128 (blocks[j], keys[r]);
+		for (i32 j = 0; j < 8; j++)
+			_mm_storeu_si128 ((__m128i *)(data + i) + j, _mm_aesenclast_si128 (blocks[j], keys[10]));
+	}
+
+	for (; i < size; i += 0x10)
+		_mm_storeu_si128 ((__m128i *)(data + i), aes_encrypt_block (keys, _mm_loadu_si128 ((const __m128i *)(data + i))));
+}
+
+__attribute__ ((target ("aes"))) static void
+aes_ecb_decrypt_ni (const u8 *key, u8 *data, u64 size) {
+	__m128i enc[11];
+	__m128i keys[11];
+	aes_expand_key (key, enc, keys);
+
+	u64 i = 0;
+	for (; i + 0x80 <= size; i += 0x80) {
+		__m128i blocks[8];
+		for (i32 j = 0; j < 8; j++)
+			blocks[j] = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *)(data + i) + j), keys[0]);
+		for (i32 r = 1; r < 10; r++)
+			for (i32 j = 0; j < 8; j++)
+				blocks[j] = _mm_aesdec_si128 (blocks[j], keys[r]);
+		for (i32 j = 0; j < 8; j++)
+			_mm_storeu_si128 ((__m128i *)(data + i) + j, _mm_aesdeclast_si128 (blocks[j], keys[10]));
+	}
+
+	for (; i < size; i += 0x10)
+		_mm_storeu_si128 ((__m128i *)(data + i), aes_decrypt_block (keys, _mm_loadu_si128 ((const __m128i *)(data + i))));
+}
+
+// Every block depends on the previous ciphertext, so encryption stays one block at a time
+__attribute__ ((target ("aes"))) static void
+aes_cbc_encrypt_ni (const u8 *key, const u8 *iv, u8 *data, u64 size) {
+	__m128i keys[11];
+	aes_expand_key (key, keys, nullptr);
+
+	__m128i prev = _mm_loadu_si128 ((const __m128i *)iv);
+	for (u64 i = 0; i < size; i += 0x10) {
+		prev = aes_encrypt_block (keys, _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *)(data + i)), prev));
+		_mm_storeu_si128 ((__m128i *)(data + i), prev);
+	}
+}
+
+// Decrypts blocks [0, count) back to front, the ciphertext before each block is still intact when it is needed
+__attribute__ ((target ("aes"))) static void
+aes_cbc_decrypt_blocks_ni (const __m128i *keys, const u8 *iv, u8 *data, u64 count) {
+	for (u64 i = count; i > 0; i--) {
+		u8 *block    = data + (i - 1) * 0x10;
+		__m128i prev = _mm_loadu_si128 ((const __m128i *)(i > 1 ? block - 0x10 : iv));
+		_mm_storeu_si128 ((__m128i *)block, _mm_xor_si128 (aes_decrypt_block (keys, _mm_loadu_si128 ((const __m128i *)block)), prev));
+	}
+}
+
+__attribute__ ((target ("aes"))) static void
+aes_cbc_decrypt_ni (const u8 *key, const u8 *iv, u8 *data, u64 size) {
+	__m128i enc[11];
+	__m128i keys[11];
+	aes_expand_key (key, enc, keys);
+
+	// Runs of 8 blocks from the end, each one keeps block i - 1 in memory for its first xor
+	u64 i = size / 0x10;
+	for (; i > 8; i -= 8) {
+		u8 *chunk = data + (i - 8) * 0x10;
+		__m128i blocks[8];
+		__m128i prev[8];
+		for (i32 j = 0; j < 8; j++) {
+			prev[j]   = _mm_loadu_si128 ((const __m128i *)chunk + j - 1);
+			blocks[j] = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *)chunk + j), keys[0]);
+		}
+		for (i32 r = 1; r < 10; r++)
+			for (i32 j = 0; j < 8; j++)
+				blocks[j] = _mm_aesdec_si128 (blocks[j], keys[r]);
+		for (i32 j = 0; j < 8; j++)
+			_mm_storeu_si128 ((__m128i *)chunk + j, _mm_xor_si128 (_mm_aesdeclast_si128 (blocks[j], keys[10]), prev[j]));
+	}
+
+	aes_cbc_decrypt_blocks_ni (keys, iv, data, i);
+}
+
+// 16 blocks per iteration in four 512 bit registers, the tails go through the AES-NI versions
+__attribute__ ((target ("aes,avx512f,vaes"))) static void
+aes_ecb_encrypt_vaes (const u8 *key, u8 *data, u64 size) {
+	__m128i keys[11];
+	__m512i wide[11];
+	aes_expand_key (key, keys, nullptr);
+	for (i32 r = 0; r < 11; r++)
+		wide[r] = _mm512_broadcast_i32x4 (keys[r]);
+
+	u64 i = 0;
+	for (; i + 0x100 <= size; i += 0x100) {
+		__m512i blocks[4];
+		for (i32 j = 0; j < 4; j++)
+			blocks[j] = _mm512_xor_si512 (_mm512_loadu_si512 (data + i + j * 0x40), wide[0]);
+		for (i32 r = 1; r < 10; r++)
+			for (i32 j = 0; j < 4; j++)
+				blocks[j] = _mm512_aesenc_epi128 (blocks[j], wide[r]);
+		for (i32 j = 0; j < 4; j++)
+			_mm512_storeu_si512 (data + i + j * 0x40, _mm512_aesenclast_epi128 (blocks[j], wide[10]));
+	}
+
+	aes_ecb_encrypt_ni (key, data + i, size - i);
+}
+
+__attribute__ ((target ("aes,avx512f,vaes"))) static void
+aes_ecb_decrypt_vaes (const u8 *key, u8 *data, u64 size) {
+	__m128i enc[11];
+	__m128i keys[11];
+	__m512i wide[11];
+	aes_expand_key (key, enc, keys);
+	for (i32 r = 0; r < 11; r++)
+		wide[r] = _mm512_broadcast_i32x4 (keys[r]);
+
+	u64 i = 0;
+	for (; i + 0x100 <= size; i += 0x100) {
+		__m512i blocks[4];
+		for (i32 j = 0; j < 4; j++)
+			blocks[j] = _mm512_xor_si512 (_mm512_loadu_si512 (data + i + j * 0x40), wide[0]);
+		for (i32 r = 1; r < 10; r++)
+			for (i32 j = 0; j < 4; j++)
+				blocks[j] = _mm512_aesdec_epi128 (blocks[j], wide[r]);
+		for (i32 j = 0; j < 4; j++)
+			_mm512_storeu_si512 (data + i + j * 0x40, _mm512_aesdeclast_epi128 (blocks[j], wide[10]));
+	}
+
+	aes_ecb_decrypt_ni (key, data + i, size - i);
+}
+
+__attribute__ ((target ("aes,avx512f,vaes"))) static void
+aes_cbc_decrypt_vaes (const u8 *key, const u8 *iv, u8 *data, u64 size) {
+	__m128i enc[11];
+	__m128i keys[11];
+	__m512i wide[11];
+	aes_expand_key (key, enc, keys);
+	for (i32 r = 0; r < 11; r++)
+		wide[r] = _mm512_broadcast_i32x4 (keys[r]);
+
+	// Same back to front order as the AES-NI version with runs of 16 blocks
+	u64 i = size / 0x10;
+	for (; i > 16; i -= 16) {
+		u8 *chunk = data + (i - 16) * 0x10;
+		__m512i blocks[4];
+		__m512i prev[4];
+		for (i32 j = 0; j < 4; j++) {
+			prev[j]   = _mm512_loadu_si512 (chunk + j * 0x40 - 0x10);
+			blocks[j] = _mm512_xor_si512 (_mm512_loadu_si512 (chunk + j * 0x40), wide[0]);
+		}
+		for (i32 r = 1; r < 10; r++)
+			for (i32 j = 0; j < 4; j++)
+				blocks[j] = _mm512_aesdec_epi128 (blocks[j], wide[r]);
+		for (i32 j = 0; j < 4; j++)
+			_mm512_storeu_si512 (chunk + j * 0x40, _mm512_xor_si512 (_mm512_aesdeclast_epi128 (blocks[j], wide[10]), prev[j]));
+	}
+
+	aes_cbc_decrypt_blocks_ni (keys, iv, data, i);
+}
+#endif
+
+static const aes_funcs &
+aes_get_funcs () {
+	static const aes_funcs funcs = [] () -> aes_funcs {
+#ifdef __x86_64__
+		if (__builtin_cpu_supports ("vaes") && __builtin_cpu_supports ("avx512f") && __builtin_cpu_supports ("aes"))
+			return {aes_ecb_encrypt_vaes, aes_ecb_decrypt_vaes, aes_cbc_encrypt_ni, aes_cbc_decrypt_vaes};
+		if (__builtin_cpu_supports ("aes")) return {aes_ecb_encrypt_ni, aes_ecb_decrypt_ni, aes_cbc_encrypt_ni, aes_cbc_decrypt_ni};
+#endif
+		return {aes_ecb_encrypt_portable, aes_ecb_decrypt_portable, aes_cbc_encrypt_portable, aes_cbc_decrypt_portable};
+	}();
+	return funcs;
+}
+
+void
+aes_ecb_encrypt (const u8 *key, u8 *data, u64 size) {
+	aes_get_funcs ().ecb_encrypt (key, data, size);
+}
+
+void
+aes_ecb_decrypt (const u8 *key, u8 *data, u64 size) {
+	aes_get_funcs ().ecb_decrypt (key, data, size);
+}
+
+void
+aes_cbc_encrypt (const u8 *key, const u8 *iv, u8 *data, u64 size) {
+	aes_get_funcs ().cbc_encrypt (key, iv, data, size);
+}
+
+void
+aes_cbc_decrypt (const u8 *key, const u8 *iv, u8 *data, u64 size) {
+	aes_get_funcs ().cbc_decrypt (key, iv, data, size);
+}
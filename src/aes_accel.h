@@ -0,0 +1,13 @@
+#ifndef _AES_ACCEL_H
+#define _AES_ACCEL_H
+
+#include "helpers.h"
+
+// AES-128 in the modes FARC and DIVAFILE use, in place. AES-NI or VAES is picked once at runtime
+// with KKdLib's aes as the fallback. size must be a multiple of 16.
+void aes_ecb_encrypt (const u8 *key, u8 *data, u64 size);
+void aes_ecb_decrypt (const u8 *key, u8 *data, u64 size);
+void aes_cbc_encrypt (const u8 *key, const u8 *iv, u8 *data, u64 size);
+void aes_cbc_decrypt (const u8 *key, const u8 *iv, u8 *data, u64 size);
+
+#endif
@@ -0,0 +1,198 @@
+#include "atlas.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+// Top edge of the packed area over [x, x + width)
+struct atlas_skyline_node {
+	u32 x;
+	u32 y;
+	u32 width;
+};
+
+static u32
+atlas_align (u32 value, u32 alignment) {
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static u32
+atlas_pow2 (u32 value) {
+	u32 result = 1;
+	while (result < value)
+		result <<= 1;
+	return result;
+}
+
+// Lowest y a width x height area starting at node index fits at, or UINT32_MAX
+static u32
+atlas_skyline_fit (const std::vector<atlas_skyline_node> &nodes, size_t index, u32 width, u32 height, u32 size) {
+	u32 x = nodes[index].x;
+	if (x + width > size) return UINT32_MAX;
+
+	u32 y = 0;
+	for (u32 left = width; left > 0; index++) {
+		y = std::max (y, nodes[index].y);
+		if (y + height > size) return UINT32_MAX;
+		left -= std::min (left, nodes[index].width);
+	}
+	return y;
+}
+
+static void
+atlas_skyline_add (std::vector<atlas_skyline_node> &nodes, size_t index, u32 x, u32 y, u32 width, u32 height) {
+	nodes.insert (nodes.begin () + index, {x, y + height, width});
+
+	// Nodes under the new one shrink from the left or go away
+	for (size_t i = index + 1; i < nodes.size ();) {
+		if (nodes[i].x >= x + width) break;
+		u32 shrink = x + width - nodes[i].x;
+		if (shrink >= nodes[i].width) {
+			nodes.erase (nodes.begin () + i);
+			continue;
+		}
+		nodes[i].x += shrink;
+		nodes[i].width -= shrink;
+		break;
+	}
+
+	for (size_t i = 0; i + 1 < nodes.size ();) {
+		if (nodes[i].y == nodes[i + 1].y) {
+			nodes[i].width += nodes[i + 1].width;
+			nodes.erase (nodes.begin () + i + 1);
+		} else {
+			i++;
+		}
+	}
+}
+
+bool
+atlas_pack (std::vector<atlas_rect> &rects, std::vector<atlas_page> &pages, u32 max_size, u32 padding, u32 align, bool rotate) {
+	align = std::max<u32> (align, 1);
+	pages.clear ();
+	// Pages are rounded up to powers of two, any other max_size could be exceeded by that
+	if (max_size == 0 || (max_size & (max_size - 1)) != 0) return false;
+
+	// Padding past the right and bottom edge of a page costs nothing, so the skyline spans it too
+	u32 size = max_size + atlas_align (padding, align);
+	for (const auto &rect : rects)
+		if (rect.width > max_size || rect.height > max_size) return false;
+
+	// Largest first leaves the gaps for the small ones
+	std::vector<size_t> left (rects.size ());
+	for (size_t i = 0; i < left.size (); i++)
+		left[i] = i;
+	std::sort (left.begin (), left.end (), [&] (size_t a, size_t b) {
+		const atlas_rect &ra = rects[a];
+		const atlas_rect &rb = rects[b];
+		u32 la               = std::max (ra.width, ra.height);
+		u32 lb               = std::max (rb.width, rb.height);
+		if (la != lb) return la > lb;
+		return std::min (ra.width, ra.height) > std::min (rb.width, rb.height);
+	});
+
+	std::vector<atlas_skyline_node> nodes;
+	std::vector<size_t> next;
+	while (!left.empty ()) {
+		u32 page = (u32)pages.size ();
+		nodes.assign (1, {0, 0, size});
+		next.clear ();
+
+		u32 used_width  = 0;
+		u32 used_height = 0;
+		for (size_t index : left) {
+			atlas_rect &rect = rects[index];
+
+			// Bottom left: lowest top edge, then leftmost
+			size_t best_node = SIZE_MAX;
+			u32 best_top     = UINT32_MAX;
+			u32 best_x       = UINT32_MAX;
+			u32 best_y       = 0;
+			bool best_rotated = false;
+			for (i32 turn = 0; turn < (rotate && rect.width != rect.height ? 2 : 1); turn++) {
+				u32 width  = turn ? rect.height : rect.width;
+				u32 height = turn ? rect.width : rect.height;
+				u32 packed_width  = atlas_align (width + padding, align);
+				u32 packed_height = atlas_align (height + padding, align);
+				for (size_t i = 0; i < nodes.size (); i++) {
+					if (nodes[i].x + width > max_size) break;
+					u32 y = atlas_skyline_fit (nodes, i, packed_width, packed_height, size);
+					if (y == UINT32_MAX || y + height > max_size) continue;
+					if (y + packed_height < best_top || (y + packed_height == best_top && nodes[i].x < best_x)) {
+						best_node    = i;
+						best_top     = y + packed_height;
+						best_x       = nodes[i].x;
+						best_y       = y;
+						best_rotated = turn != 0;
+					}
+				}
+			}
+
+			if (best_node == SIZE_MAX) {
+				next.push_back (index);
+				continue;
+			}
+
+			rect.x       = best_x;
+			rect.y       = best_y;
+			rect.page    = page;
+			rect.rotated = best_rotated;
+			u32 width    = best_rotated ? rect.height : rect.width;
+			u32 height   = best_rotated ? rect.width : rect.height;
+			atlas_skyline_add (nodes, best_node, best_x, best_y, atlas_align (width + padding, align), atlas_align (height + padding, align));
+			used_width  = std::max (used_width, best_x + width);
+			used_height = std::max (used_height, best_y + height);
+		}
+
+		// Nothing fits an empty page, another one would not take it either
+		if (next.size () == left.size ()) return false;
+
+		pages.push_back ({atlas_pow2 (std::max (used_width, align)), atlas_pow2 (std::max (used_height, align))});
+		left.swap (next);
+	}
+
+	return true;
+}
+
+void
+atlas_blit (u8 *page, u32 page_width, const u8 *image, const atlas_rect &rect) {
+	const u32 *src = (const u32 *)image;
+	u32 *dest      = (u32 *)page + (u64)rect.y * page_width + rect.x;
+	if (!rect.rotated) {
+		for (u32 y = 0; y < rect.height; y++)
+			memcpy (dest + (u64)y * page_width, src + (u64)y * rect.width, rect.width * 4);
+		return;
+	}
+
+	// Source pixel (x, y) lands at (height - 1 - y, x)
+	u32 width  = rect.width;
+	u32 height = rect.height;
+	u32 y      = 0;
+#ifdef __x86_64__
+	// 4x4 tiles: a transpose puts source columns in registers, reversing them turns the transpose into a rotation
+	for (; y + 4 <= height; y += 4) {
+		u32 x = 0;
+		for (; x + 4 <= width; x += 4) {
+			__m128 r0 = _mm_castsi128_ps (_mm_loadu_si128 ((const __m128i *)(src + (u64)(y + 0) * width + x)));
+			__m128 r1 = _mm_castsi128_ps (_mm_loadu_si128 ((const __m128i *)(src + (u64)(y + 1) * width + x)));
+			__m128 r2 = _mm_castsi128_ps (_mm_loadu_si128 ((const __m128i *)(src + (u64)(y + 2) * width + x)));
+			__m128 r3 = _mm_castsi128_ps (_mm_loadu_si128 ((const __m128i *)(src + (u64)(y + 3) * width + x)));
+			_MM_TRANSPOSE4_PS (r0, r1, r2, r3);
+
+			u32 *out = dest + (u64)x * page_width + (height - 4 - y);
+			_mm_storeu_si128 ((__m128i *)(out + page_width * 0), _mm_shuffle_epi32 (_mm_castps_si128 (r0), _MM_SHUFFLE (0, 1, 2, 3)));
+			_mm_storeu_si128 ((__m128i *)(out + page_width * 1), _mm_shuffle_epi32 (_mm_castps_si128 (r1), _MM_SHUFFLE (0, 1, 2, 3)));
+			_mm_storeu_si128 ((__m128i *)(out + page_width * 2), _mm_shuffle_epi32 (_mm_castps_si128 (r2), _MM_SHUFFLE (0, 1, 2, 3)));
+			_mm_storeu_si128 ((__m128i *)(out + page_width * 3), _mm_shuffle_epi32 (_mm_castps_si128 (r3), _MM_SHUFFLE (0, 1, 2, 3)));
+		}
+
+		for (; x < width; x++)
+			for (u32 row = y; row < y + 4; row++)
+				dest[(u64)x * page_width + (height - 1 - row)] = src[(u64)row * width + x];
+	}
+#endif
+
+	for (; y < height; y++)
+		for (u32 x = 0; x < width; x++)
+			dest[(u64)x * page_width + (height - 1 - y)] = src[(u64)y * width + x];
+}
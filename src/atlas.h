@@ -0,0 +1,31 @@
+#ifndef _ATLAS_H
+#define _ATLAS_H
+
+#include "helpers.h"
+
+// Image placed on an atlas page. width and height are the size of the image, x and y the top left corner
+// of where it lands on the page. Rotated images are turned 90 degrees clockwise and take height x width pixels.
+struct atlas_rect {
+	u32 width;
+	u32 height;
+	u32 x;
+	u32 y;
+	u32 page;
+	bool rotated;
+};
+
+struct atlas_page {
+	u32 width;
+	u32 height;
+};
+
+// Skyline packer. Places every rect on as few pages of at most max_size x max_size as it can,
+// keeping padding pixels free right of and below every rect and starting every rect on a multiple of align.
+// Pages are shrunk to the smallest power of two sizes holding their rects. False when max_size is not a power of two
+// or a rect does not fit an empty page.
+bool atlas_pack (std::vector<atlas_rect> &rects, std::vector<atlas_page> &pages, u32 max_size, u32 padding, u32 align, bool rotate);
+
+// Copies an RGBA8 image of rect.width x rect.height to its place on an RGBA8 page page_width pixels wide
+void atlas_blit (u8 *page, u32 page_width, const u8 *image, const atlas_rect &rect);
+
+#endif
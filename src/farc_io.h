@@ -0,0 +1,204 @@
+#ifndef _FARC_IO_H
+#define _FARC_IO_H
+
+#include "helpers.h"
+#include "mapped_file.h"
+
+#include <deque>
+#include <map>
+#include <memory>
+
+// DT archives encrypt entries with AES-128-ECB, FT archives use AES-128-CBC with a random IV in front of every entry
+extern const u8 farc_dt_key[16];
+extern const u8 farc_ft_key[16];
+
+// Memory mapped archive. Opening parses only the header and entry table,
+// entries are decrypted and decompressed when their data is asked for.
+class farc_reader {
+public:
+	farc_signature signature;
+	u32 flags;
+	bool ft;
+
+	farc_reader ();
+	~farc_reader ();
+
+	// Fills f with the archive settings and one farc_file per entry, data is left null and offset points into the archive
+	bool open (const char *path, farc *f);
+
+	// Entry bytes as stored in the archive, possibly compressed and encrypted
+	const u8 *get_stored (const farc_file &file, u64 *size) const;
+
+	// Decrypts and decompresses an entry into dest, which must hold file.size bytes
+	bool read (const farc_file &file, void *dest) const;
+
+	u64 get_size () const { return map.get_size (); }
+	bool is_file (const char *path) const { return map.is_file (path); }
+
+	// Unmaps the archive, entries read afterwards fail until it is opened again
+	void close () { map.close (); }
+
+private:
+	mapped_file map;
+};
+
+// Destination of a written archive. The header is written last through write_at,
+// once offsets and sizes of all entries are known.
+class farc_sink {
+public:
+	virtual ~farc_sink () {}
+
+	virtual bool write (const void *data, u64 size) = 0;
+	virtual bool write_at (u64 offset, const void *data, u64 size) = 0;
+	// Copies size bytes at offset to dest, which is past offset, used when the reserved header was too small
+	virtual bool move (u64 offset, u64 size, u64 dest) = 0;
+};
+
+// Writes into a temporary file next to path and moves it over path on commit, so a failed write leaves the old archive.
+// Windows cannot replace a file that is still mapped, readers of path have to be closed before commit.
+class farc_file_sink : public farc_sink {
+public:
+	farc_file_sink ();
+	~farc_file_sink () override;
+
+	bool open (const char *path);
+	// Opens an existing archive to append to and patch in place, size is set to its current length
+	bool open_update (const char *path, u64 *size);
+	bool commit ();
+
+	bool write (const void *data, u64 size) override;
+	bool write_at (u64 offset, const void *data, u64 size) override;
+	bool move (u64 offset, u64 size, u64 dest) override;
+
+private:
+	FILE *file;
+	std::string path;
+	std::string temp_path;
+	bool in_place;
+};
+
+// Builds the archive in memory. reserve is the expected final size so the buffer rarely has to grow.
+class farc_memory_sink : public farc_sink {
+public:
+	std::vector<u8> data;
+	// Set when a write failed because the buffer could not grow
+	bool out_of_memory;
+
+	farc_memory_sink (u64 reserve = 0);
+
+	bool write (const void *data, u64 size) override;
+	bool write_at (u64 offset, const void *data, u64 size) override;
+	bool move (u64 offset, u64 size, u64 dest) override;
+};
+
+// Compression levels next to libdeflate's 0 to 12. The default level is the archive's compression_level.
+// Auto trial compresses part of every entry and picks a fast level for data that barely shrinks,
+// or stores it as is where the format allows uncompressed entries.
+static const i32 farc_level_default = -2;
+static const i32 farc_level_auto    = -1;
+
+// Directory of entries compressed by earlier writes, named after the payload hash, size, level, flags and layout.
+// Entries are kept as they were before encryption, FT entries still get a fresh IV every time.
+// Nothing is ever evicted, the directory only grows. Files can be deleted at any time to trim it, even while writes
+// run: entries are renamed into place whole and checked against their header when read.
+class farc_cache {
+public:
+	farc_cache (const char *path);
+
+	// Cache consulted by every write started from now on, null or empty to stop caching
+	static void set (const char *path);
+	static std::shared_ptr<farc_cache> get_current ();
+
+	// Reads the entry called name into data after prefix bytes, compressed is whether it is gzipped.
+	// False when the entry is missing or its size or hash do not match what was stored.
+	bool get (const std::string &name, std::vector<u8> &data, u64 prefix, bool *compressed) const;
+	// Stores an entry, failures only mean the next write compresses again
+	void put (const std::string &name, const u8 *data, u64 size, bool compressed) const;
+
+private:
+	std::string path;
+};
+
+struct farc_entry;
+struct farc_stream_job;
+
+// Identifies entry contents for deduplication. Payloads are hashed before compression together with
+// the flags and compression level they are written with, stored entries by the bytes as they are in the source archive.
+struct farc_payload_key {
+	u64 hash[2];
+	u64 size;
+	u32 flags;
+	i32 level;
+	bool stored;
+
+	friend auto operator<=> (const farc_payload_key &, const farc_payload_key &) = default;
+};
+
+// Writes entries as they are added. Entries are compressed on the thread pool, then encrypted and written
+// in order by the calling thread while later ones are still compressing. Only a window of entries is in memory at any time.
+// Space for the header is reserved on open and the header is written on close. Entries with the same contents
+// as an earlier one are not written again, their table entry points at the data of the first.
+class farc_stream_writer {
+public:
+	farc_stream_writer ();
+	~farc_stream_writer ();
+
+	farc_stream_writer (const farc_stream_writer &)            = delete;
+	farc_stream_writer &operator= (const farc_stream_writer &) = delete;
+
+	// f supplies the archive settings and must outlive the writer. header_size is the expected
+	// value of the header size field, if the table outgrows it the data is moved once on close.
+	bool open (farc_sink *sink, const farc *f, u64 header_size = 0x10000);
+
+	// Same as open for a sink positioned at the end of an existing archive of length size, nothing before it is written
+	// until the header on close. header_size has to be exact, the data is never moved.
+	bool open_append (farc_sink *sink, const farc *f, u64 header_size, u64 size);
+
+	// Borrows data, or file.data when it is null, until the entry is written. Entries without either are decoded from source.
+	bool add (const farc_file &file, const farc_reader *source = nullptr, const void *data = nullptr, i32 level = farc_level_default);
+	// Writes size bytes that are already compressed and encrypted for this archive, file supplies the sizes and flags
+	bool add_stored (const farc_file &file, const u8 *data, u64 size);
+	// Lists an entry that is already in the archive at file.offset
+	bool add_existing (const farc_file &file);
+	// Takes the malloc'd file.data and leaves it null
+	bool add_owned (farc_file &file, i32 level = farc_level_default);
+	// Maps the file at path as the entry contents, file supplies the name and flags
+	bool add_path (const farc_file &file, const char *path, i32 level = farc_level_default);
+
+	bool close ();
+
+private:
+	bool submit (farc_stream_job *job);
+	bool drain (u64 jobs, u64 bytes);
+	bool write_entry (const void *data, u64 size);
+	bool write_padding (u64 end);
+
+	farc_sink *sink;
+	const farc *f;
+	std::deque<farc_stream_job *> pending;
+	u64 pending_bytes;
+	std::vector<std::string> names;
+	std::vector<farc_entry> entries;
+	// Index in entries of the first entry with each payload
+	std::map<farc_payload_key, u64> payloads;
+	std::shared_ptr<farc_cache> cache;
+	u64 names_size;
+	u64 data_offset;
+	u64 offset;
+	bool failed;
+};
+
+// Writes f to sink. data, when given, holds the contents of each entry in place of file.data,
+// entries without either are decoded from source. levels, when given, holds the compression level of each entry.
+// Entries of source that were not changed are copied as they are stored when source has the same layout as f.
+bool farc_write (const farc *f, farc_sink *sink, const farc_reader *source = nullptr, const void *const *data = nullptr,
+                 const i32 *levels = nullptr);
+
+// Saves f back to path, the archive source was opened from. Unchanged entries stay where they are,
+// changed and new ones are appended and only the header is rewritten. Entries in the way of a grown table
+// are moved to the end. When more than max_waste of the file would be unused the archive is written
+// again instead, still without recompressing unchanged entries. A negative max_waste always writes it again.
+// source is closed before the new archive replaces the old one and has to be opened again afterwards.
+bool farc_update (const farc *f, farc_reader *source, const char *path, const void *const *data, const i32 *levels, double max_waste);
+
+#endif
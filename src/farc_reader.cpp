@@ -0,0 +1,192 @@
+#include "farc_io.h"
+#include "aes_accel.h"
+#include "scratch_arena.h"
+
+#include <libdeflate.h>
+
+const u8 farc_dt_key[16] = {'p', 'r', 'o', 'j', 'e', 'c', 't', '_', 'd', 'i', 'v', 'a', '.', 'b', 'i', 'n'};
+const u8 farc_ft_key[16] = {0x13, 0x72, 0xD5, 0x7B, 0x6E, 0x9E, 0x31, 0xEB, 0xA2, 0x39, 0xB8, 0x3C, 0x15, 0x57, 0xC6, 0xBB};
+
+static u32
+farc_load_u32 (const u8 *data) {
+	return ((u32)data[0] << 24) | ((u32)data[1] << 16) | ((u32)data[2] << 8) | (u32)data[3];
+}
+
+struct farc_decompressor {
+	libdeflate_decompressor *real;
+
+	farc_decompressor () : real (libdeflate_alloc_decompressor ()) {}
+	~farc_decompressor () { libdeflate_free_decompressor (real); }
+};
+
+// Reads entries of an entry table until end, FT tables carry per entry flags
+static bool
+farc_read_entries (farc *f, const u8 *data, const u8 *end, bool compressed_size, bool entry_flags, u32 count) {
+	while (data < end && f->files.size () < count) {
+		const u8 *name_end = (const u8 *)memchr (data, 0, end - data);
+		if (name_end == nullptr) return false;
+
+		u64 fields = 2 + compressed_size + entry_flags;
+		if ((u64)(end - name_end - 1) < fields * 4) return false;
+
+		farc_file &file = f->files.emplace_back ();
+		file.name.assign ((const char *)data, name_end - data);
+		data = name_end + 1;
+
+		file.offset = farc_load_u32 (data);
+		data += 4;
+		if (compressed_size) {
+			file.size_compressed = farc_load_u32 (data);
+			file.size            = farc_load_u32 (data + 4);
+			data += 8;
+		} else {
+			file.size            = farc_load_u32 (data);
+			file.size_compressed = file.size;
+			data += 4;
+		}
+
+		if (entry_flags) {
+			u32 flags = farc_load_u32 (data);
+			data += 4;
+			file.compressed = (flags & FARC_GZIP) != 0;
+			file.encrypted  = (flags & FARC_AES) != 0;
+		} else if (f->signature == FARC_FArC) {
+			file.compressed = file.size_compressed != file.size;
+			file.encrypted  = false;
+		} else {
+			file.compressed = (f->flags & FARC_GZIP) != 0;
+			file.encrypted  = (f->flags & FARC_AES) != 0;
+		}
+
+		file.data            = nullptr;
+		file.data_compressed = nullptr;
+		file.data_changed    = false;
+	}
+
+	return true;
+}
+
+farc_reader::farc_reader () : signature (FARC_FArC), flags (FARC_NONE), ft (false) {}
+
+farc_reader::~farc_reader () {}
+
+bool
+farc_reader::open (const char *path, farc *f) {
+	if (!map.open (path)) return false;
+
+	const u8 *data = map.get_data ();
+	u64 size       = map.get_size ();
+	if (size < 0x0C) return false;
+
+	u64 header_size = farc_load_u32 (data + 0x04);
+	if (header_size + 0x08 > size) return false;
+	const u8 *end = data + header_size + 0x08;
+
+	f->files.clear ();
+	f->ft = false;
+	ft    = false;
+
+	switch (farc_load_u32 (data)) {
+	case 0x46417263: // FArc
+		f->signature = FARC_FArc;
+		f->flags     = FARC_NONE;
+		f->alignment = farc_load_u32 (data + 0x08);
+		signature    = f->signature;
+		flags        = f->flags;
+		return farc_read_entries (f, data + 0x0C, end, false, false, UINT32_MAX);
+	case 0x46417243: // FArC
+		f->signature = FARC_FArC;
+		f->flags     = FARC_GZIP;
+		f->alignment = farc_load_u32 (data + 0x08);
+		signature    = f->signature;
+		flags        = f->flags;
+		return farc_read_entries (f, data + 0x0C, end, true, false, UINT32_MAX);
+	case 0x46415243: { // FARC
+		if (size < 0x14) return false;
+
+		f->signature = FARC_FARC;
+		f->flags     = (farc_flags)farc_load_u32 (data + 0x08);
+		f->alignment = farc_load_u32 (data + 0x10);
+		signature    = f->signature;
+		flags        = f->flags;
+
+		// FT archives keep an IV where DT ones keep the alignment, a random IV is practically never a power of two
+		if (!(f->flags & FARC_AES) || (f->alignment & (f->alignment - 1)) == 0)
+			return farc_read_entries (f, data + 0x14, end, true, false, UINT32_MAX);
+
+		if (header_size < 0x28 || (header_size - 0x18) % 0x10 != 0) return false;
+
+		scratch_scope scope;
+		u64 table_size = header_size - 0x18;
+		u8 *table      = scope.arena.allocate<u8> (table_size);
+		memcpy (table, data + 0x20, table_size);
+
+		aes_cbc_decrypt (farc_ft_key, data + 0x10, table, table_size);
+
+		f->alignment = farc_load_u32 (table);
+		f->ft        = farc_load_u32 (table + 0x04) == 1;
+		ft           = true;
+		return farc_read_entries (f, table + (f->ft ? 0x10 : 0x0C), table + table_size, true, f->ft, farc_load_u32 (table + 0x08));
+	}
+	default: return false;
+	}
+}
+
+const u8 *
+farc_reader::get_stored (const farc_file &file, u64 *size) const {
+	u64 length = file.compressed || file.encrypted ? file.size_compressed : file.size;
+	if (file.encrypted && !ft) length = (length + 0x0F) & ~0x0Full;
+
+	// Empty entries at the end of the archive start right where the file ends
+	if (file.offset > map.get_size () || (file.offset == map.get_size () && length > 0)) {
+		*size = 0;
+		return nullptr;
+	}
+
+	*size = std::min<u64> (length, map.get_size () - file.offset);
+	return map.get_data () + file.offset;
+}
+
+bool
+farc_reader::read (const farc_file &file, void *dest) const {
+	u64 size;
+	const u8 *data = get_stored (file, &size);
+	if (data == nullptr) return false;
+
+	if (!file.compressed && !file.encrypted) {
+		if (size < file.size) return false;
+		memcpy (dest, data, file.size);
+		return true;
+	}
+
+	scratch_scope scope;
+	if (file.encrypted) {
+		const u8 *iv = data;
+		if (ft) {
+			// Empty entries may be only the IV, other writers and older versions of this one did not pad them
+			if (size < 0x10 || (size < 0x20 && file.size > 0)) return false;
+			data += 0x10;
+			size -= 0x10;
+		}
+		size &= ~0x0Full;
+
+		u8 *decrypted = scope.arena.allocate<u8> (size);
+		memcpy (decrypted, data, size);
+		if (ft) aes_cbc_decrypt (farc_ft_key, iv, decrypted, size);
+		else aes_ecb_decrypt (farc_dt_key, decrypted, size);
+		data = decrypted;
+	}
+
+	if (!file.compressed) {
+		if (size < file.size) return false;
+		memcpy (dest, data, file.size);
+		return true;
+	}
+
+	// Encrypted entries are padded to the block size, so the gzip stream may be followed by junk
+	static thread_local farc_decompressor decompressor;
+	size_t in_size;
+	size_t out_size;
+	libdeflate_result result = libdeflate_gzip_decompress_ex (decompressor.real, data, size, dest, file.size, &in_size, &out_size);
+	return result == LIBDEFLATE_SUCCESS && out_size == file.size;
+}
@@ -0,0 +1,943 @@
+#include "farc_io.h"
+#include "aes_accel.h"
+#include "scratch_arena.h"
+#include "thread_pool.h"
+
+#include <condition_variable>
+#include <libdeflate.h>
+#include <mutex>
+#include <new>
+#include <random>
+#include <xxhash.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+// Uncompressed bytes allowed in flight, entries past this wait for the oldest one to be written
+static const u64 farc_window_size = 0x10000000;
+// Smaller entries compress faster than their cache file opens
+static const u64 farc_cache_min_size = 0x1000;
+
+enum farc_layout {
+	FARC_LAYOUT_FArc,
+	FARC_LAYOUT_FArC,
+	FARC_LAYOUT_DT,
+	FARC_LAYOUT_FT,
+};
+
+struct farc_entry {
+	u64 offset;
+	u64 size_compressed;
+	u64 size;
+	u32 flags;
+};
+
+struct farc_encoded {
+	std::vector<u8> data;
+	u64 size_compressed;
+	bool valid;
+};
+
+// libdeflate compressors are not thread safe, every worker keeps its own
+struct farc_compressor {
+	libdeflate_compressor *real;
+	i32 level;
+
+	farc_compressor () : real (nullptr), level (-1) {}
+	~farc_compressor () {
+		if (real != nullptr) libdeflate_free_compressor (real);
+	}
+
+	libdeflate_compressor *get (i32 value) {
+		value = std::clamp (value, 0, 12);
+		if (real == nullptr || level != value) {
+			if (real != nullptr) libdeflate_free_compressor (real);
+			real  = libdeflate_alloc_compressor (value);
+			level = value;
+		}
+		return real;
+	}
+};
+
+static u64
+farc_align (u64 value, u64 alignment) {
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static void
+farc_store_u32 (u8 *data, u32 value) {
+	data[0] = (u8)(value >> 24);
+	data[1] = (u8)(value >> 16);
+	data[2] = (u8)(value >> 8);
+	data[3] = (u8)value;
+}
+
+static void
+farc_random_bytes (u8 *data, size_t size) {
+	static thread_local std::mt19937 random ((std::random_device ()) ());
+	for (size_t i = 0; i < size; i++)
+		data[i] = (u8)random ();
+}
+
+static farc_layout
+farc_get_layout (const farc *f) {
+	switch (f->signature) {
+	case FARC_FArc: return FARC_LAYOUT_FArc;
+	case FARC_FArC: return FARC_LAYOUT_FArC;
+	default: return f->ft ? FARC_LAYOUT_FT : FARC_LAYOUT_DT;
+	}
+}
+
+// DT archives apply the archive flags to every entry, FArC and FT ones decide per entry
+static u32
+farc_get_entry_flags (const farc *f, farc_layout layout, const farc_file &file) {
+	switch (layout) {
+	case FARC_LAYOUT_FArc: return FARC_NONE;
+	case FARC_LAYOUT_FArC: return file.compressed ? FARC_GZIP : FARC_NONE;
+	case FARC_LAYOUT_DT: return f->flags & (FARC_GZIP | FARC_AES);
+	default: return (file.compressed ? FARC_GZIP : FARC_NONE) | (file.encrypted ? FARC_AES : FARC_NONE);
+	}
+}
+
+// Value of the header size field, the header itself is 8 bytes longer.
+// names_size counts every name with its terminator.
+static u64
+farc_get_header_size (farc_layout layout, u64 names_size, u64 count) {
+	u64 fields = layout == FARC_LAYOUT_FArc ? 0x08 : layout == FARC_LAYOUT_FT ? 0x10 : 0x0C;
+	u64 size   = names_size + count * fields;
+
+	switch (layout) {
+	case FARC_LAYOUT_FArc:
+	case FARC_LAYOUT_FArC: return 0x04 + size;
+	case FARC_LAYOUT_DT: return 0x0C + size;
+	default: return 0x18 + farc_align (0x10 + size, 0x10);
+	}
+}
+
+static void
+farc_build_header (const farc *f, farc_layout layout, const std::vector<std::string> &names, const std::vector<farc_entry> &entries, u8 *header,
+                   u64 header_size) {
+	memset (header, 0, header_size + 0x08);
+	farc_store_u32 (header, f->signature);
+	farc_store_u32 (header + 0x04, (u32)header_size);
+
+	u8 *data = header + 0x0C;
+	switch (layout) {
+	case FARC_LAYOUT_FArc:
+	case FARC_LAYOUT_FArC: farc_store_u32 (header + 0x08, f->alignment); break;
+	case FARC_LAYOUT_DT:
+		farc_store_u32 (header + 0x08, f->flags);
+		farc_store_u32 (header + 0x10, f->alignment);
+		data = header + 0x14;
+		break;
+	case FARC_LAYOUT_FT:
+		farc_store_u32 (header + 0x08, f->flags);
+		// Readers tell FT from DT by the IV not being a power of two where DT keeps its alignment
+		for (u32 value = 0; value == 0 || (value & (value - 1)) == 0;) {
+			farc_random_bytes (header + 0x10, 0x10);
+			value = ((u32)header[0x10] << 24) | ((u32)header[0x11] << 16) | ((u32)header[0x12] << 8) | header[0x13];
+		}
+		farc_store_u32 (header + 0x20, f->alignment);
+		farc_store_u32 (header + 0x24, 1);
+		farc_store_u32 (header + 0x28, (u32)entries.size ());
+		data = header + 0x30;
+		break;
+	}
+
+	for (size_t i = 0; i < entries.size (); i++) {
+		memcpy (data, names[i].c_str (), names[i].size () + 1);
+		data += names[i].size () + 1;
+
+		farc_store_u32 (data, (u32)entries[i].offset);
+		data += 4;
+		if (layout != FARC_LAYOUT_FArc) {
+			farc_store_u32 (data, (u32)entries[i].size_compressed);
+			data += 4;
+		}
+		farc_store_u32 (data, (u32)entries[i].size);
+		data += 4;
+		if (layout == FARC_LAYOUT_FT) {
+			farc_store_u32 (data, entries[i].flags);
+			data += 4;
+		}
+	}
+
+	if (layout == FARC_LAYOUT_FT) aes_cbc_encrypt (farc_ft_key, header + 0x10, header + 0x20, header_size - 0x18);
+}
+
+// Level for farc_level_auto from a few slices of the entry compressed at the fastest level, 0 when the data
+// does not compress at all. BC textures and other packed data shrink by the same few percent at every level,
+// only data that halves at the fastest level is worth the time of a slower one.
+static i32
+farc_pick_level (const u8 *src, u64 size) {
+	const u64 slice = 0x4000;
+	if (size < 0x40) return 0;
+
+	static thread_local farc_compressor sampler;
+	libdeflate_compressor *c = sampler.get (1);
+
+	u8 buffer[slice];
+	u64 count  = std::min<u64> ((size + slice - 1) / slice, 4);
+	u64 length = std::min (size, slice);
+	u64 in     = 0;
+	u64 out    = 0;
+	for (u64 i = 0; i < count; i++) {
+		u64 offset = count > 1 ? (size - length) * i / (count - 1) : 0;
+		u64 result = libdeflate_deflate_compress (c, src + offset, length, buffer, length);
+		in += length;
+		out += result != 0 ? result : length;
+	}
+
+	if (out * 100 >= in * 97) return 0;
+	if (out * 2 >= in) return 1;
+	return 6;
+}
+
+// Bytes in front of an encoded entry, FT keeps the IV there
+static u64
+farc_get_prefix (farc_layout layout, u32 flags) {
+	return layout == FARC_LAYOUT_FT && (flags & FARC_AES) ? 0x10 : 0x00;
+}
+
+// First stage, on the pool: the entry gzipped or copied after room for an FT IV,
+// with capacity left to pad it to the AES block size. FArC and FT entries that do not
+// shrink are stored uncompressed, which clears file.compressed.
+static bool
+farc_compress (const farc *f, farc_layout layout, farc_file &file, i32 level, const u8 *src, farc_encoded &out) {
+	if (level == farc_level_default) level = f->compression_level;
+
+	bool optional = layout == FARC_LAYOUT_FArC || layout == FARC_LAYOUT_FT;
+	if (farc_get_entry_flags (f, layout, file) & FARC_GZIP) {
+		if (level == farc_level_auto) level = farc_pick_level (src, file.size);
+		if (level == 0 && optional) file.compressed = false;
+		// DT archives compress every entry, so even data that does not compress gets the cheapest real level
+		else if (level == farc_level_auto || level == 0) level = 1;
+	}
+
+	u32 flags  = farc_get_entry_flags (f, layout, file);
+	u64 prefix = farc_get_prefix (layout, flags);
+	u64 size   = file.size;
+	if (flags & FARC_GZIP) {
+		static thread_local farc_compressor compressor;
+		libdeflate_compressor *c = compressor.get (level);
+
+		u64 bound = libdeflate_gzip_compress_bound (c, file.size);
+		out.data.resize (prefix + bound + 0x10);
+		size = libdeflate_gzip_compress (c, src, file.size, out.data.data () + prefix, bound);
+		if (size == 0) return false;
+
+		if (size >= file.size && optional) {
+			file.compressed = false;
+			size            = file.size;
+			if (size > 0) memcpy (out.data.data () + prefix, src, size);
+		}
+	} else {
+		out.data.resize (prefix + size + 0x10);
+		if (size > 0) memcpy (out.data.data () + prefix, src, size);
+	}
+
+	out.size_compressed = size;
+	out.data.resize (prefix + size);
+	return true;
+}
+
+// Second stage, on the thread writing the archive while the pool compresses the entries after this one.
+// DT entries record the unpadded size, FT entries are an IV followed by the padded ciphertext and record the whole length.
+static void
+farc_encrypt (const farc *f, farc_layout layout, const farc_file &file, farc_encoded &out) {
+	if (!(farc_get_entry_flags (f, layout, file) & FARC_AES)) return;
+
+	u64 prefix = layout == FARC_LAYOUT_FT ? 0x10 : 0x00;
+	u64 padded = farc_align (out.data.size () - prefix, 0x10);
+	// Empty entries stored as is still get one block after the IV, readers that always decrypt a block reject a bare IV
+	if (prefix > 0) padded = std::max<u64> (padded, 0x10);
+	out.data.resize (prefix + padded);
+
+	if (prefix > 0) {
+		farc_random_bytes (out.data.data (), 0x10);
+		aes_cbc_encrypt (farc_ft_key, out.data.data (), out.data.data () + prefix, padded);
+		out.size_compressed = prefix + padded;
+		return;
+	}
+
+	// ECB blocks are independent, large entries are split so they do not hold up the archive
+	const u64 slice = 0x100000;
+	u8 *data        = out.data.data ();
+	if (padded <= slice) aes_ecb_encrypt (farc_dt_key, data, padded);
+	else
+		thread_pool::get ().parallel_for ((padded + slice - 1) / slice, [&] (size_t i) {
+			aes_ecb_encrypt (farc_dt_key, data + i * slice, std::min (slice, padded - i * slice));
+		});
+}
+
+enum farc_job_type {
+	FARC_JOB_ENCODE,
+	FARC_JOB_STORED,
+	FARC_JOB_EXISTING,
+	FARC_JOB_DUPLICATE,
+};
+
+// An entry between add and the point it is written. file never owns data here,
+// the bytes are data, the mapping or the source archive.
+struct farc_stream_job {
+	farc_job_type type;
+	farc_file file;
+	const void *data;
+	void *owned;
+	mapped_file map;
+	const farc_reader *source;
+	u64 stored_size;
+	i32 level;
+	// Index in the writer's entries of the entry a duplicate shares its data with
+	u64 original;
+	// XXH3 of the contents, set on add when they are known by then
+	XXH128_hash_t hash;
+	bool hashed;
+	farc_encoded encoded;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool done;
+
+	farc_stream_job (const farc_file &info, farc_job_type type)
+	    : type (type), data (nullptr), owned (nullptr), source (nullptr), stored_size (0), level (farc_level_default), original (0), hashed (false), done (false) {
+		file.name            = info.name;
+		file.offset          = info.offset;
+		file.size            = info.size;
+		file.size_compressed = info.size_compressed;
+		file.compressed      = info.compressed;
+		file.encrypted       = info.encrypted;
+	}
+
+	~farc_stream_job () { free (owned); }
+};
+
+// Name of the cache entry for the contents of job compressed with level
+static std::string
+farc_get_cache_name (const farc *f, farc_layout layout, const farc_stream_job *job, i32 level) {
+	char name[0x80];
+	snprintf (name, sizeof (name), "%016llx%016llx_%llx_%d_%x_%d", (unsigned long long)job->hash.high64, (unsigned long long)job->hash.low64,
+	          (unsigned long long)job->file.size, level, farc_get_entry_flags (f, layout, job->file), layout);
+	return name;
+}
+
+static void
+farc_stream_job_encode (const farc *f, const farc_cache *cache, farc_stream_job *job) {
+	scratch_scope scope;
+	const u8 *src = (const u8 *)job->data;
+	bool valid    = true;
+	if (src == nullptr && job->file.size > 0) {
+		u8 *buffer = scope.arena.allocate<u8> (job->file.size);
+		valid      = job->source != nullptr && job->file.offset != 0 && job->source->read (job->file, buffer);
+		src        = buffer;
+	}
+
+	// Only gzipped entries are worth caching, anything else is a copy
+	farc_layout layout = farc_get_layout (f);
+	i32 level          = job->level == farc_level_default ? f->compression_level : job->level;
+	u32 flags          = farc_get_entry_flags (f, layout, job->file);
+	std::string name;
+	if (valid && cache != nullptr && job->file.size >= farc_cache_min_size && (flags & FARC_GZIP)) {
+		if (!job->hashed) job->hash = XXH3_128bits (src, job->file.size);
+		name = farc_get_cache_name (f, layout, job, level);
+
+		bool compressed;
+		if (cache->get (name, job->encoded.data, farc_get_prefix (layout, flags), &compressed)) {
+			job->file.compressed         = compressed;
+			job->encoded.size_compressed = job->encoded.data.size () - farc_get_prefix (layout, flags);
+			job->encoded.valid           = true;
+			return;
+		}
+	}
+
+	job->encoded.valid = valid && farc_compress (f, layout, job->file, level, src, job->encoded);
+	if (job->encoded.valid && !name.empty ()) {
+		u64 prefix = farc_get_prefix (layout, flags);
+		cache->put (name, job->encoded.data.data () + prefix, job->encoded.data.size () - prefix, job->file.compressed);
+	}
+}
+
+static void
+farc_stream_job_run (const farc *f, const farc_cache *cache, farc_stream_job *job) {
+	// Runs on the pool, running out of memory fails the entry and with it the write
+	try {
+		farc_stream_job_encode (f, cache, job);
+	} catch (const std::bad_alloc &) {
+		job->encoded.valid = false;
+	}
+
+	std::lock_guard<std::mutex> lock (job->mutex);
+	job->done = true;
+	job->cond.notify_all ();
+}
+
+farc_stream_writer::farc_stream_writer ()
+    : sink (nullptr), f (nullptr), pending_bytes (0), names_size (0), data_offset (0), offset (0), failed (true) {}
+
+farc_stream_writer::~farc_stream_writer () {
+	// Entries still on the pool point at this writer, wait for them without writing anything
+	failed = true;
+	drain (0, 0);
+}
+
+bool
+farc_stream_writer::open (farc_sink *sink, const farc *f, u64 header_size) {
+	this->sink = sink;
+	this->f    = f;
+	names.clear ();
+	entries.clear ();
+	payloads.clear ();
+	cache = farc_cache::get_current ();
+	names_size    = 0;
+	pending_bytes = 0;
+	data_offset   = farc_align (header_size + 0x08, std::max<u64> (f->alignment, 1));
+	offset        = data_offset;
+
+	std::vector<u8> header (data_offset);
+	failed = !sink->write (header.data (), header.size ());
+	return !failed;
+}
+
+bool
+farc_stream_writer::open_append (farc_sink *sink, const farc *f, u64 header_size, u64 size) {
+	this->sink = sink;
+	this->f    = f;
+	names.clear ();
+	entries.clear ();
+	payloads.clear ();
+	cache = farc_cache::get_current ();
+	names_size    = 0;
+	pending_bytes = 0;
+	data_offset   = farc_align (header_size + 0x08, std::max<u64> (f->alignment, 1));
+	offset        = size;
+
+	// A table that outgrew the old archive ends past its last byte, appended entries go after the table
+	failed = !write_padding (farc_align (std::max (size, data_offset), std::max<u64> (f->alignment, 1)));
+	return !failed;
+}
+
+bool
+farc_stream_writer::add (const farc_file &file, const farc_reader *source, const void *data, i32 level) {
+	farc_stream_job *job = new farc_stream_job (file, FARC_JOB_ENCODE);
+	job->data            = data != nullptr ? data : file.data;
+	job->source          = source;
+	job->level           = level;
+	return submit (job);
+}
+
+bool
+farc_stream_writer::add_owned (farc_file &file, i32 level) {
+	farc_stream_job *job = new farc_stream_job (file, FARC_JOB_ENCODE);
+	job->owned           = file.data;
+	job->data            = file.data;
+	job->level           = level;
+	file.data            = nullptr;
+	return submit (job);
+}
+
+bool
+farc_stream_writer::add_path (const farc_file &file, const char *path, i32 level) {
+	farc_stream_job *job = new farc_stream_job (file, FARC_JOB_ENCODE);
+	job->level           = level;
+	if (!job->map.open (path)) {
+		delete job;
+		failed = true;
+		return false;
+	}
+
+	job->data      = job->map.get_data ();
+	job->file.size = job->map.get_size ();
+	return submit (job);
+}
+
+bool
+farc_stream_writer::add_stored (const farc_file &file, const u8 *data, u64 size) {
+	farc_stream_job *job = new farc_stream_job (file, FARC_JOB_STORED);
+	job->data            = data;
+	job->stored_size     = size;
+	return submit (job);
+}
+
+bool
+farc_stream_writer::add_existing (const farc_file &file) {
+	return submit (new farc_stream_job (file, FARC_JOB_EXISTING));
+}
+
+bool
+farc_stream_writer::submit (farc_stream_job *job) {
+	// Contents are known up front unless they still have to be decoded from a source archive
+	bool known = job->type == FARC_JOB_ENCODE ? job->data != nullptr || job->file.size == 0 : job->type == FARC_JOB_STORED;
+	if (known) {
+		farc_payload_key key = {};
+		key.size             = job->type == FARC_JOB_STORED ? job->stored_size : job->file.size;
+		key.flags            = farc_get_entry_flags (f, farc_get_layout (f), job->file);
+		// Stored entries without compression or encryption are the payload itself
+		key.stored = job->type == FARC_JOB_STORED && key.flags != FARC_NONE;
+		// Copies asking for another level are compressed again so each entry gets the level it asked for
+		if (job->type == FARC_JOB_ENCODE && (key.flags & FARC_GZIP))
+			key.level = job->level == farc_level_default ? f->compression_level : job->level;
+
+		XXH128_hash_t hash = XXH3_128bits (job->data, key.size);
+		key.hash[0]        = hash.low64;
+		key.hash[1]        = hash.high64;
+		job->hash          = hash;
+		job->hashed        = true;
+
+		auto [it, inserted] = payloads.try_emplace (key, names.size ());
+		if (!inserted) {
+			job->type     = FARC_JOB_DUPLICATE;
+			job->original = it->second;
+			free (job->owned);
+			job->owned = nullptr;
+		}
+	}
+
+	names.push_back (job->file.name);
+	names_size += job->file.name.size () + 1;
+	pending.push_back (job);
+
+	// Stored and existing entries need no work, they only keep their place in the order
+	if (job->type == FARC_JOB_ENCODE) {
+		pending_bytes += job->file.size;
+		const farc *f           = this->f;
+		const farc_cache *cache = this->cache.get ();
+		thread_pool::get ().enqueue ([f, cache, job] () { farc_stream_job_run (f, cache, job); });
+	} else {
+		job->done = true;
+	}
+	return drain (thread_pool::get ().get_concurrency () * 2, farc_window_size);
+}
+
+// Writes an entry at offset followed by padding up to the alignment
+bool
+farc_stream_writer::write_entry (const void *data, u64 size) {
+	if (size > 0 && !sink->write (data, size)) return false;
+	offset += size;
+
+	// Offsets and sizes are 32 bit in every version of the format
+	return write_padding (farc_align (offset, std::max<u64> (f->alignment, 1))) && offset <= UINT32_MAX;
+}
+
+// Zeros up to end
+bool
+farc_stream_writer::write_padding (u64 end) {
+	static const u8 padding[0x100] = {};
+
+	for (u64 left = end - offset; left > 0; left -= std::min<u64> (left, sizeof (padding)))
+		if (!sink->write (padding, std::min<u64> (left, sizeof (padding)))) return false;
+	offset = end;
+	return true;
+}
+
+// Writes finished entries in order, waiting on the oldest one while more than jobs entries or bytes are in flight
+bool
+farc_stream_writer::drain (u64 jobs, u64 bytes) {
+	while (!pending.empty ()) {
+		farc_stream_job *job = pending.front ();
+		{
+			std::unique_lock<std::mutex> lock (job->mutex);
+			if (!job->done && pending.size () <= jobs && pending_bytes <= bytes) break;
+			job->cond.wait (lock, [job] () { return job->done; });
+		}
+		pending.pop_front ();
+		if (job->type == FARC_JOB_ENCODE) pending_bytes -= job->file.size;
+
+		if (!failed && job->type == FARC_JOB_ENCODE && !job->encoded.valid) failed = true;
+		if (!failed) {
+			farc_entry entry;
+			entry.offset          = offset;
+			entry.size_compressed = job->file.size_compressed;
+			entry.size            = job->file.size;
+			entry.flags           = farc_get_entry_flags (f, farc_get_layout (f), job->file);
+
+			switch (job->type) {
+			case FARC_JOB_ENCODE:
+				farc_encrypt (f, farc_get_layout (f), job->file, job->encoded);
+				entry.size_compressed = job->encoded.size_compressed;
+				failed                = !write_entry (job->encoded.data.data (), job->encoded.data.size ());
+				break;
+			case FARC_JOB_STORED: failed = !write_entry (job->data, job->stored_size); break;
+			case FARC_JOB_EXISTING: entry.offset = job->file.offset; break;
+			case FARC_JOB_DUPLICATE: entry = entries[job->original]; break;
+			}
+
+			entries.push_back (entry);
+			if (entry.size > UINT32_MAX || entry.size_compressed > UINT32_MAX) failed = true;
+		}
+
+		delete job;
+	}
+
+	return !failed;
+}
+
+bool
+farc_stream_writer::close () {
+	if (!drain (0, 0)) return false;
+
+	farc_layout layout = farc_get_layout (f);
+	u64 header_size    = farc_get_header_size (layout, names_size, names.size ());
+	u64 start          = farc_align (header_size + 0x08, std::max<u64> (f->alignment, 1));
+	if (start > data_offset) {
+		if (!sink->move (data_offset, offset - data_offset, start)) return false;
+		for (auto &entry : entries)
+			entry.offset += start - data_offset;
+		offset += start - data_offset;
+		if (offset > UINT32_MAX) return false;
+	}
+
+	std::vector<u8> header (header_size + 0x08);
+	farc_build_header (f, layout, names, entries, header.data (), header_size);
+	failed = true;
+	return sink->write_at (0, header.data (), header.size ());
+}
+
+// Whether entries stored in source can be copied as they are into an archive with the settings of f
+static bool
+farc_can_copy (const farc *f, const farc_reader *source) {
+	if (source == nullptr || source->signature != f->signature) return false;
+
+	switch (farc_get_layout (f)) {
+	case FARC_LAYOUT_DT: return !source->ft && source->flags == (u32)f->flags;
+	case FARC_LAYOUT_FT: return source->ft;
+	default: return true;
+	}
+}
+
+static bool
+farc_is_stored (const farc_file &file, const farc_reader *source) {
+	return source != nullptr && file.offset != 0 && !file.data_changed;
+}
+
+static u64
+farc_get_header_size (const farc *f) {
+	u64 names_size = 0;
+	for (const auto &file : f->files)
+		names_size += file.name.size () + 1;
+	return farc_get_header_size (farc_get_layout (f), names_size, f->files.size ());
+}
+
+bool
+farc_write (const farc *f, farc_sink *sink, const farc_reader *source, const void *const *data, const i32 *levels) {
+	bool copy = farc_can_copy (f, source);
+
+	farc_stream_writer writer;
+	if (!writer.open (sink, f, farc_get_header_size (f))) return false;
+	for (size_t i = 0; i < f->files.size (); i++) {
+		const farc_file &file = f->files[i];
+		if (copy && farc_is_stored (file, source)) {
+			u64 size;
+			const u8 *stored = source->get_stored (file, &size);
+			if (stored == nullptr || !writer.add_stored (file, stored, size)) return false;
+		} else if (!writer.add (file, source, data != nullptr ? data[i] : nullptr, levels != nullptr ? levels[i] : farc_level_default)) {
+			return false;
+		}
+	}
+	return writer.close ();
+}
+
+bool
+farc_update (const farc *f, farc_reader *source, const char *path, const void *const *data, const i32 *levels, double max_waste) {
+	if (source == nullptr) return false;
+
+	u64 alignment   = std::max<u64> (f->alignment, 1);
+	u64 header_size = farc_get_header_size (f);
+	u64 start       = farc_align (header_size + 0x08, alignment);
+
+	// Space used by entries that stay, anything else in the file is left over from replaced entries.
+	// Entries may share their data, it only counts once.
+	std::map<u64, u64> stored;
+	for (const auto &file : f->files) {
+		if (!farc_is_stored (file, source)) continue;
+
+		u64 size;
+		if (source->get_stored (file, &size) == nullptr) return false;
+		stored[file.offset] = farc_align (size, alignment);
+	}
+
+	u64 live = 0;
+	for (const auto &[offset, size] : stored)
+		live += size;
+
+	u64 size = source->get_size ();
+	if (!farc_can_copy (f, source) || size - std::min (size, start + live) > max_waste * size) {
+		farc_file_sink sink;
+		if (!sink.open (path) || !farc_write (f, &sink, source, data, levels)) return false;
+		source->close ();
+		return sink.commit ();
+	}
+
+	farc_file_sink sink;
+	farc_stream_writer writer;
+	if (!sink.open_update (path, &size) || !writer.open_append (&sink, f, header_size, size)) return false;
+	for (size_t i = 0; i < f->files.size (); i++) {
+		const farc_file &file = f->files[i];
+		bool result;
+		if (!farc_is_stored (file, source))
+			result = writer.add (file, source, data != nullptr ? data[i] : nullptr, levels != nullptr ? levels[i] : farc_level_default);
+		else if (file.offset >= start) result = writer.add_existing (file);
+		else {
+			u64 stored_size;
+			const u8 *stored = source->get_stored (file, &stored_size);
+			result           = stored != nullptr && writer.add_stored (file, stored, stored_size);
+		}
+		if (!result) return false;
+	}
+
+	// The header goes in last, until then the file still reads as the old archive
+	return writer.close () && sink.commit ();
+}
+
+#ifdef _WIN32
+static std::wstring
+farc_widen (const std::string &path) {
+	std::wstring wpath (MultiByteToWideChar (CP_UTF8, 0, path.c_str (), -1, nullptr, 0), L'\0');
+	MultiByteToWideChar (CP_UTF8, 0, path.c_str (), -1, wpath.data (), (int)wpath.size ());
+	return wpath;
+}
+#endif
+
+static bool
+farc_seek (FILE *file, u64 offset, int origin) {
+#ifdef _WIN32
+	return _fseeki64 (file, offset, origin) == 0;
+#else
+	return fseeko (file, offset, origin) == 0;
+#endif
+}
+
+farc_file_sink::farc_file_sink () : file (nullptr), in_place (false) {}
+
+farc_file_sink::~farc_file_sink () {
+	if (file == nullptr) return;
+
+	fclose (file);
+	if (in_place) return;
+#ifdef _WIN32
+	DeleteFileW (farc_widen (temp_path).c_str ());
+#else
+	remove (temp_path.c_str ());
+#endif
+}
+
+bool
+farc_file_sink::open (const char *path) {
+	this->path.assign (path);
+	temp_path = this->path + ".tmp";
+
+#ifdef _WIN32
+	file = _wfopen (farc_widen (temp_path).c_str (), L"w+b");
+#else
+	file = fopen (temp_path.c_str (), "w+b");
+#endif
+	return file != nullptr;
+}
+
+bool
+farc_file_sink::open_update (const char *path, u64 *size) {
+	this->path.assign (path);
+	in_place = true;
+
+#ifdef _WIN32
+	file = _wfopen (farc_widen (this->path).c_str (), L"r+b");
+#else
+	file = fopen (path, "r+b");
+#endif
+	if (file == nullptr || !farc_seek (file, 0, SEEK_END)) return false;
+
+#ifdef _WIN32
+	*size = _ftelli64 (file);
+#else
+	*size = ftello (file);
+#endif
+	return true;
+}
+
+bool
+farc_file_sink::commit () {
+	if (file == nullptr) return false;
+
+	bool result = fclose (file) == 0;
+	file        = nullptr;
+	if (in_place) return result;
+
+#ifdef _WIN32
+	if (result) result = MoveFileExW (farc_widen (temp_path).c_str (), farc_widen (path).c_str (), MOVEFILE_REPLACE_EXISTING) != 0;
+	if (!result) DeleteFileW (farc_widen (temp_path).c_str ());
+#else
+	if (result) result = rename (temp_path.c_str (), path.c_str ()) == 0;
+	if (!result) remove (temp_path.c_str ());
+#endif
+	return result;
+}
+
+bool
+farc_file_sink::write (const void *data, u64 size) {
+	return size == 0 || fwrite (data, 1, size, file) == size;
+}
+
+bool
+farc_file_sink::write_at (u64 offset, const void *data, u64 size) {
+	if (!farc_seek (file, offset, SEEK_SET)) return false;
+	bool result = write (data, size);
+	return farc_seek (file, 0, SEEK_END) && result;
+}
+
+bool
+farc_file_sink::move (u64 offset, u64 size, u64 dest) {
+	// Back to front, the ranges overlap whenever the header grew by less than the data size
+	std::vector<u8> buffer (std::min<u64> (size, 0x400000));
+	for (u64 left = size; left > 0;) {
+		u64 chunk = std::min<u64> (left, buffer.size ());
+		left -= chunk;
+		if (!farc_seek (file, offset + left, SEEK_SET) || fread (buffer.data (), 1, chunk, file) != chunk) return false;
+		if (!write_at (dest + left, buffer.data (), chunk)) return false;
+	}
+	return true;
+}
+
+farc_memory_sink::farc_memory_sink (u64 reserve) : out_of_memory (false) {
+	// Only a hint, growing later reports the failure
+	try {
+		data.reserve (reserve);
+	} catch (const std::bad_alloc &) {
+	}
+}
+
+bool
+farc_memory_sink::write (const void *data, u64 size) {
+	try {
+		this->data.insert (this->data.end (), (const u8 *)data, (const u8 *)data + size);
+	} catch (const std::bad_alloc &) {
+		out_of_memory = true;
+		return false;
+	}
+	return true;
+}
+
+bool
+farc_memory_sink::write_at (u64 offset, const void *data, u64 size) {
+	try {
+		if (offset + size > this->data.size ()) this->data.resize (offset + size);
+	} catch (const std::bad_alloc &) {
+		out_of_memory = true;
+		return false;
+	}
+	memcpy (this->data.data () + offset, data, size);
+	return true;
+}
+
+bool
+farc_memory_sink::move (u64 offset, u64 size, u64 dest) {
+	try {
+		if (dest + size > data.size ()) data.resize (dest + size);
+	} catch (const std::bad_alloc &) {
+		out_of_memory = true;
+		return false;
+	}
+	memmove (data.data () + dest, data.data () + offset, size);
+	return true;
+}
+
+static std::mutex farc_cache_mutex;
+static std::shared_ptr<farc_cache> farc_cache_current;
+
+farc_cache::farc_cache (const char *path) : path (path) {}
+
+void
+farc_cache::set (const char *path) {
+	std::lock_guard<std::mutex> lock (farc_cache_mutex);
+	if (path != nullptr && *path != '\0') farc_cache_current = std::make_shared<farc_cache> (path);
+	else farc_cache_current.reset ();
+}
+
+std::shared_ptr<farc_cache>
+farc_cache::get_current () {
+	std::lock_guard<std::mutex> lock (farc_cache_mutex);
+	return farc_cache_current;
+}
+
+static FILE *
+farc_cache_open (const std::string &path, const char *mode) {
+#ifdef _WIN32
+	return _wfopen (farc_widen (path).c_str (), farc_widen (mode).c_str ());
+#else
+	return fopen (path.c_str (), mode);
+#endif
+}
+
+// A cache entry is this header followed by the entry as farc_compress left it. The size and hash cover
+// the bytes after the header, so truncated or damaged files are compressed again instead of being written out.
+struct farc_cache_header {
+	u8 magic[4];
+	u32 compressed;
+	u64 size;
+	u64 hash[2];
+};
+
+static const u8 farc_cache_magic[4] = {'F', 'C', 'E', '1'};
+
+bool
+farc_cache::get (const std::string &name, std::vector<u8> &data, u64 prefix, bool *compressed) const {
+	FILE *file = farc_cache_open (path + "/" + name, "rb");
+	if (file == nullptr) return false;
+
+	farc_cache_header header = {};
+	bool valid = fread (&header, sizeof (header), 1, file) == 1 && memcmp (header.magic, farc_cache_magic, sizeof (farc_cache_magic)) == 0 &&
+	             header.compressed <= 1 && farc_seek (file, 0, SEEK_END);
+#ifdef _WIN32
+	i64 size = valid ? _ftelli64 (file) - (i64)sizeof (header) : -1;
+#else
+	i64 size = valid ? ftello (file) - (i64)sizeof (header) : -1;
+#endif
+	// The recorded size is checked against the file before anything is allocated for it
+	if (size >= 0 && (u64)size == header.size && farc_seek (file, sizeof (header), SEEK_SET)) {
+		// Same room for padding as farc_compress leaves
+		data.resize (prefix + size + 0x10);
+		valid = fread (data.data () + prefix, 1, size, file) == (u64)size;
+		data.resize (prefix + size);
+
+		XXH128_hash_t hash = XXH3_128bits (data.data () + prefix, size);
+		valid              = valid && hash.low64 == header.hash[0] && hash.high64 == header.hash[1];
+	} else {
+		valid = false;
+	}
+	fclose (file);
+
+	*compressed = header.compressed == 1;
+	return valid;
+}
+
+void
+farc_cache::put (const std::string &name, const u8 *data, u64 size, bool compressed) const {
+	// Written under a name of its own and renamed, so concurrent builds never read half an entry
+	u8 random[8];
+	farc_random_bytes (random, sizeof (random));
+	char suffix[0x20];
+	snprintf (suffix, sizeof (suffix), ".%02x%02x%02x%02x%02x%02x%02x%02x.tmp", random[0], random[1], random[2], random[3], random[4], random[5],
+	          random[6], random[7]);
+	std::string temp_path = path + "/" + name + suffix;
+
+	FILE *file = farc_cache_open (temp_path, "wb");
+	if (file == nullptr) return;
+
+	farc_cache_header header = {};
+	XXH128_hash_t hash       = XXH3_128bits (data, size);
+	memcpy (header.magic, farc_cache_magic, sizeof (farc_cache_magic));
+	header.compressed = compressed ? 1 : 0;
+	header.size       = size;
+	header.hash[0]    = hash.low64;
+	header.hash[1]    = hash.high64;
+
+	bool result = fwrite (&header, sizeof (header), 1, file) == 1 && (size == 0 || fwrite (data, 1, size, file) == size);
+	result      = fclose (file) == 0 && result;
+
+#ifdef _WIN32
+	if (result) result = MoveFileExW (farc_widen (temp_path).c_str (), farc_widen (path + "/" + name).c_str (), MOVEFILE_REPLACE_EXISTING) != 0;
+	if (!result) DeleteFileW (farc_widen (temp_path).c_str ());
+#else
+	if (result) result = rename (temp_path.c_str (), (path + "/" + name).c_str ()) == 0;
+	if (!result) remove (temp_path.c_str ());
+#endif
+}
@@ -8,6 +8,8 @@
 #include <algorithm>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <stdbool.h>
@@ -1,24 +1,64 @@
-#include "BC.h"
+#include "atlas.h"
+#include "farc_io.h"
 #include "helpers.h"
-
+#include "scratch_arena.h"
+#include "texture.h"
+#include "thread_pool.h"
+#include <shared_mutex>
+
+struct pyobject_farc;
+static i64 py_farc_resolve_file (pyobject_farc *self, u64 index, const std::string &name);
+static PyObject *py_farc_get_data (pyobject_farc *self, u64 index);
+static PyObject *py_farc_get_bytes (pyobject_farc *self, u64 index);
+
+// Contents are kept as a bytes object in data, real->data stays null so KKdLib never frees or copies it.
+// Files returned by farc.files have no data of their own and go through their parent archive instead.
 struct pyobject_farc_file {
 	PyObject_HEAD;
 	farc_file *real;
+	PyObject *data;
+	pyobject_farc *parent;
+	u64 index;
+	// Compression level used when the file is written, farc_level_default for the archive's
+	i32 level;
 };
 
+// A libdeflate level or farc_level_auto, None stands for farc_level_default where allow_default is set
+static bool
+py_farc_parse_level (PyObject *value, bool allow_default, i32 *level) {
+	if (value == Py_None && allow_default) {
+		*level = farc_level_default;
+		return true;
+	}
+
+	if (value != nullptr && PyLong_Check (value)) {
+		long result = PyLong_AsLong (value);
+		if (PyErr_Occurred ()) return false;
+		if (result >= farc_level_auto && result <= 12) {
+			*level = result;
+			return true;
+		}
+	}
+
+	PyErr_SetString (PyExc_ValueError, "Compression level must be -1 for auto or 0 to 12");
+	return false;
+}
+
 static int
 py_farc_file_init (pyobject_farc_file *self, PyObject *args, PyObject *kwds) {
 	const char *name = "DEFAULT";
 	PyObject *data   = nullptr;
-	char *kwlist[]   = {"name", "data", nullptr};
-	if (!PyArg_ParseTupleAndKeywords (args, kwds, "|sO!", kwlist, &name, &PyBytes_Type, &data)) return -1;
+	PyObject *level  = Py_None;
+	char *kwlist[]   = {"name", "data", "compression_level", nullptr};
+	if (!PyArg_ParseTupleAndKeywords (args, kwds, "|sO!O", kwlist, &name, &PyBytes_Type, &data, &level)) return -1;
+	if (!py_farc_parse_level (level, true, &self->level)) return -1;
 	self->real = new farc_file;
 
 	self->real->name.assign (name);
 	if (data != nullptr && PyBytes_Check (data)) {
+		Py_INCREF (data);
+		self->data       = data;
 		self->real->size = PyBytes_Size (data);
-		self->real->data = malloc (self->real->size);
-		memcpy (self->real->data, PyBytes_AsString (data), self->real->size);
 	}
 
 	return 0;
@@ -27,6 +67,36 @@ py_farc_file_init (pyobject_farc_file *self, PyObject *args, PyObject *kwds) {
 void
 py_farc_file_finalize (pyobject_farc_file *self) {
 	delete self->real;
+	Py_CLEAR (self->data);
+	Py_CLEAR (self->parent);
+}
+
+// Everything but the data, which stays with whoever owns it
+static void
+py_farc_file_copy_info (farc_file *dest, const farc_file *src) {
+	dest->name.assign (src->name);
+	dest->offset          = src->offset;
+	dest->size            = src->size;
+	dest->size_compressed = src->size_compressed;
+	dest->compressed      = src->compressed;
+	dest->encrypted       = src->encrypted;
+	dest->data_changed    = src->data_changed;
+}
+
+// New reference to the contents as bytes, None when there are none
+static PyObject *
+py_farc_file_get_bytes (pyobject_farc_file *self) {
+	if (self->data != nullptr) {
+		Py_INCREF (self->data);
+		return self->data;
+	}
+	if (self->parent != nullptr) {
+		i64 index = py_farc_resolve_file (self->parent, self->index, self->real->name);
+		if (index < 0) return nullptr;
+		self->index = index;
+		return py_farc_get_bytes (self->parent, index);
+	}
+	Py_RETURN_NONE;
 }
 
 static PyObject *
@@ -46,6 +116,15 @@ py_farc_file_set_name (pyobject_farc_file *self, PyObject *value, void *closure)
 		return -1;
 	}
 
+	// Files from farc.files find their contents by name, take them along before it changes
+	if (self->parent != nullptr && self->data == nullptr) {
+		PyObject *data = py_farc_file_get_bytes (self);
+		if (data == nullptr) return -1;
+		if (data != Py_None) self->data = data;
+		else Py_DECREF (data);
+	}
+	Py_CLEAR (self->parent);
+
 	PyObject *bytes = PyUnicode_AsUTF8String (value);
 	self->real->name.assign (PyBytes_AsString (bytes));
 	Py_DECREF (bytes);
@@ -53,6 +132,18 @@ py_farc_file_set_name (pyobject_farc_file *self, PyObject *value, void *closure)
 	return 0;
 }
 
+static PyObject *
+py_farc_file_get_data (pyobject_farc_file *self, void *closure) {
+	if (self->data != nullptr) return PyMemoryView_FromObject (self->data);
+	if (self->parent != nullptr) {
+		i64 index = py_farc_resolve_file (self->parent, self->index, self->real->name);
+		if (index < 0) return nullptr;
+		self->index = index;
+		return py_farc_get_data (self->parent, index);
+	}
+	Py_RETURN_NONE;
+}
+
 static int
 py_farc_file_set_data (pyobject_farc_file *self, PyObject *value, void *closure) {
 	if (value == nullptr || !PyBytes_Check (value)) {
@@ -60,16 +151,33 @@ py_farc_file_set_data (pyobject_farc_file *self, PyObject *value, void *closure)
 		return -1;
 	}
 
+	PyObject *old = self->data;
+	Py_INCREF (value);
+	self->data       = value;
 	self->real->size = PyBytes_Size (value);
-	self->real->data = malloc (self->real->size);
-	memcpy (self->real->data, PyBytes_AsString (value), self->real->size);
+	Py_XDECREF (old);
+	Py_CLEAR (self->parent);
 
 	return 0;
 }
 
-static PyGetSetDef pygetsets_farc_file[] = {{"name", (getter)py_farc_file_get_name, (setter)py_farc_file_set_name, "Name", nullptr},
-                                            {"data", nullptr, (setter)py_farc_file_set_data, "File data", nullptr},
-                                            {nullptr}};
+static PyObject *
+py_farc_file_get_compression_level (pyobject_farc_file *self, void *closure) {
+	if (self->level == farc_level_default) Py_RETURN_NONE;
+	return PyLong_FromLong (self->level);
+}
+
+static int
+py_farc_file_set_compression_level (pyobject_farc_file *self, PyObject *value, void *closure) {
+	return py_farc_parse_level (value, true, &self->level) ? 0 : -1;
+}
+
+static PyGetSetDef pygetsets_farc_file[] = {
+    {"name", (getter)py_farc_file_get_name, (setter)py_farc_file_set_name, "Name", nullptr},
+    {"data", (getter)py_farc_file_get_data, (setter)py_farc_file_set_data, "File data", nullptr},
+    {"compression_level", (getter)py_farc_file_get_compression_level, (setter)py_farc_file_set_compression_level,
+     "Compression level, None for the archive's and -1 for auto", nullptr},
+    {nullptr}};
 
 static PyType_Slot pyslots_farc_file[] = {
     {Py_tp_repr, (void *)pyrepr_farc_file},
@@ -84,45 +192,164 @@ PYTHON_TYPE_DEF (farc_file);
 struct pyobject_farc {
 	PyObject_HEAD;
 	farc *real;
+	// Bytes object with the contents of each entry, null where the entry still lives in the archive.
+	// The farc_file data pointers themselves stay null.
+	std::vector<PyObject *> *data;
+	// Compression level of each entry, farc_level_default for the archive's
+	std::vector<i32> *levels;
+	// Index of the first entry with each name, built on the first lookup and cleared when entries move
+	std::unordered_map<std::string, u64> *names;
+	// Set when opened from a path, entries with null data and a non zero offset still live in the archive
+	farc_reader *reader;
+	PyObject *path;
+	// Python mmap of the archive, created the first time a stored entry is viewed
+	PyObject *map;
+	// Never held while waiting for the GIL. Shared while the reader is used without the GIL,
+	// exclusive while update rewrites the archive and reopens the reader with the GIL held.
+	std::shared_mutex *lock;
+	// Bumped by update, entries copied before it have offsets into the old archive
+	u64 generation;
 };
 
-static int
-py_farc_init (pyobject_farc *self, PyObject *args, PyObject *kwds) {
-	const char *signature = "FArC";
-	bool ft               = true;
-	char *kwlist[]        = {"signature", "ft", nullptr};
-	if (!PyArg_ParseTupleAndKeywords (args, kwds, "|sb", kwlist, &signature, &ft)) return -1;
-
-	self->real = new farc;
-
+static bool
+py_farc_set_signature (farc *f, const char *signature, bool ft) {
 	if (strcmp (signature, "FArc") == 0) {
-		self->real->signature = FARC_FArc;
-		self->real->flags     = FARC_NONE;
+		f->signature = FARC_FArc;
+		f->flags     = FARC_NONE;
 	} else if (strcmp (signature, "FArC") == 0) {
-		self->real->signature = FARC_FArC;
-		self->real->flags     = FARC_GZIP;
+		f->signature = FARC_FArC;
+		f->flags     = FARC_GZIP;
 	} else if (strcmp (signature, "FARC") == 0) {
-		self->real->signature = FARC_FARC;
-		self->real->flags     = (farc_flags)(FARC_GZIP | FARC_AES);
+		f->signature = FARC_FARC;
+		f->flags     = (farc_flags)(FARC_GZIP | FARC_AES);
 	} else {
 		PyErr_SetString (PyExc_RuntimeError, "Signature must be one of [FArc, FarC, FARC]");
-		return -1;
+		return false;
 	}
 
-	self->real->ft                = ft;
-	self->real->compression_level = 12;
-	self->real->alignment         = 0x10;
+	f->ft                = ft;
+	f->compression_level = 12;
+	f->alignment         = 0x10;
 	if (ft) {
-		self->real->entry_size  = 0x10;
-		self->real->header_size = 0x10;
+		f->entry_size  = 0x10;
+		f->header_size = 0x10;
+	}
+
+	return true;
+}
+
+static int
+py_farc_init (pyobject_farc *self, PyObject *args, PyObject *kwds) {
+	const char *signature = "FArC";
+	bool ft               = true;
+	const char *path      = nullptr;
+	PyObject *level       = nullptr;
+	char *kwlist[]        = {"signature", "ft", "path", "compression_level", nullptr};
+	if (!PyArg_ParseTupleAndKeywords (args, kwds, "|sbzO", kwlist, &signature, &ft, &path, &level)) return -1;
+
+	// libdeflate's slowest level unless the caller asks for another one or for auto
+	i32 compression_level = 12;
+	if (level != nullptr && !py_farc_parse_level (level, false, &compression_level)) return -1;
+
+	self->real   = new farc;
+	self->data   = new std::vector<PyObject *>;
+	self->levels = new std::vector<i32>;
+	self->names  = new std::unordered_map<std::string, u64>;
+	self->reader = nullptr;
+	self->lock   = new std::shared_mutex;
+
+	if (path != nullptr) {
+		self->reader = new farc_reader;
+		self->path   = PyUnicode_FromString (path);
+		bool result;
+		Py_BEGIN_ALLOW_THREADS;
+		result = self->reader->open (path, self->real);
+		Py_END_ALLOW_THREADS;
+		if (!result) {
+			PyErr_Format (PyExc_RuntimeError, "Could not read farc %s", path);
+			return -1;
+		}
+		self->data->resize (self->real->files.size ());
+		self->levels->resize (self->real->files.size (), farc_level_default);
+
+		self->real->compression_level = compression_level;
+		if (self->real->ft) {
+			self->real->entry_size  = 0x10;
+			self->real->header_size = 0x10;
+		}
+		return 0;
 	}
 
+	if (!py_farc_set_signature (self->real, signature, ft)) return -1;
+	self->real->compression_level = compression_level;
 	return 0;
 }
 
 void
 py_farc_finalize (pyobject_farc *self) {
+	if (self->data != nullptr)
+		for (PyObject *data : *self->data)
+			Py_XDECREF (data);
+
 	delete self->real;
+	delete self->data;
+	delete self->levels;
+	delete self->names;
+	delete self->reader;
+	delete self->lock;
+	Py_CLEAR (self->path);
+	Py_CLEAR (self->map);
+}
+
+// Index of the entry called name, or -1
+static i64
+py_farc_find_file (pyobject_farc *self, const char *name) {
+	if (self->names->empty ())
+		for (u64 i = 0; i < self->real->files.size (); i++)
+			self->names->try_emplace (self->real->files[i].name, i);
+
+	auto it = self->names->find (name);
+	return it != self->names->end () ? (i64)it->second : -1;
+}
+
+// Index of the entry a farc_file from farc.files refers to, entries may have moved since
+static i64
+py_farc_resolve_file (pyobject_farc *self, u64 index, const std::string &name) {
+	if (index < self->real->files.size () && self->real->files[index].name == name) return index;
+
+	i64 result = py_farc_find_file (self, name.c_str ());
+	if (result < 0) PyErr_Format (PyExc_KeyError, "File %s no longer in farc", name.c_str ());
+	return result;
+}
+
+// Stores file at index, or after the last entry when index is -1
+static bool
+py_farc_set_file (pyobject_farc *self, pyobject_farc_file *file, i64 index) {
+	// Both sides share the bytes object, the file keeps its data
+	PyObject *data = py_farc_file_get_bytes (file);
+	if (data == nullptr) return false;
+	if (data == Py_None) Py_CLEAR (data);
+
+	farc_file *self_file;
+	if (index < 0) {
+		self_file = self->real->add_file (file->real->name.c_str ());
+		self->data->push_back (data);
+		self->levels->push_back (file->level);
+		if (!self->names->empty ()) self->names->try_emplace (self_file->name, self->real->files.size () - 1);
+	} else {
+		self_file = &self->real->files[index];
+		Py_XDECREF (self->data->at (index));
+		self->data->at (index)   = data;
+		self->levels->at (index) = file->level;
+	}
+
+	py_farc_file_copy_info (self_file, file->real);
+	self_file->offset       = 0;
+	self_file->data_changed = true;
+	if (self->real->flags & FARC_GZIP) self_file->compressed = true;
+	if (self->real->flags & FARC_AES) self_file->encrypted = true;
+
+	return true;
 }
 
 static PyObject *
@@ -130,908 +357,2398 @@ py_farc_add_file (pyobject_farc *self, PyObject *args) {
 	pyobject_farc_file *file;
 	if (!PyArg_ParseTuple (args, "O!", pytype_farc_file, &file)) return nullptr;
 
-	auto self_file = self->real->add_file (file->real->name.c_str ());
-	*self_file     = *file->real;
-	if (self->real->flags & FARC_GZIP) self_file->compressed = true;
-	if (self->real->flags & FARC_AES) self_file->encrypted = true;
-	// Prevent double free
-	file->real->data            = nullptr;
-	file->real->data_compressed = nullptr;
-
+	if (!py_farc_set_file (self, file, -1)) return nullptr;
 	Py_RETURN_NONE;
 }
 
 static PyObject *
-py_farc_write (pyobject_farc *self, PyObject *args) {
-	const char *path;
-	if (!PyArg_ParseTuple (args, "s", &path)) return nullptr;
-
-	if (path_check_file_exists (path)) path_delete_file (path);
-	self->real->write (path, self->real->signature, self->real->flags, false, false);
+py_farc_replace_file (pyobject_farc *self, PyObject *args) {
+	pyobject_farc_file *file;
+	if (!PyArg_ParseTuple (args, "O!", pytype_farc_file, &file)) return nullptr;
 
+	if (!py_farc_set_file (self, file, py_farc_find_file (self, file->real->name.c_str ()))) return nullptr;
 	Py_RETURN_NONE;
 }
 
 static PyObject *
-py_farc_get_files (pyobject_farc *self, void *closure) {
-	PyObject *list = PyList_New (self->real->files.size ());
+py_farc_remove_file (pyobject_farc *self, PyObject *args) {
+	const char *name;
+	if (!PyArg_ParseTuple (args, "s", &name)) return nullptr;
 
-	for (u64 i = 0; i < self->real->files.size (); i++) {
-		pyobject_farc_file *obj = PyObject_New (pyobject_farc_file, pytype_farc_file);
-		PyObject_Init ((PyObject *)obj, pytype_farc_file);
-		obj->real                  = new farc_file;
-		*obj->real                 = self->real->files.at (i);
-		obj->real->data            = nullptr;
-		obj->real->data_compressed = nullptr;
-		PyList_SetItem (list, i, (PyObject *)obj);
+	i64 index = py_farc_find_file (self, name);
+	if (index < 0) {
+		PyErr_Format (PyExc_KeyError, "Could not find file %s", name);
+		return nullptr;
 	}
 
-	return list;
-}
+	Py_XDECREF (self->data->at (index));
+	self->data->erase (self->data->begin () + index);
+	self->levels->erase (self->levels->begin () + index);
+	self->names->clear ();
+	self->real->files.erase (self->real->files.begin () + index);
 
-static PyMethodDef pymethods_farc[] = {{"add_file", (PyCFunction)py_farc_add_file, METH_VARARGS, "Add file to farc (farc_file)"},
-                                       {"write", (PyCFunction)py_farc_write, METH_VARARGS, "Write data to file (path)"},
-                                       {nullptr}};
+	Py_RETURN_NONE;
+}
 
-static PyGetSetDef pygetsets_farc[] = {{"files", (getter)py_farc_get_files, nullptr, "Files", nullptr}, {nullptr}};
+// Contents of every entry for farc_write, null for entries still in the opened archive
+static std::vector<const void *>
+py_farc_get_data_pointers (pyobject_farc *self) {
+	std::vector<const void *> data (self->data->size ());
+	for (size_t i = 0; i < data.size (); i++)
+		if (self->data->at (i) != nullptr) data[i] = PyBytes_AsString (self->data->at (i));
+	return data;
+}
 
-static PyType_Slot pyslots_farc[] = {
-    {Py_tp_methods, pymethods_farc},
-    {Py_tp_getset, pygetsets_farc},
-    {Py_tp_init, (void *)py_farc_init},
-    {Py_tp_finalize, (void *)py_farc_finalize},
-    {0},
+// What farc_write needs from a farc, copied with the GIL held so the entries can change while it runs without it.
+// The bytes objects stay referenced until py_farc_snapshot_release.
+struct py_farc_snapshot {
+	farc real;
+	std::vector<PyObject *> data;
+	std::vector<const void *> pointers;
+	std::vector<i32> levels;
+	u64 generation;
 };
 
-PYTHON_TYPE_DEF (farc);
-
-struct pyobject_txp_set {
-	PyObject_HEAD;
-	txp_set *real;
-	std::vector<std::string> *names;
-};
+static void
+py_farc_snapshot_take (pyobject_farc *self, py_farc_snapshot *snapshot) {
+	snapshot->real.signature         = self->real->signature;
+	snapshot->real.flags             = self->real->flags;
+	snapshot->real.ft                = self->real->ft;
+	snapshot->real.compression_level = self->real->compression_level;
+	snapshot->real.alignment         = self->real->alignment;
+	snapshot->real.entry_size        = self->real->entry_size;
+	snapshot->real.header_size       = self->real->header_size;
+	snapshot->real.files.reserve (self->real->files.size ());
+	for (const farc_file &file : self->real->files)
+		py_farc_file_copy_info (snapshot->real.add_file (file.name.c_str ()), &file);
+
+	snapshot->data = *self->data;
+	snapshot->pointers.resize (snapshot->data.size ());
+	for (size_t i = 0; i < snapshot->data.size (); i++) {
+		if (snapshot->data[i] == nullptr) continue;
+		Py_INCREF (snapshot->data[i]);
+		snapshot->pointers[i] = PyBytes_AsString (snapshot->data[i]);
+	}
+	snapshot->levels     = *self->levels;
+	snapshot->generation = self->generation;
+}
 
-static int
-py_txp_set_init (pyobject_txp_set *self, PyObject *args, PyObject *kwds) {
-	self->real  = new txp_set ();
-	self->names = new std::vector<std::string> ();
+static void
+py_farc_snapshot_release (py_farc_snapshot *snapshot) {
+	for (PyObject *data : snapshot->data)
+		Py_XDECREF (data);
+	snapshot->data.clear ();
+}
 
-	return 0;
+// Calls func with a snapshot without the GIL, the snapshot is taken again when an update moves the entries first
+template <typename T>
+static bool
+py_farc_run_snapshot (pyobject_farc *self, T func) {
+	for (;;) {
+		py_farc_snapshot snapshot;
+		py_farc_snapshot_take (self, &snapshot);
+
+		bool current;
+		bool result = false;
+		Py_BEGIN_ALLOW_THREADS;
+		{
+			std::shared_lock<std::shared_mutex> lock (*self->lock);
+			current = snapshot.generation == self->generation;
+			if (current) result = func (snapshot);
+		}
+		Py_END_ALLOW_THREADS;
+		py_farc_snapshot_release (&snapshot);
+		if (current) return result;
+	}
 }
 
-void
-py_txp_set_finalize (pyobject_txp_set *self) {
+// Writes the entries back to the archive the farc was opened from and reads its table again.
+// The reader lets go of the archive before it is replaced and maps the new one, or the old one when writing failed.
+static bool
+py_farc_rewrite (pyobject_farc *self, double max_waste) {
+	// Views from farc_file.data keep the mapping alive. Writing in place would change the bytes under them,
+	// a new file leaves the old one to the views.
+	bool viewed = self->map != nullptr && Py_REFCNT (self->map) > 1;
+#ifdef _WIN32
+	// Windows cannot move a new file over one that is still mapped
+	if (viewed) {
+		PyErr_Format (PyExc_RuntimeError, "Could not replace farc %U, views of its entries from farc_file.data are still alive", self->path);
+		return false;
+	}
+#endif
+	if (viewed) max_waste = -1;
+	Py_CLEAR (self->map);
+
+	PyObject *path_bytes           = PyUnicode_AsUTF8String (self->path);
+	const char *path               = PyBytes_AsString (path_bytes);
+	std::vector<const void *> data = py_farc_get_data_pointers (self);
+	farc *fresh                    = new farc;
+
+	// The GIL stays held so the entries cannot change under the rewrite, reads already running without it finish first
+	bool written;
+	bool result;
+	{
+		std::unique_lock<std::shared_mutex> lock (*self->lock);
+		written = farc_update (self->real, self->reader, path, data.data (), self->levels->data (), max_waste);
+		// Every entry is in the archive now, read the table again so later updates see them there.
+		// A failed write leaves the old archive, which is mapped again for the entries still in it.
+		bool opened = self->reader->open (path, fresh);
+		result      = written && opened;
+		self->generation++;
+	}
+	if (!result) {
+		PyErr_Format (PyExc_RuntimeError, written ? "Could not read farc %s" : "Could not update farc %s", path);
+		Py_DECREF (path_bytes);
+		delete fresh;
+		return false;
+	}
+	Py_DECREF (path_bytes);
+
+	fresh->compression_level = self->real->compression_level;
+	fresh->entry_size        = self->real->entry_size;
+	fresh->header_size       = self->real->header_size;
 	delete self->real;
-	delete self->names;
+	self->real = fresh;
+	return true;
 }
 
 static PyObject *
-py_txp_set_add_texture_data (pyobject_txp_set *self, PyObject *args) {
-	const char *name;
-	i32 width;
-	i32 height;
-	const char *format_name;
-	PyObject *data;
-	if (!PyArg_ParseTuple (args, "siisO!", &name, &width, &height, &format_name, &PyBytes_Type, &data)) return nullptr;
+py_farc_write (pyobject_farc *self, PyObject *args) {
+	const char *path;
+	if (!PyArg_ParseTuple (args, "s", &path)) return nullptr;
 
-	txp_format format;
-	if (strcmp (format_name, "RGB") == 0) {
-		format = TXP_RGB8;
-	} else if (strcmp (format_name, "RGBA") == 0) {
-		format = TXP_RGBA8;
-	} else if (strcmp (format_name, "BC1") == 0 || strcmp (format_name, "DXT1") == 0) {
-		format = TXP_BC1;
-	} else if (strcmp (format_name, "BC2") == 0 || strcmp (format_name, "DXT3") == 0) {
-		format = TXP_BC2;
-	} else if (strcmp (format_name, "BC3") == 0 || strcmp (format_name, "DXT5") == 0) {
-		format = TXP_BC3;
-	} else {
-		PyErr_SetString (PyExc_RuntimeError, "Format must be one of [RGB, RGBA, BC1/DXT1, BC2/DXT3, BC3/DXT5]");
-		return nullptr;
+	// Writing over the opened archive moves its entries, the reader has to follow them
+	if (self->reader != nullptr && self->reader->is_file (path)) {
+		if (!py_farc_rewrite (self, -1)) return nullptr;
+		Py_RETURN_NONE;
 	}
 
-	txp_mipmap mipmap;
-	txp texture;
-
-	mipmap.width  = width;
-	mipmap.height = height;
-	mipmap.format = format;
-
-	if (PyBytes_Size (data) != mipmap.get_size ()) {
-		PyErr_SetString (PyExc_RuntimeError, "Data does not match expected size");
+	farc_file_sink sink;
+	bool result = py_farc_run_snapshot (self, [&] (const py_farc_snapshot &snapshot) {
+		return sink.open (path) && farc_write (&snapshot.real, &sink, self->reader, snapshot.pointers.data (), snapshot.levels.data ()) &&
+		       sink.commit ();
+	});
+	if (!result) {
+		PyErr_Format (PyExc_RuntimeError, "Could not write farc %s", path);
 		return nullptr;
 	}
 
-	mipmap.size = mipmap.get_size ();
-	mipmap.data.resize (mipmap.size);
-	memcpy (mipmap.data.data (), PyBytes_AsString (data), mipmap.size);
-
-	texture.has_cube_map  = false;
-	texture.array_size    = 1;
-	texture.mipmaps_count = 1;
-	texture.mipmaps.push_back (mipmap);
-
-	self->real->textures.push_back (texture);
-	self->names->push_back (std::string (name));
-
 	Py_RETURN_NONE;
 }
 
 static PyObject *
-py_txp_set_add_texture_pillow (pyobject_txp_set *self, PyObject *args) {
-	const char *name;
-	PyObject *image;
-	const char *format = "ATI2";
-	if (!PyArg_ParseTuple (args, "sO|s", &name, &image, &format)) return nullptr;
+py_farc_update (pyobject_farc *self, PyObject *args, PyObject *kwds) {
+	double max_waste = 0.25;
+	char *kwlist[]   = {"max_waste", nullptr};
+	if (!PyArg_ParseTupleAndKeywords (args, kwds, "|d", kwlist, &max_waste)) return nullptr;
 
-	PyObject *width  = PyObject_GetAttrString (image, "width");
-	PyObject *height = PyObject_GetAttrString (image, "height");
-	PyObject *mode   = PyObject_GetAttrString (image, "mode");
-	if (width == nullptr || height == nullptr || mode == nullptr || !PyLong_Check (width) || !PyLong_Check (height) || !PyUnicode_Check (mode)) {
-		PyErr_SetString (PyExc_RuntimeError, "Could not find image.width");
+	if (self->reader == nullptr) {
+		PyErr_SetString (PyExc_RuntimeError, "Only a farc opened from a path can be updated");
 		return nullptr;
 	}
 
-	PyObject *image_data = PyObject_CallMethod (image, "getdata", nullptr);
-	if (!image_data) {
-		PyErr_SetString (PyExc_RuntimeError, "Could not call image.getdata");
+	if (!py_farc_rewrite (self, max_waste)) return nullptr;
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_farc_to_bytes (pyobject_farc *self, PyObject *args) {
+	// The bytes object is a copy of the buffer, reserving close to the archive size keeps the peak near twice that.
+	// Entries still in the archive take their stored size, new ones rarely grow when compressed.
+	std::unique_ptr<farc_memory_sink> sink;
+	bool result = py_farc_run_snapshot (self, [&] (const py_farc_snapshot &snapshot) {
+		u64 reserve = 0x40;
+		for (size_t i = 0; i < snapshot.real.files.size (); i++) {
+			const farc_file &file = snapshot.real.files[i];
+			bool stored           = snapshot.pointers[i] == nullptr && file.offset != 0 && (file.compressed || file.encrypted);
+			u64 size              = stored ? file.size_compressed : file.size;
+			reserve              += file.name.size () + 0x14 + size + std::max<u64> (snapshot.real.alignment, 0x20);
+		}
+
+		sink = std::make_unique<farc_memory_sink> (reserve);
+		return farc_write (&snapshot.real, sink.get (), self->reader, snapshot.pointers.data (), snapshot.levels.data ());
+	});
+	if (!result) {
+		if (sink->out_of_memory) PyErr_NoMemory ();
+		else PyErr_SetString (PyExc_RuntimeError, "Could not write farc");
 		return nullptr;
 	}
 
-	txp texture;
+	return PyBytes_FromStringAndSize ((const char *)sink->data.data (), sink->data.size ());
+}
 
-	if (strcmp (format, "RGB") == 0 || strcmp (format, "RGBA") == 0) {
-		txp_mipmap mipmap;
-		mipmap.width  = PyLong_AsLong (width);
-		mipmap.height = PyLong_AsLong (height);
-
-		PyObject *iter = PyObject_GetIter (image_data);
-		if (!iter) return nullptr;
-
-		u64 i           = 0;
-		PyObject *bytes = PyUnicode_AsUTF8String (mode);
-		if (strcmp (PyBytes_AsString (bytes), "RGB") == 0) {
-			mipmap.format = TXP_RGB8;
-			mipmap.size   = mipmap.get_size ();
-			mipmap.data.resize (mipmap.size);
-
-			while (PyObject *item = PyIter_Next (iter)) {
-				u8 r = PyLong_AsLong (PyTuple_GetItem (item, 0));
-				u8 g = PyLong_AsLong (PyTuple_GetItem (item, 1));
-				u8 b = PyLong_AsLong (PyTuple_GetItem (item, 2));
-
-				mipmap.data[i * 3 + 0] = r;
-				mipmap.data[i * 3 + 1] = g;
-				mipmap.data[i * 3 + 2] = b;
-
-				i++;
-				Py_DECREF (item);
-			}
-		} else if (strcmp (PyBytes_AsString (bytes), "RGBA") == 0) {
-			mipmap.format = TXP_RGBA8;
-			mipmap.size   = mipmap.get_size ();
-			mipmap.data.resize (mipmap.size);
-
-			while (PyObject *item = PyIter_Next (iter)) {
-				u8 r = PyLong_AsLong (PyTuple_GetItem (item, 0));
-				u8 g = PyLong_AsLong (PyTuple_GetItem (item, 1));
-				u8 b = PyLong_AsLong (PyTuple_GetItem (item, 2));
-				u8 a = PyLong_AsLong (PyTuple_GetItem (item, 3));
-
-				mipmap.data[i * 4 + 0] = r;
-				mipmap.data[i * 4 + 1] = g;
-				mipmap.data[i * 4 + 2] = b;
-				mipmap.data[i * 4 + 3] = a;
-
-				i++;
-				Py_DECREF (item);
-			}
-		} else {
-			PyErr_SetString (PyExc_RuntimeError, "Image mode must be RGB or RGBA");
+// New reference to the contents of an entry as bytes. Entries still in the archive are decoded once
+// and kept, so later calls and writes use the same object.
+static PyObject *
+py_farc_get_bytes (pyobject_farc *self, u64 index) {
+	for (;;) {
+		if (index >= self->real->files.size ()) {
+			PyErr_SetString (PyExc_IndexError, "File no longer in farc");
 			return nullptr;
 		}
 
-		texture.has_cube_map  = false;
-		texture.array_size    = 1;
-		texture.mipmaps_count = 1;
-		texture.mipmaps.push_back (mipmap);
-
-		Py_DECREF (bytes);
-		Py_DECREF (iter);
-	} else if (strcmp (format, "BC3") == 0 || strcmp (format, "DXT5") == 0) {
-		PyObject *iter = PyObject_GetIter (image_data);
-		if (!iter) return nullptr;
-		u8 *data = (u8 *)malloc (PyLong_AsLong (width) * PyLong_AsLong (height) * 4);
-		u64 i    = 0;
-
-		PyObject *bytes = PyUnicode_AsUTF8String (mode);
-		if (strcmp (PyBytes_AsString (bytes), "RGB") == 0) {
-			while (PyObject *item = PyIter_Next (iter)) {
-				u8 r = PyLong_AsLong (PyTuple_GetItem (item, 0));
-				u8 g = PyLong_AsLong (PyTuple_GetItem (item, 1));
-				u8 b = PyLong_AsLong (PyTuple_GetItem (item, 2));
-
-				data[i * 4 + 0] = r;
-				data[i * 4 + 1] = g;
-				data[i * 4 + 2] = b;
-				data[i * 4 + 3] = 255;
-
-				i++;
-				Py_DECREF (item);
-			}
-		} else if (strcmp (PyBytes_AsString (bytes), "RGBA") == 0) {
-			while (PyObject *item = PyIter_Next (iter)) {
-				u8 r = PyLong_AsLong (PyTuple_GetItem (item, 0));
-				u8 g = PyLong_AsLong (PyTuple_GetItem (item, 1));
-				u8 b = PyLong_AsLong (PyTuple_GetItem (item, 2));
-				u8 a = PyLong_AsLong (PyTuple_GetItem (item, 3));
-
-				data[i * 4 + 0] = r;
-				data[i * 4 + 1] = g;
-				data[i * 4 + 2] = b;
-				data[i * 4 + 3] = a;
-
-				i++;
-				Py_DECREF (item);
-			}
-		} else {
-			PyErr_SetString (PyExc_RuntimeError, "Image mode must be RGB or RGBA");
-			return nullptr;
+		PyObject *data = self->data->at (index);
+		if (data != nullptr) {
+			Py_INCREF (data);
+			return data;
 		}
 
-		Py_DECREF (bytes);
-		Py_DECREF (iter);
-
-		txp_mipmap mipmap;
-
-		mipmap.width  = PyLong_AsLong (width);
-		mipmap.height = PyLong_AsLong (height);
-		mipmap.format = TXP_BC3;
-		mipmap.size   = mipmap.get_size ();
-		mipmap.data.resize (mipmap.size);
-
-		u8 *dest = mipmap.data.data ();
-		for (i32 i = 0; i < mipmap.height; i += 4) {
-			i32 remainHeight = std::min<i32> (4, mipmap.height - i);
-			for (i32 j = 0; j < mipmap.width; j += 4) {
-				i32 remainWidth = std::min<i32> (4, mipmap.width - j);
-
-				HDRColorA color[16] = {};
-				for (i32 h = 0; h < remainHeight; h++) {
-					for (i32 w = 0; w < remainWidth; w++) {
-						u64 pxOffset       = ((i + h) * mipmap.width + j + w) * 4;
-						color[h * 4 + w].r = (f32)(*(u8 *)(data + pxOffset + 0)) / 255.0;
-						color[h * 4 + w].g = (f32)(*(u8 *)(data + pxOffset + 1)) / 255.0;
-						color[h * 4 + w].b = (f32)(*(u8 *)(data + pxOffset + 2)) / 255.0;
-						color[h * 4 + w].a = (f32)(*(u8 *)(data + pxOffset + 3)) / 255.0;
-					}
-				}
-
-				D3DXEncodeBC3 (dest, color, BC_FLAGS_DITHER_RGB | BC_FLAGS_DITHER_A);
-				dest += 16;
-			}
+		// Other threads may change the entries while this one reads without the GIL
+		farc_file file;
+		py_farc_file_copy_info (&file, &self->real->files[index]);
+		if (self->reader == nullptr || file.offset == 0) return PyBytes_FromStringAndSize (nullptr, 0);
+
+		PyObject *bytes = PyBytes_FromStringAndSize (nullptr, file.size);
+		if (bytes == nullptr) return nullptr;
+
+		u64 generation = self->generation;
+		bool current;
+		bool result = false;
+		char *dest  = PyBytes_AsString (bytes);
+		Py_BEGIN_ALLOW_THREADS;
+		{
+			std::shared_lock<std::shared_mutex> lock (*self->lock);
+			current = generation == self->generation;
+			if (current) result = self->reader->read (file, dest);
 		}
-
-		texture.has_cube_map  = false;
-		texture.array_size    = 1;
-		texture.mipmaps_count = 1;
-		texture.mipmaps.push_back (mipmap);
-	} else if (strcmp (format, "BC5") == 0 || strcmp (format, "ATI2") == 0) {
-		PyObject *iter = PyObject_GetIter (image_data);
-		if (!iter) return nullptr;
-
-		const f32 cbcr_add     = 128.5019;
-		const f32 cbcr_div     = 256.0001 / 255.0;
-		const __m128 matrix_y  = {0.212593317f, 0.715214610f, 0.0721921176f, 1.0f};
-		const __m128 matrix_cb = {-0.114568502f, -0.385435730f, 0.5000042320f, 1.0f};
-		const __m128 matrix_cr = {0.500004232f, -0.454162151f, -0.0458420813f, 1.0f};
-
-		u8 *ya_data   = (u8 *)malloc (PyLong_AsLong (width) * PyLong_AsLong (height) * 2);
-		u8 *cbcr_data = (u8 *)malloc (PyLong_AsLong (width) * PyLong_AsLong (height) * 2);
-
-		PyObject *bytes = PyUnicode_AsUTF8String (mode);
-		if (strcmp (PyBytes_AsString (bytes), "RGBA") == 0) {
-			u64 i = 0;
-			while (PyObject *item = PyIter_Next (iter)) {
-				f32 r = PyLong_AsLong (PyTuple_GetItem (item, 0));
-				f32 g = PyLong_AsLong (PyTuple_GetItem (item, 1));
-				f32 b = PyLong_AsLong (PyTuple_GetItem (item, 2));
-				u8 a  = PyLong_AsLong (PyTuple_GetItem (item, 3));
-
-#ifdef __x86_64__
-				__m128 rgb  = {r, g, b, cbcr_add};
-				__m128 y    = _mm_mul_ps (rgb, matrix_y);
-				__m128 cb   = _mm_mul_ps (rgb, matrix_cb);
-				__m128 cr   = _mm_mul_ps (rgb, matrix_cr);
-				__m128 cbcr = _mm_hadd_ps (cb, cr);
-
-				ya_data[i * 2 + 0]   = y[0] + y[1] + y[2];
-				ya_data[i * 2 + 1]   = a;
-				cbcr_data[i * 2 + 0] = (cbcr[0] + cbcr[1]) / cbcr_div;
-				cbcr_data[i * 2 + 1] = (cbcr[2] + cbcr[3]) / cbcr_div;
-#else
-				f32 y  = r * 0.212593317f + g * 0.715214610f + b * 0.0721921176f;
-				f32 cb = (r * -0.114568502f + g * -0.385435730f + b * 0.5000042320f + cbcr_add) / cbcr_div;
-				f32 cr = (r * 0.500004232f + g * -0.454162151f + b * -0.0458420813f + cbcr_add) / cbcr_div;
-
-				ya_data[i * 2 + 0]   = y;
-				ya_data[i * 2 + 1]   = a;
-				cbcr_data[i * 2 + 0] = cb;
-				cbcr_data[i * 2 + 1] = cr;
-#endif
-
-				i++;
-				Py_DECREF (item);
-			}
-		} else if (strcmp (PyBytes_AsString (bytes), "RGB") == 0) {
-			u64 i = 0;
-			while (PyObject *item = PyIter_Next (iter)) {
-				f32 r = PyLong_AsLong (PyTuple_GetItem (item, 0));
-				f32 g = PyLong_AsLong (PyTuple_GetItem (item, 1));
-				f32 b = PyLong_AsLong (PyTuple_GetItem (item, 2));
-
-#ifdef __x86_64__
-				__m128 rgb  = {r, g, b, cbcr_add};
-				__m128 y    = _mm_mul_ps (rgb, matrix_y);
-				__m128 cb   = _mm_mul_ps (rgb, matrix_cb);
-				__m128 cr   = _mm_mul_ps (rgb, matrix_cr);
-				__m128 cbcr = _mm_hadd_ps (cb, cr);
-
-				ya_data[i * 2 + 0]   = y[0] + y[1] + y[2];
-				ya_data[i * 2 + 1]   = 255;
-				cbcr_data[i * 2 + 0] = (cbcr[0] + cbcr[1]) / cbcr_div;
-				cbcr_data[i * 2 + 1] = (cbcr[2] + cbcr[3]) / cbcr_div;
-#else
-				f32 y  = r * 0.212593317f + g * 0.715214610f + b * 0.0721921176f;
-				f32 cb = (r * -0.114568502f + g * -0.385435730f + b * 0.5000042320f + cbcr_add) / cbcr_div;
-				f32 cr = (r * 0.500004232f + g * -0.454162151f + b * -0.0458420813f + cbcr_add) / cbcr_div;
-
-				ya_data[i * 2 + 0]   = y;
-				ya_data[i * 2 + 1]   = 255;
-				cbcr_data[i * 2 + 0] = cb;
-				cbcr_data[i * 2 + 1] = cr;
-#endif
-
-				i++;
-				Py_DECREF (item);
-			}
-		} else {
-			PyErr_SetString (PyExc_RuntimeError, "Image mode must be RGB or RGBA");
+		Py_END_ALLOW_THREADS;
+		if (!current) {
+			// An update moved the entries after the copy was taken
+			Py_DECREF (bytes);
+			continue;
+		}
+		if (!result) {
+			Py_DECREF (bytes);
+			PyErr_Format (PyExc_RuntimeError, "Could not read file %s", file.name.c_str ());
 			return nullptr;
 		}
-		Py_DECREF (bytes);
-		Py_DECREF (iter);
-
-		txp_mipmap ya_mipmap;
-		txp_mipmap cbcr_mipmap;
-
-		ya_mipmap.width  = PyLong_AsLong (width);
-		ya_mipmap.height = PyLong_AsLong (height);
-		ya_mipmap.format = TXP_BC5;
-		ya_mipmap.size   = ya_mipmap.get_size ();
-		ya_mipmap.data.resize (ya_mipmap.size);
-
-		u8 *dest = ya_mipmap.data.data ();
-		for (i32 i = 0; i < ya_mipmap.height; i += 4) {
-			i32 remainHeight = std::min<i32> (4, ya_mipmap.height - i);
-			for (i32 j = 0; j < ya_mipmap.width; j += 4) {
-				i32 remainWidth = std::min<i32> (4, ya_mipmap.width - j);
-
-				XMFLOAT2 color[16] = {0.0};
-				for (i32 h = 0; h < remainHeight; h++) {
-					for (i32 w = 0; w < remainWidth; w++) {
-						u64 pxOffset       = ((i + h) * ya_mipmap.width + j + w) * 2;
-						color[h * 4 + w].x = (f32)(*(u8 *)(ya_data + pxOffset + 0)) / 255.0;
-						color[h * 4 + w].y = (f32)(*(u8 *)(ya_data + pxOffset + 1)) / 255.0;
-					}
-				}
 
-				D3DXEncodeBC5U (dest, color);
-				dest += 16;
-			}
+		// Only kept when the slot still holds the entry that was read
+		if (generation == self->generation && index < self->real->files.size () && self->data->at (index) == nullptr &&
+		    self->real->files[index].offset == file.offset) {
+			Py_INCREF (bytes);
+			self->data->at (index) = bytes;
 		}
+		return bytes;
+	}
+}
 
-		cbcr_mipmap.width  = PyLong_AsLong (width) / 2;
-		cbcr_mipmap.height = PyLong_AsLong (height) / 2;
-		cbcr_mipmap.format = TXP_BC5;
-		cbcr_mipmap.size   = cbcr_mipmap.get_size ();
-		cbcr_mipmap.data.resize (cbcr_mipmap.size);
-
-		dest = cbcr_mipmap.data.data ();
-		for (i32 i = 0; i < ya_mipmap.height; i += 8) {
-			i32 remainHeight = std::min<i32> (8, ya_mipmap.height - i);
-			for (i32 j = 0; j < ya_mipmap.width; j += 8) {
-				i32 remainWidth = std::min<i32> (8, ya_mipmap.width - j);
-
-				f32 color[8][8][2] = {0.5};
-				for (i32 h = 0; h < remainHeight; h++) {
-					for (i32 w = 0; w < remainWidth; w++) {
-						u64 pxOffset   = ((i + h) * ya_mipmap.width + j + w) * 2;
-						color[h][w][0] = (f32)(*(u8 *)(cbcr_data + pxOffset + 0)) / 255.0;
-						color[h][w][1] = (f32)(*(u8 *)(cbcr_data + pxOffset + 1)) / 255.0;
-					}
-				}
-
-				XMFLOAT2 temp[16];
-				for (i32 h = 0; h < 4; h++) {
-					for (i32 w = 0; w < 4; w++) {
-						temp[h * 4 + w].x =
-						    (color[h * 2][w * 2][0] + color[h * 2][w * 2 + 1][0] + color[h * 2 + 1][w * 2][0] + color[h * 2 + 1][w * 2 + 1][0]) / 4.0;
-						temp[h * 4 + w].y =
-						    (color[h * 2][w * 2][1] + color[h * 2][w * 2 + 1][1] + color[h * 2 + 1][w * 2][1] + color[h * 2 + 1][w * 2 + 1][1]) / 4.0;
-					}
-				}
-				D3DXEncodeBC5U (dest, temp);
-				dest += 16;
-			}
-		}
+static PyObject *
+py_farc_get_map (pyobject_farc *self) {
+	if (self->map != nullptr) return self->map;
+
+	PyObject *io     = PyImport_ImportModule ("io");
+	PyObject *module = PyImport_ImportModule ("mmap");
+	if (io == nullptr || module == nullptr) {
+		Py_XDECREF (io);
+		Py_XDECREF (module);
+		return nullptr;
+	}
 
-		texture.has_cube_map  = false;
-		texture.array_size    = 1;
-		texture.mipmaps_count = 2;
-		texture.mipmaps.push_back (ya_mipmap);
-		texture.mipmaps.push_back (cbcr_mipmap);
-	} else if (strcmp (format, "BC7") == 0) {
-		PyObject *iter = PyObject_GetIter (image_data);
-		if (!iter) return nullptr;
-		u8 *data = (u8 *)malloc (PyLong_AsLong (width) * PyLong_AsLong (height) * 4);
-		u64 i    = 0;
-
-		PyObject *bytes = PyUnicode_AsUTF8String (mode);
-		if (strcmp (PyBytes_AsString (bytes), "RGB") == 0) {
-			while (PyObject *item = PyIter_Next (iter)) {
-				u8 r = PyLong_AsLong (PyTuple_GetItem (item, 0));
-				u8 g = PyLong_AsLong (PyTuple_GetItem (item, 1));
-				u8 b = PyLong_AsLong (PyTuple_GetItem (item, 2));
-
-				data[i * 4 + 0] = r;
-				data[i * 4 + 1] = g;
-				data[i * 4 + 2] = b;
-				data[i * 4 + 3] = 255;
-
-				i++;
-				Py_DECREF (item);
-			}
-		} else if (strcmp (PyBytes_AsString (bytes), "RGBA") == 0) {
-			while (PyObject *item = PyIter_Next (iter)) {
-				u8 r = PyLong_AsLong (PyTuple_GetItem (item, 0));
-				u8 g = PyLong_AsLong (PyTuple_GetItem (item, 1));
-				u8 b = PyLong_AsLong (PyTuple_GetItem (item, 2));
-				u8 a = PyLong_AsLong (PyTuple_GetItem (item, 3));
-
-				data[i * 4 + 0] = r;
-				data[i * 4 + 1] = g;
-				data[i * 4 + 2] = b;
-				data[i * 4 + 3] = a;
-
-				i++;
-				Py_DECREF (item);
-			}
-		} else {
-			PyErr_SetString (PyExc_RuntimeError, "Image mode must be RGB or RGBA");
-			return nullptr;
+	PyObject *file = PyObject_CallMethod (io, "open", "Os", self->path, "rb");
+	if (file != nullptr) {
+		PyObject *fileno = PyObject_CallMethod (file, "fileno", nullptr);
+		PyObject *type   = PyObject_GetAttrString (module, "mmap");
+		PyObject *access = PyObject_GetAttrString (module, "ACCESS_READ");
+		if (fileno != nullptr && type != nullptr && access != nullptr) {
+			PyObject *args   = Py_BuildValue ("(Oi)", fileno, 0);
+			PyObject *kwargs = Py_BuildValue ("{sO}", "access", access);
+			if (args != nullptr && kwargs != nullptr) self->map = PyObject_Call (type, args, kwargs);
+			Py_XDECREF (args);
+			Py_XDECREF (kwargs);
 		}
+		Py_XDECREF (fileno);
+		Py_XDECREF (type);
+		Py_XDECREF (access);
+
+		// The mapping outlives the file handle
+		PyObject *result = PyObject_CallMethod (file, "close", nullptr);
+		Py_XDECREF (result);
+		Py_DECREF (file);
+	}
 
-		Py_DECREF (bytes);
-		Py_DECREF (iter);
-
-		txp_mipmap mipmap;
-
-		mipmap.width  = PyLong_AsLong (width);
-		mipmap.height = PyLong_AsLong (height);
-		mipmap.format = (txp_format)15; // BC7
-		mipmap.size   = mipmap.width * mipmap.height;
-		mipmap.data.resize (mipmap.size);
-
-		u8 *dest = mipmap.data.data ();
-		std::vector<std::thread> thread_pool;
-		std::vector<HDRColorA *> ptrs;
-
-		for (i32 i = 0; i < mipmap.height; i += 4) {
-			i32 remainHeight = std::min<i32> (4, mipmap.height - i);
-			for (i32 j = 0; j < mipmap.width; j += 4) {
-				i32 remainWidth = std::min<i32> (4, mipmap.width - j);
-
-				HDRColorA *color = (HDRColorA *)calloc (16, sizeof (HDRColorA));
-				for (i32 h = 0; h < remainHeight; h++) {
-					for (i32 w = 0; w < remainWidth; w++) {
-						u64 pxOffset       = ((i + h) * mipmap.width + j + w) * 4;
-						color[h * 4 + w].r = (f32)(*(u8 *)(data + pxOffset + 0)) / 255.0;
-						color[h * 4 + w].g = (f32)(*(u8 *)(data + pxOffset + 1)) / 255.0;
-						color[h * 4 + w].b = (f32)(*(u8 *)(data + pxOffset + 2)) / 255.0;
-						color[h * 4 + w].a = (f32)(*(u8 *)(data + pxOffset + 3)) / 255.0;
-					}
-				}
+	Py_DECREF (io);
+	Py_DECREF (module);
+	return self->map;
+}
 
-				thread_pool.push_back (std::thread (D3DXEncodeBC7, dest, color, 0));
-				ptrs.push_back (color);
-				dest += 16;
+// memoryview of an entry. Entries stored as is in an opened archive are views into its mapping,
+// anything else is a view of the bytes from py_farc_get_bytes.
+static PyObject *
+py_farc_get_data (pyobject_farc *self, u64 index) {
+	if (index < self->real->files.size () && self->data->at (index) == nullptr && self->reader != nullptr) {
+		farc_file &file = self->real->files[index];
+		if (!file.compressed && !file.encrypted && file.offset != 0) {
+			u64 size;
+			if (self->reader->get_stored (file, &size) == nullptr || size < file.size) {
+				PyErr_Format (PyExc_RuntimeError, "Could not read file %s", file.name.c_str ());
+				return nullptr;
 			}
-		}
-
-		for (auto &t : thread_pool)
-			t.join ();
 
-		for (auto ptr : ptrs)
-			free (ptr);
-
-		texture.has_cube_map  = false;
-		texture.array_size    = 1;
-		texture.mipmaps_count = 1;
-		texture.mipmaps.push_back (mipmap);
-	} else {
-		PyErr_SetString (PyExc_RuntimeError, "Unknown pixel format");
-		return nullptr;
+			PyObject *map = py_farc_get_map (self);
+			if (map == nullptr) return nullptr;
+
+			PyObject *start  = PyLong_FromUnsignedLongLong (file.offset);
+			PyObject *stop   = PyLong_FromUnsignedLongLong (file.offset + file.size);
+			PyObject *slice  = start != nullptr && stop != nullptr ? PySlice_New (start, stop, nullptr) : nullptr;
+			PyObject *view   = PyMemoryView_FromObject (map);
+			PyObject *result = nullptr;
+			if (view != nullptr && slice != nullptr) result = PyObject_GetItem (view, slice);
+			Py_XDECREF (start);
+			Py_XDECREF (stop);
+			Py_XDECREF (slice);
+			Py_XDECREF (view);
+			return result;
+		}
 	}
 
-	self->real->textures.push_back (texture);
-	self->names->push_back (std::string (name));
-
-	Py_DECREF (width);
-	Py_DECREF (height);
-	Py_DECREF (mode);
+	PyObject *bytes = py_farc_get_bytes (self, index);
+	if (bytes == nullptr) return nullptr;
 
-	Py_RETURN_NONE;
+	PyObject *view = PyMemoryView_FromObject (bytes);
+	Py_DECREF (bytes);
+	return view;
 }
 
 static PyObject *
-py_txp_set_get_texture_id (pyobject_txp_set *self, PyObject *args) {
+py_farc_read_file (pyobject_farc *self, PyObject *args) {
 	const char *name;
 	if (!PyArg_ParseTuple (args, "s", &name)) return nullptr;
 
-	for (u64 i = 0; i < self->names->size (); i++)
-		if (strcmp (name, self->names->at (i).c_str ()) == 0) return PyLong_FromLong (i);
+	i64 index = py_farc_find_file (self, name);
+	if (index < 0) {
+		PyErr_Format (PyExc_KeyError, "Could not find file %s", name);
+		return nullptr;
+	}
 
-	PyErr_SetString (PyExc_RuntimeError, "Could not find texture");
-	return nullptr;
+	return py_farc_get_bytes (self, index);
 }
 
-static PyMethodDef pymethods_txp_set[] = {{"add_texture_data", (PyCFunction)py_txp_set_add_texture_data, METH_VARARGS,
-                                           "Add textures to set (name, width, height, format: [RGB, RGBA, BC1/DXT1, BC2/DXT3, BC3/DXT5], data)"},
-                                          {"add_texture_pillow", (PyCFunction)py_txp_set_add_texture_pillow, METH_VARARGS,
-                                           "Add a texture from pillow (name, image, compression: [RGB/RGBA, BC5/ATI2]])"},
-                                          {"get_texture_id", (PyCFunction)py_txp_set_get_texture_id, METH_VARARGS, "Get the id for a texture (name)"},
-                                          {nullptr}};
-
-static PyType_Slot pyslots_txp_set[] = {
-    {Py_tp_init, (void *)py_txp_set_init},
-    {Py_tp_finalize, (void *)py_txp_set_finalize},
-    {Py_tp_methods, pymethods_txp_set},
-    {0},
-};
-
-PYTHON_TYPE_DEF (txp_set);
+// farc_file bound to entry index of self, its contents are read through self when asked for
+static PyObject *
+py_farc_new_file (pyobject_farc *self, u64 index) {
+	pyobject_farc_file *obj = PyObject_New (pyobject_farc_file, pytype_farc_file);
+	if (obj == nullptr) return nullptr;
+	obj->real   = new farc_file;
+	obj->data   = nullptr;
+	obj->parent = self;
+	obj->index  = index;
+	obj->level  = self->levels->at (index);
+	py_farc_file_copy_info (obj->real, &self->real->files.at (index));
+	Py_INCREF (self);
+	return (PyObject *)obj;
+}
 
-struct pyobject_sprite_info {
+// Sequence over the entries of a farc, farc_file objects are only created for the entries that are indexed
+struct pyobject_farc_files {
 	PyObject_HEAD;
-	spr::SprInfo spr_info;
-	SpriteData spr_data;
-	std::string *name;
+	pyobject_farc *parent;
 };
 
-static int
+void
+py_farc_files_finalize (pyobject_farc_files *self) {
+	Py_CLEAR (self->parent);
+}
+
+static Py_ssize_t
+py_farc_files_length (pyobject_farc_files *self) {
+	return self->parent != nullptr ? self->parent->real->files.size () : 0;
+}
+
+static PyObject *
+py_farc_files_item (pyobject_farc_files *self, Py_ssize_t index) {
+	if (index < 0 || index >= py_farc_files_length (self)) {
+		PyErr_SetString (PyExc_IndexError, "farc index out of range");
+		return nullptr;
+	}
+
+	return py_farc_new_file (self->parent, index);
+}
+
+static PyObject *
+py_farc_files_subscript (pyobject_farc_files *self, PyObject *key) {
+	if (PySlice_Check (key)) {
+		Py_ssize_t start;
+		Py_ssize_t stop;
+		Py_ssize_t step;
+		if (PySlice_Unpack (key, &start, &stop, &step) < 0) return nullptr;
+		Py_ssize_t count = PySlice_AdjustIndices (py_farc_files_length (self), &start, &stop, step);
+
+		PyObject *list = PyList_New (count);
+		if (list == nullptr) return nullptr;
+		for (Py_ssize_t i = 0; i < count; i++) {
+			PyObject *file = py_farc_files_item (self, start + i * step);
+			if (file == nullptr) {
+				Py_DECREF (list);
+				return nullptr;
+			}
+			PyList_SetItem (list, i, file);
+		}
+		return list;
+	}
+
+	Py_ssize_t index = PyNumber_AsSsize_t (key, PyExc_IndexError);
+	if (index == -1 && PyErr_Occurred ()) return nullptr;
+	if (index < 0) index += py_farc_files_length (self);
+	return py_farc_files_item (self, index);
+}
+
+static PyType_Slot pyslots_farc_files[] = {
+    {Py_sq_length, (void *)py_farc_files_length},
+    {Py_sq_item, (void *)py_farc_files_item},
+    {Py_mp_length, (void *)py_farc_files_length},
+    {Py_mp_subscript, (void *)py_farc_files_subscript},
+    {Py_tp_finalize, (void *)py_farc_files_finalize},
+    {0},
+};
+
+PYTHON_TYPE_DEF (farc_files);
+
+static PyObject *
+py_farc_get_files (pyobject_farc *self, void *closure) {
+	pyobject_farc_files *view = PyObject_New (pyobject_farc_files, pytype_farc_files);
+	if (view == nullptr) return nullptr;
+	view->parent = self;
+	Py_INCREF (self);
+	return (PyObject *)view;
+}
+
+static PyObject *
+py_farc_get (pyobject_farc *self, PyObject *args) {
+	const char *name;
+	PyObject *fallback = Py_None;
+	if (!PyArg_ParseTuple (args, "s|O", &name, &fallback)) return nullptr;
+
+	i64 index = py_farc_find_file (self, name);
+	if (index >= 0) return py_farc_new_file (self, index);
+
+	Py_INCREF (fallback);
+	return fallback;
+}
+
+static int
+py_farc_contains (pyobject_farc *self, PyObject *key) {
+	if (!PyUnicode_Check (key)) return 0;
+
+	PyObject *bytes = PyUnicode_AsUTF8String (key);
+	if (bytes == nullptr) return -1;
+	int result = py_farc_find_file (self, PyBytes_AsString (bytes)) >= 0;
+	Py_DECREF (bytes);
+	return result;
+}
+
+static PyMethodDef pymethods_farc[] = {{"add_file", (PyCFunction)py_farc_add_file, METH_VARARGS, "Add file to farc (farc_file)"},
+                                       {"write", (PyCFunction)py_farc_write, METH_VARARGS, "Write data to file (path)"},
+                                       {"to_bytes", (PyCFunction)py_farc_to_bytes, METH_NOARGS, "Build the archive in memory"},
+                                       {"update", (PyCFunction)py_farc_update, METH_VARARGS | METH_KEYWORDS,
+                                        "Save changes back to the opened archive (max_waste=0.25)"},
+                                       {"replace_file", (PyCFunction)py_farc_replace_file, METH_VARARGS, "Replace the file with the same name (farc_file)"},
+                                       {"remove_file", (PyCFunction)py_farc_remove_file, METH_VARARGS, "Remove a file (name)"},
+                                       {"read_file", (PyCFunction)py_farc_read_file, METH_VARARGS, "Read the contents of a file (name)"},
+                                       {"get", (PyCFunction)py_farc_get, METH_VARARGS, "Get a file by name, or default (name, default=None)"},
+                                       {nullptr}};
+
+static PyObject *
+py_farc_get_compression_level (pyobject_farc *self, void *closure) {
+	return PyLong_FromLong (self->real->compression_level);
+}
+
+static int
+py_farc_set_compression_level (pyobject_farc *self, PyObject *value, void *closure) {
+	return py_farc_parse_level (value, false, &self->real->compression_level) ? 0 : -1;
+}
+
+static PyGetSetDef pygetsets_farc[] = {{"files", (getter)py_farc_get_files, nullptr, "Files", nullptr},
+                                       {"compression_level", (getter)py_farc_get_compression_level, (setter)py_farc_set_compression_level,
+                                        "Compression level of entries without their own, 12 by default, -1 for auto", nullptr},
+                                       {nullptr}};
+
+static PyType_Slot pyslots_farc[] = {
+    {Py_sq_contains, (void *)py_farc_contains},
+    {Py_tp_methods, pymethods_farc},
+    {Py_tp_getset, pygetsets_farc},
+    {Py_tp_init, (void *)py_farc_init},
+    {Py_tp_finalize, (void *)py_farc_finalize},
+    {0},
+};
+
+PYTHON_TYPE_DEF (farc);
+
+struct pyobject_farc_writer {
+	PyObject_HEAD;
+	farc *settings;
+	farc_file_sink *sink;
+	farc_stream_writer *real;
+	// Held while real is used without the GIL, close deletes real under it
+	std::mutex *lock;
+};
+
+static int
+py_farc_writer_init (pyobject_farc_writer *self, PyObject *args, PyObject *kwds) {
+	const char *path;
+	const char *signature = "FArC";
+	bool ft               = true;
+	PyObject *level       = nullptr;
+	u32 alignment         = 0x10;
+	u64 header_size       = 0x10000;
+	char *kwlist[]        = {"path", "signature", "ft", "compression_level", "alignment", "header_size", nullptr};
+	if (!PyArg_ParseTupleAndKeywords (args, kwds, "s|sbOIK", kwlist, &path, &signature, &ft, &level, &alignment, &header_size)) return -1;
+
+	// libdeflate's slowest level unless the caller asks for another one or for auto
+	i32 compression_level = 12;
+	if (level != nullptr && !py_farc_parse_level (level, false, &compression_level)) return -1;
+
+	self->lock     = new std::mutex;
+	self->settings = new farc;
+	self->sink     = new farc_file_sink;
+	self->real     = new farc_stream_writer;
+	if (!py_farc_set_signature (self->settings, signature, ft)) return -1;
+	self->settings->compression_level = compression_level;
+	self->settings->alignment         = alignment;
+
+	if (!self->sink->open (path) || !self->real->open (self->sink, self->settings, header_size)) {
+		PyErr_Format (PyExc_RuntimeError, "Could not open %s for writing", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+py_farc_writer_finalize (pyobject_farc_writer *self) {
+	// The writer waits for entries still being compressed, the sink then drops the unfinished file
+	delete self->real;
+	delete self->sink;
+	delete self->settings;
+	delete self->lock;
+}
+
+static bool
+py_farc_writer_check (pyobject_farc_writer *self) {
+	if (self->real != nullptr) return true;
+	PyErr_SetString (PyExc_RuntimeError, "farc_writer is closed");
+	return false;
+}
+
+// Calls func with the stream writer without the GIL and under the lock, *result is what it returned.
+// False with an error set when another thread closed the writer first.
+template <typename T>
+static bool
+py_farc_writer_run (pyobject_farc_writer *self, bool *result, T func) {
+	bool open;
+	Py_BEGIN_ALLOW_THREADS;
+	{
+		std::lock_guard<std::mutex> lock (*self->lock);
+		open = self->real != nullptr;
+		if (open) *result = func (self->real);
+	}
+	Py_END_ALLOW_THREADS;
+	if (!open) PyErr_SetString (PyExc_RuntimeError, "farc_writer is closed");
+	return open;
+}
+
+// Deletes the stream writer and sink, finishing the archive first when commit is set
+static bool
+py_farc_writer_release (pyobject_farc_writer *self, bool commit) {
+	bool result = true;
+	Py_BEGIN_ALLOW_THREADS;
+	{
+		std::lock_guard<std::mutex> lock (*self->lock);
+		if (self->real != nullptr && commit) result = self->real->close () && self->sink->commit ();
+		delete self->real;
+		delete self->sink;
+		self->real = nullptr;
+		self->sink = nullptr;
+	}
+	Py_END_ALLOW_THREADS;
+	return result;
+}
+
+static PyObject *
+py_farc_writer_add_file (pyobject_farc_writer *self, PyObject *args) {
+	pyobject_farc_file *file;
+	if (!PyArg_ParseTuple (args, "O!", pytype_farc_file, &file)) return nullptr;
+	if (!py_farc_writer_check (self)) return nullptr;
+
+	PyObject *data = py_farc_file_get_bytes (file);
+	if (data == nullptr) return nullptr;
+
+	// The writer holds on to entries past this call without the GIL, so it gets its own copy
+	farc_file entry;
+	entry.name.assign (file->real->name);
+	entry.compressed = (self->settings->flags & FARC_GZIP) != 0;
+	entry.encrypted  = (self->settings->flags & FARC_AES) != 0;
+	if (data != Py_None) {
+		entry.size = PyBytes_Size (data);
+		entry.data = malloc (std::max<u64> (entry.size, 1));
+		memcpy (entry.data, PyBytes_AsString (data), entry.size);
+	}
+	Py_DECREF (data);
+
+	bool result;
+	i32 level = file->level;
+	if (!py_farc_writer_run (self, &result, [&] (farc_stream_writer *writer) { return writer->add_owned (entry, level); })) return nullptr;
+	if (!result) {
+		PyErr_SetString (PyExc_RuntimeError, "Could not write farc");
+		return nullptr;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_farc_writer_add_path (pyobject_farc_writer *self, PyObject *args) {
+	const char *name;
+	const char *path;
+	PyObject *value = Py_None;
+	if (!PyArg_ParseTuple (args, "ss|O", &name, &path, &value)) return nullptr;
+	if (!py_farc_writer_check (self)) return nullptr;
+
+	i32 level;
+	if (!py_farc_parse_level (value, true, &level)) return nullptr;
+
+	farc_file file;
+	file.name.assign (name);
+	file.compressed = (self->settings->flags & FARC_GZIP) != 0;
+	file.encrypted  = (self->settings->flags & FARC_AES) != 0;
+
+	bool result;
+	if (!py_farc_writer_run (self, &result, [&] (farc_stream_writer *writer) { return writer->add_path (file, path, level); })) return nullptr;
+	if (!result) {
+		PyErr_Format (PyExc_RuntimeError, "Could not add %s to farc", path);
+		return nullptr;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_farc_writer_close (pyobject_farc_writer *self, PyObject *args) {
+	if (self->real == nullptr) Py_RETURN_NONE;
+
+	if (!py_farc_writer_release (self, true)) {
+		PyErr_SetString (PyExc_RuntimeError, "Could not write farc");
+		return nullptr;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_farc_writer_enter (pyobject_farc_writer *self, PyObject *args) {
+	Py_INCREF (self);
+	return (PyObject *)self;
+}
+
+static PyObject *
+py_farc_writer_exit (pyobject_farc_writer *self, PyObject *args) {
+	PyObject *type;
+	PyObject *value;
+	PyObject *traceback;
+	if (!PyArg_ParseTuple (args, "OOO", &type, &value, &traceback)) return nullptr;
+
+	// Leaving through an exception drops the partial archive instead of finishing it
+	if (type != Py_None) {
+		py_farc_writer_release (self, false);
+		Py_RETURN_FALSE;
+	}
+
+	PyObject *result = py_farc_writer_close (self, nullptr);
+	if (result == nullptr) return nullptr;
+	Py_DECREF (result);
+	Py_RETURN_FALSE;
+}
+
+static PyMethodDef pymethods_farc_writer[]
+    = {{"add_file", (PyCFunction)py_farc_writer_add_file, METH_VARARGS, "Compress and write a file (farc_file)"},
+       {"add_path", (PyCFunction)py_farc_writer_add_path, METH_VARARGS, "Compress and write a file from disk (name, path, compression_level=None)"},
+       {"close", (PyCFunction)py_farc_writer_close, METH_NOARGS, "Finish the archive"},
+       {"__enter__", (PyCFunction)py_farc_writer_enter, METH_NOARGS, nullptr},
+       {"__exit__", (PyCFunction)py_farc_writer_exit, METH_VARARGS, nullptr},
+       {nullptr}};
+
+static PyType_Slot pyslots_farc_writer[] = {
+    {Py_tp_methods, pymethods_farc_writer},
+    {Py_tp_init, (void *)py_farc_writer_init},
+    {Py_tp_finalize, (void *)py_farc_writer_finalize},
+    {0},
+};
+
+PYTHON_TYPE_DEF (farc_writer);
+
+// Writes a malloc'd buffer to path and frees it, called without the GIL
+static bool
+py_write_file (const char *path, void *data, u64 size) {
+	FILE *file  = fopen (path, "wb");
+	bool result = file != nullptr && fwrite (data, 1, size, file) == size;
+	if (file != nullptr) result = fclose (file) == 0 && result;
+	free (data);
+	return result;
+}
+
+struct pyobject_txp_set {
+	PyObject_HEAD;
+	txp_set *real;
+	std::vector<std::string> *names;
+	// Id of the first texture with each name, names only ever grow so it stays valid
+	std::unordered_map<std::string, u32> *ids;
+	// Mipmaps of the first textures as they are in source, a bytes object the set was loaded from.
+	// Those textures have no data of their own until KKdLib has to pack them.
+	std::vector<texture_pack_entry> *borrowed;
+	PyObject *source;
+};
+
+static int
+py_txp_set_init (pyobject_txp_set *self, PyObject *args, PyObject *kwds) {
+	self->real     = new txp_set ();
+	self->names    = new std::vector<std::string> ();
+	self->ids      = new std::unordered_map<std::string, u32> ();
+	self->borrowed = new std::vector<texture_pack_entry> ();
+	self->source   = nullptr;
+
+	// Sets are built up here rather than unpacked, they can be packed as soon as they exist
+	self->real->ready = true;
+
+	return 0;
+}
+
+void
+py_txp_set_finalize (pyobject_txp_set *self) {
+	delete self->real;
+	delete self->names;
+	delete self->ids;
+	delete self->borrowed;
+	Py_CLEAR (self->source);
+}
+
+// Names the texture last added to real->textures
+static void
+py_txp_set_add_name (pyobject_txp_set *self, std::string name) {
+	self->ids->try_emplace (name, self->names->size ());
+	self->names->push_back (std::move (name));
+}
+
+static PyObject *
+py_txp_set_add_texture_data (pyobject_txp_set *self, PyObject *args) {
+	const char *name;
+	i32 width;
+	i32 height;
+	const char *format_name;
+	PyObject *data;
+	if (!PyArg_ParseTuple (args, "siisO!", &name, &width, &height, &format_name, &PyBytes_Type, &data)) return nullptr;
+
+	txp_format format;
+	if (strcmp (format_name, "RGB") == 0) {
+		format = TXP_RGB8;
+	} else if (strcmp (format_name, "RGBA") == 0) {
+		format = TXP_RGBA8;
+	} else if (strcmp (format_name, "BC1") == 0 || strcmp (format_name, "DXT1") == 0) {
+		format = TXP_BC1;
+	} else if (strcmp (format_name, "BC2") == 0 || strcmp (format_name, "DXT3") == 0) {
+		format = TXP_BC2;
+	} else if (strcmp (format_name, "BC3") == 0 || strcmp (format_name, "DXT5") == 0) {
+		format = TXP_BC3;
+	} else {
+		PyErr_SetString (PyExc_RuntimeError, "Format must be one of [RGB, RGBA, BC1/DXT1, BC2/DXT3, BC3/DXT5]");
+		return nullptr;
+	}
+
+	txp_mipmap mipmap;
+	txp texture;
+
+	mipmap.width  = width;
+	mipmap.height = height;
+	mipmap.format = format;
+
+	if (PyBytes_Size (data) != mipmap.get_size ()) {
+		PyErr_SetString (PyExc_RuntimeError, "Data does not match expected size");
+		return nullptr;
+	}
+
+	mipmap.size = mipmap.get_size ();
+	mipmap.data.resize (mipmap.size);
+	memcpy (mipmap.data.data (), PyBytes_AsString (data), mipmap.size);
+
+	texture.has_cube_map  = false;
+	texture.array_size    = 1;
+	texture.mipmaps_count = 1;
+	texture.mipmaps.push_back (mipmap);
+
+	self->real->textures.push_back (texture);
+	py_txp_set_add_name (self, name);
+
+	Py_RETURN_NONE;
+}
+
+// Reads a pillow image into RGBA8 on the scratch arena, RGB images get an opaque alpha channel
+static u8 *
+py_pillow_read_rgba (PyObject *image, i32 *width, i32 *height, bool *has_alpha) {
+	PyObject *py_width  = PyObject_GetAttrString (image, "width");
+	PyObject *py_height = PyObject_GetAttrString (image, "height");
+	PyObject *py_mode   = PyObject_GetAttrString (image, "mode");
+	if (py_width == nullptr || py_height == nullptr || py_mode == nullptr || !PyLong_Check (py_width) || !PyLong_Check (py_height) ||
+	    !PyUnicode_Check (py_mode)) {
+		Py_XDECREF (py_width);
+		Py_XDECREF (py_height);
+		Py_XDECREF (py_mode);
+		PyErr_SetString (PyExc_RuntimeError, "Could not find image.width");
+		return nullptr;
+	}
+
+	*width  = PyLong_AsLong (py_width);
+	*height = PyLong_AsLong (py_height);
+	Py_DECREF (py_width);
+	Py_DECREF (py_height);
+
+	PyObject *bytes = PyUnicode_AsUTF8String (py_mode);
+	Py_DECREF (py_mode);
+	if (strcmp (PyBytes_AsString (bytes), "RGB") == 0) {
+		*has_alpha = false;
+	} else if (strcmp (PyBytes_AsString (bytes), "RGBA") == 0) {
+		*has_alpha = true;
+	} else {
+		Py_DECREF (bytes);
+		PyErr_SetString (PyExc_RuntimeError, "Image mode must be RGB or RGBA");
+		return nullptr;
+	}
+	Py_DECREF (bytes);
+
+	PyObject *image_data = PyObject_CallMethod (image, "tobytes", nullptr);
+	if (image_data == nullptr || !PyBytes_Check (image_data)) {
+		Py_XDECREF (image_data);
+		PyErr_SetString (PyExc_RuntimeError, "Could not call image.tobytes");
+		return nullptr;
+	}
+
+	u64 count = (u64)*width * *height;
+	if ((u64)PyBytes_Size (image_data) != count * (*has_alpha ? 4 : 3)) {
+		Py_DECREF (image_data);
+		PyErr_SetString (PyExc_RuntimeError, "Image data does not match image size");
+		return nullptr;
+	}
+
+	const u8 *data = (const u8 *)PyBytes_AsString (image_data);
+	u8 *rgba       = scratch_arena::get ().allocate<u8> (count * 4);
+	if (*has_alpha) {
+		memcpy (rgba, data, count * 4);
+	} else {
+		for (u64 i = 0; i < count; i++) {
+			rgba[i * 4 + 0] = data[i * 3 + 0];
+			rgba[i * 4 + 1] = data[i * 3 + 1];
+			rgba[i * 4 + 2] = data[i * 3 + 2];
+			rgba[i * 4 + 3] = 255;
+		}
+	}
+	Py_DECREF (image_data);
+
+	return rgba;
+}
+
+// Encoding for a format name of add_texture_pillow, RGB is promoted to RGBA later when the image has alpha
+static bool
+py_texture_get_encoding (const char *format, texture_encoding *encoding) {
+	if (strcmp (format, "RGB") == 0 || strcmp (format, "RGBA") == 0) {
+		*encoding = TEXTURE_ENCODING_RGB;
+	} else if (strcmp (format, "BC3") == 0 || strcmp (format, "DXT5") == 0) {
+		*encoding = TEXTURE_ENCODING_BC3;
+	} else if (strcmp (format, "BC5") == 0 || strcmp (format, "ATI2") == 0) {
+		*encoding = TEXTURE_ENCODING_BC5_YCBCR;
+	} else if (strcmp (format, "BC7") == 0) {
+		*encoding = TEXTURE_ENCODING_BC7;
+	} else {
+		PyErr_SetString (PyExc_RuntimeError, "Unknown pixel format");
+		return false;
+	}
+	return true;
+}
+
+static PyObject *
+py_txp_set_add_texture_pillow (pyobject_txp_set *self, PyObject *args, PyObject *kwds) {
+	const char *name;
+	PyObject *image;
+	const char *format = "ATI2";
+	bool mipmaps       = false;
+	bool cube_map      = false;
+	char *kwlist[]     = {"name", "image", "format", "mipmaps", "cube_map", nullptr};
+	if (!PyArg_ParseTupleAndKeywords (args, kwds, "sO|sbb", kwlist, &name, &image, &format, &mipmaps, &cube_map)) return nullptr;
+
+	texture_encoding encoding;
+	if (!py_texture_get_encoding (format, &encoding)) return nullptr;
+
+	if (mipmaps && encoding == TEXTURE_ENCODING_BC5_YCBCR) {
+		PyErr_SetString (PyExc_RuntimeError, "BC5/ATI2 textures store their CbCr plane as the second mipmap and cannot have mipmaps");
+		return nullptr;
+	}
+
+	// A list or tuple of images becomes a texture array, or the six faces of a cube map
+	bool is_array           = PyList_Check (image) || PyTuple_Check (image);
+	Py_ssize_t layers_count = is_array ? PySequence_Size (image) : 1;
+	if (layers_count < 1) {
+		PyErr_SetString (PyExc_RuntimeError, "Image list must not be empty");
+		return nullptr;
+	} else if (cube_map && layers_count != 6) {
+		PyErr_SetString (PyExc_RuntimeError, "Cube maps need exactly 6 images (+X, -X, +Y, -Y, +Z, -Z)");
+		return nullptr;
+	}
+
+	i32 width;
+	i32 height;
+	bool has_alpha = false;
+	scratch_scope scope;
+	const u8 **layers = scope.arena.allocate<const u8 *> (layers_count);
+	for (Py_ssize_t i = 0; i < layers_count; i++) {
+		PyObject *layer = is_array ? PySequence_GetItem (image, i) : image;
+		if (layer == nullptr) return nullptr;
+
+		i32 layer_width;
+		i32 layer_height;
+		bool layer_has_alpha;
+		layers[i] = py_pillow_read_rgba (layer, &layer_width, &layer_height, &layer_has_alpha);
+		if (is_array) Py_DECREF (layer);
+		if (layers[i] == nullptr) return nullptr;
+
+		if (i == 0) {
+			width  = layer_width;
+			height = layer_height;
+		} else if (layer_width != width || layer_height != height) {
+			PyErr_SetString (PyExc_RuntimeError, "All images must have the same size");
+			return nullptr;
+		}
+		has_alpha |= layer_has_alpha;
+	}
+
+	// Uncompressed textures keep the layout of the source image
+	if (encoding == TEXTURE_ENCODING_RGB && has_alpha) encoding = TEXTURE_ENCODING_RGBA;
+
+	txp texture;
+	Py_BEGIN_ALLOW_THREADS;
+	texture_encode (&texture, layers, layers_count, width, height, encoding, mipmaps ? texture_get_mipmaps_count (width, height) : 1, cube_map);
+	Py_END_ALLOW_THREADS;
+
+	self->real->textures.push_back (texture);
+	py_txp_set_add_name (self, name);
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_txp_set_get_texture_id (pyobject_txp_set *self, PyObject *args) {
+	const char *name;
+	if (!PyArg_ParseTuple (args, "s", &name)) return nullptr;
+
+	auto it = self->ids->find (name);
+	if (it != self->ids->end ()) return PyLong_FromLong (it->second);
+
+	PyErr_SetString (PyExc_RuntimeError, "Could not find texture");
+	return nullptr;
+}
+
+// Ids of every name of an iterable, looked up without a Python call per name
+static PyObject *
+py_txp_set_get_texture_ids (pyobject_txp_set *self, PyObject *args) {
+	PyObject *names;
+	if (!PyArg_ParseTuple (args, "O", &names)) return nullptr;
+
+	PyObject *iter = PyObject_GetIter (names);
+	if (iter == nullptr) return nullptr;
+
+	PyObject *ids = PyList_New (0);
+	PyObject *item;
+	while (ids != nullptr && (item = PyIter_Next (iter)) != nullptr) {
+		const char *name = PyUnicode_Check (item) ? PyUnicode_AsUTF8AndSize (item, nullptr) : nullptr;
+		auto it          = name != nullptr ? self->ids->find (name) : self->ids->end ();
+		if (name == nullptr) {
+			if (!PyErr_Occurred ()) PyErr_SetString (PyExc_TypeError, "Names must be strings");
+		} else if (it == self->ids->end ()) {
+			PyErr_Format (PyExc_RuntimeError, "Could not find texture %s", name);
+		}
+		Py_DECREF (item);
+		if (it == self->ids->end ()) break;
+
+		PyObject *id = PyLong_FromLong (it->second);
+		if (id == nullptr || PyList_Append (ids, id) < 0) Py_CLEAR (ids);
+		Py_XDECREF (id);
+	}
+	Py_DECREF (iter);
+	if (PyErr_Occurred ()) Py_CLEAR (ids);
+
+	return ids;
+}
+
+// Textures of the set as they are packed, borrowed mipmaps point into the source
+static std::vector<texture_pack_entry>
+py_txp_set_get_pack_entries (pyobject_txp_set *self) {
+	std::vector<texture_pack_entry> textures = texture_pack_snapshot (self->real);
+	for (size_t i = 0; i < self->borrowed->size (); i++)
+		textures[i] = self->borrowed->at (i);
+	return textures;
+}
+
+// Copies the borrowed mipmaps into the textures, for KKdLib, which only packs what the set holds.
+// The source stays referenced, packs running without the GIL may still read from it.
+static void
+py_txp_set_materialize (pyobject_txp_set *self) {
+	for (size_t i = 0; i < self->borrowed->size (); i++) {
+		const texture_pack_entry &entry = self->borrowed->at (i);
+		for (size_t j = 0; j < entry.mipmaps.size (); j++) {
+			txp_mipmap &mipmap = self->real->textures[i].mipmaps[j];
+			if (mipmap.data.empty ()) mipmap.data.assign (entry.mipmaps[j].data, entry.mipmaps[j].data + entry.mipmaps[j].size);
+		}
+	}
+}
+
+// Borrows the textures of the set for packing without the GIL, false with an exception set when it has none.
+// Other threads may add textures to the same set meanwhile, those are left out.
+static bool
+py_txp_set_snapshot (pyobject_txp_set *self, std::vector<texture_pack_entry> *textures, u64 *size) {
+	if (self->real->textures.empty ()) {
+		PyErr_SetString (PyExc_TypeError, "txp_set has no textures");
+		return false;
+	}
+
+	*textures = py_txp_set_get_pack_entries (self);
+	*size     = texture_pack_get_size (*textures);
+	return true;
+}
+
+static PyObject *
+py_txp_set_to_bytes (pyobject_txp_set *self, PyObject *args) {
+	std::vector<texture_pack_entry> textures;
+	u64 size;
+	if (!py_txp_set_snapshot (self, &textures, &size)) return nullptr;
+
+	// Packed straight into the bytes object, nothing else sees it until it is returned
+	PyObject *result = PyBytes_FromStringAndSize (nullptr, size);
+	if (result == nullptr) return nullptr;
+
+	u8 *data = (u8 *)PyBytes_AsString (result);
+	Py_BEGIN_ALLOW_THREADS;
+	texture_pack (data, textures);
+	Py_END_ALLOW_THREADS;
+	return result;
+}
+
+static PyObject *
+py_txp_set_write (pyobject_txp_set *self, PyObject *args) {
+	const char *path;
+	if (!PyArg_ParseTuple (args, "s", &path)) return nullptr;
+
+	std::vector<texture_pack_entry> textures;
+	u64 size;
+	if (!py_txp_set_snapshot (self, &textures, &size)) return nullptr;
+
+	bool allocated;
+	bool result = false;
+	Py_BEGIN_ALLOW_THREADS;
+	u8 *data  = (u8 *)malloc (size);
+	allocated = data != nullptr;
+	if (allocated) {
+		texture_pack (data, textures);
+		result = py_write_file (path, data, size);
+	}
+	Py_END_ALLOW_THREADS;
+	if (!allocated) return PyErr_NoMemory ();
+	if (!result) {
+		PyErr_Format (PyExc_RuntimeError, "Could not write %s", path);
+		return nullptr;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef pymethods_txp_set[] = {{"add_texture_data", (PyCFunction)py_txp_set_add_texture_data, METH_VARARGS,
+                                           "Add textures to set (name, width, height, format: [RGB, RGBA, BC1/DXT1, BC2/DXT3, BC3/DXT5], data)"},
+                                          {"add_texture_pillow", (PyCFunction)py_txp_set_add_texture_pillow, METH_VARARGS | METH_KEYWORDS,
+                                           "Add a texture from pillow (name, image or list of images, compression: [RGB/RGBA, BC3/DXT5, BC5/ATI2, BC7], mipmaps: bool, cube_map: bool)"},
+                                          {"get_texture_id", (PyCFunction)py_txp_set_get_texture_id, METH_VARARGS, "Get the id for a texture (name)"},
+                                          {"get_texture_ids", (PyCFunction)py_txp_set_get_texture_ids, METH_VARARGS,
+                                           "Get the ids for a list of textures (names)"},
+                                          {"to_bytes", (PyCFunction)py_txp_set_to_bytes, METH_NOARGS, "Pack texture set to bytes ()"},
+                                          {"write", (PyCFunction)py_txp_set_write, METH_VARARGS, "Pack texture set to a file (path)"},
+                                          {nullptr}};
+
+static PyType_Slot pyslots_txp_set[] = {
+    {Py_tp_init, (void *)py_txp_set_init},
+    {Py_tp_finalize, (void *)py_txp_set_finalize},
+    {Py_tp_methods, pymethods_txp_set},
+    {0},
+};
+
+PYTHON_TYPE_DEF (txp_set);
+
+struct pyobject_sprite_info {
+	PyObject_HEAD;
+	spr::SprInfo spr_info;
+	SpriteData spr_data;
+	std::string *name;
+};
+
+static int
 py_sprite_info_init (pyobject_sprite_info *self, PyObject *args, PyObject *kwds) {
 	self->name = new std::string ();
 	return 0;
 }
 
 void
-py_sprite_info_finalize (pyobject_sprite_info *self) {
-	delete self->name;
+py_sprite_info_finalize (pyobject_sprite_info *self) {
+	delete self->name;
+}
+
+static PyObject *
+py_sprite_info_name_get (pyobject_sprite_info *self, void *closure) {
+	return PyUnicode_FromString (self->name->c_str ());
+}
+
+static int
+py_sprite_info_name_set (pyobject_sprite_info *self, PyObject *value, void *closure) {
+	if (value == nullptr || !PyUnicode_Check (value)) {
+		PyErr_SetString (PyExc_TypeError, "Name must be string");
+		return -1;
+	}
+
+	PyObject *bytes = PyUnicode_AsUTF8String (value);
+	self->name->assign (PyBytes_AsString (bytes));
+	Py_DECREF (bytes);
+
+	return 0;
+}
+
+static PyObject *
+py_sprite_info_resolution_mode_get (pyobject_sprite_info *self, void *closure) {
+	switch ((i32)self->spr_data.resolution_mode) {
+	case 0x00: return PyUnicode_FromString ("QVGA");
+	case 0x01: return PyUnicode_FromString ("VGA");
+	case 0x02: return PyUnicode_FromString ("SVGA");
+	case 0x03: return PyUnicode_FromString ("XGA");
+	case 0x04: return PyUnicode_FromString ("SXGA");
+	case 0x05: return PyUnicode_FromString ("SXGAPlus");
+	case 0x06: return PyUnicode_FromString ("UXGA");
+	case 0x07: return PyUnicode_FromString ("WVGA");
+	case 0x08: return PyUnicode_FromString ("WSVGA");
+	case 0x09: return PyUnicode_FromString ("WXGA");
+	case 0x0A: return PyUnicode_FromString ("FWXGA");
+	case 0x0B: return PyUnicode_FromString ("WUXGA");
+	case 0x0C: return PyUnicode_FromString ("WQXGA");
+	case 0x0D: return PyUnicode_FromString ("HD");
+	case 0x0E: return PyUnicode_FromString ("FHD");
+	case 0x0F: return PyUnicode_FromString ("UHD");
+	case 0x10: return PyUnicode_FromString ("3KatUHD");
+	case 0x11: return PyUnicode_FromString ("3K");
+	case 0x12: return PyUnicode_FromString ("QHD");
+	case 0x13: return PyUnicode_FromString ("WQVGA");
+	case 0x14: return PyUnicode_FromString ("qHD");
+	case 0x15: return PyUnicode_FromString ("XGAPlus");
+	case 0x16: return PyUnicode_FromString ("1176x664");
+	case 0x17: return PyUnicode_FromString ("1200x960");
+	case 0x18: return PyUnicode_FromString ("WXGA1280x900");
+	case 0x19: return PyUnicode_FromString ("SXGAMinus");
+	case 0x1A: return PyUnicode_FromString ("FWXGA1366x768");
+	case 0x1B: return PyUnicode_FromString ("WXGAPlus");
+	case 0x1C: return PyUnicode_FromString ("HDPlus");
+	case 0x1D: return PyUnicode_FromString ("WSXGA");
+	case 0x1E: return PyUnicode_FromString ("WSXGAPlus");
+	case 0x1F: return PyUnicode_FromString ("1920x1440");
+	case 0x20: return PyUnicode_FromString ("QWXGA");
+	default: {
+		PyErr_SetString (PyExc_TypeError, "Unknnown Resolution mode");
+		return nullptr;
+	}; break;
+	}
+}
+
+static int
+py_sprite_info_resolution_mode_set (pyobject_sprite_info *self, PyObject *value, void *closure) {
+	if (value == nullptr || !PyUnicode_Check (value)) {
+		PyErr_SetString (PyExc_TypeError, "Resolution mode must be string");
+		return -1;
+	}
+
+	PyObject *bytes    = PyUnicode_AsUTF8String (value);
+	const char *string = PyBytes_AsString (bytes);
+	if (strcmp (string, "QVGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x00;
+	else if (strcmp (string, "VGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x01;
+	else if (strcmp (string, "SVGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x02;
+	else if (strcmp (string, "XGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x03;
+	else if (strcmp (string, "SXGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x04;
+	else if (strcmp (string, "SXGAPlus") == 0) self->spr_data.resolution_mode = (resolution_mode)0x05;
+	else if (strcmp (string, "UXGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x06;
+	else if (strcmp (string, "WVGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x07;
+	else if (strcmp (string, "WSVGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x08;
+	else if (strcmp (string, "WXGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x09;
+	else if (strcmp (string, "FWXGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0A;
+	else if (strcmp (string, "WUXGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0B;
+	else if (strcmp (string, "WQXGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0C;
+	else if (strcmp (string, "HD") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0D;
+	else if (strcmp (string, "HDTV720") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0D;
+	else if (strcmp (string, "FHD") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0E;
+	else if (strcmp (string, "HDTV1080") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0E;
+	else if (strcmp (string, "UHD") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0F;
+	else if (strcmp (string, "3KatUHD") == 0) self->spr_data.resolution_mode = (resolution_mode)0x10;
+	else if (strcmp (string, "3K") == 0) self->spr_data.resolution_mode = (resolution_mode)0x11;
+	else if (strcmp (string, "QHD") == 0) self->spr_data.resolution_mode = (resolution_mode)0x12;
+	else if (strcmp (string, "WQVGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x13;
+	else if (strcmp (string, "qHD") == 0) self->spr_data.resolution_mode = (resolution_mode)0x14;
+	else if (strcmp (string, "XGAPlus") == 0) self->spr_data.resolution_mode = (resolution_mode)0x15;
+	else if (strcmp (string, "1176x664") == 0) self->spr_data.resolution_mode = (resolution_mode)0x16;
+	else if (strcmp (string, "1200x960") == 0) self->spr_data.resolution_mode = (resolution_mode)0x17;
+	else if (strcmp (string, "WXGA1280x900") == 0) self->spr_data.resolution_mode = (resolution_mode)0x18;
+	else if (strcmp (string, "SXGAMinus") == 0) self->spr_data.resolution_mode = (resolution_mode)0x19;
+	else if (strcmp (string, "FXWGA1366x768") == 0) self->spr_data.resolution_mode = (resolution_mode)0x1A;
+	else if (strcmp (string, "WXGAPlus") == 0) self->spr_data.resolution_mode = (resolution_mode)0x1B;
+	else if (strcmp (string, "HDPlus") == 0) self->spr_data.resolution_mode = (resolution_mode)0x1C;
+	else if (strcmp (string, "WSXGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x1D;
+	else if (strcmp (string, "WSXGAPLus") == 0) self->spr_data.resolution_mode = (resolution_mode)0x1E;
+	else if (strcmp (string, "1920x1440") == 0) self->spr_data.resolution_mode = (resolution_mode)0x1F;
+	else if (strcmp (string, "QXWGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x20;
+	else {
+		PyErr_SetString (PyExc_TypeError, "Unknown resolution mode");
+		return -1;
+	}
+	Py_DECREF (bytes);
+
+	return 0;
+}
+
+static PyGetSetDef pygetsets_sprite_info[] = {
+    {"name", (getter)py_sprite_info_name_get, (setter)py_sprite_info_name_set, nullptr, nullptr},
+    {"resolution_mode", (getter)py_sprite_info_resolution_mode_get, (setter)py_sprite_info_resolution_mode_set, nullptr, nullptr},
+    {nullptr}};
+
+static PyMemberDef pymembers_sprite_info[] = {
+    {"texid", T_UINT, offsetof (pyobject_sprite_info, spr_info) + offsetof (spr::SprInfo, texid), 0, nullptr},
+    {"rotate", T_INT, offsetof (pyobject_sprite_info, spr_info) + offsetof (spr::SprInfo, rotate), 0, nullptr},
+    {"x", T_FLOAT, offsetof (pyobject_sprite_info, spr_info) + offsetof (spr::SprInfo, px), 0, nullptr},
+    {"y", T_FLOAT, offsetof (pyobject_sprite_info, spr_info) + offsetof (spr::SprInfo, py), 0, nullptr},
+    {"width", T_FLOAT, offsetof (pyobject_sprite_info, spr_info) + offsetof (spr::SprInfo, width), 0, nullptr},
+    {"height", T_FLOAT, offsetof (pyobject_sprite_info, spr_info) + offsetof (spr::SprInfo, height), 0, nullptr},
+    {"attr", T_UINT, offsetof (pyobject_sprite_info, spr_data) + offsetof (SpriteData, attr), 0, nullptr},
+    {nullptr}};
+
+static PyType_Slot pyslots_sprite_info[] = {{Py_tp_init, (void *)py_sprite_info_init},
+                                            {Py_tp_finalize, (void *)py_sprite_info_finalize},
+                                            {Py_tp_getset, pygetsets_sprite_info},
+                                            {Py_tp_members, pymembers_sprite_info},
+                                            {0}};
+
+PYTHON_TYPE_DEF (sprite_info);
+
+struct pyobject_spr_set {
+	PyObject_HEAD;
+	spr_set real;
+	// Owner of real.txp, textures are shared with the txp_set instead of copied
+	pyobject_txp_set *txp;
+	// Entries allocated in real.sprinfo, real.sprname and real.sprdata, which grow by doubling
+	u32 sprite_capacity;
+};
+
+static bool py_spr_set_load (pyobject_spr_set *self, PyObject *source);
+
+static int
+py_spr_set_init (pyobject_spr_set *self, PyObject *args, PyObject *kwds) {
+	const char *path = nullptr;
+	PyObject *data   = nullptr;
+	char *kwlist[]   = {"path", "data", nullptr};
+	if (!PyArg_ParseTupleAndKeywords (args, kwds, "|zO", kwlist, &path, &data)) return -1;
+
+	self->real.ready      = true;
+	self->real.modern     = false;
+	self->real.big_endian = false;
+	self->real.is_x       = false;
+
+	self->real.flag           = 0;
+	self->real.num_of_texture = 0;
+	self->real.num_of_sprite  = 0;
+	self->real.sprinfo        = nullptr;
+	self->real.texname        = nullptr;
+	self->real.sprname        = nullptr;
+	self->real.sprdata        = nullptr;
+	self->real.txp            = nullptr;
+	self->txp                 = nullptr;
+	self->sprite_capacity     = 0;
+
+	if (path != nullptr) {
+		// Read rather than mapped, textures borrow from it and the file may be written again while they do
+		mapped_file map;
+		bool result;
+		Py_BEGIN_ALLOW_THREADS;
+		result = map.open (path);
+		Py_END_ALLOW_THREADS;
+		if (!result) {
+			PyErr_Format (PyExc_RuntimeError, "Could not open %s", path);
+			return -1;
+		}
+
+		PyObject *bytes = PyBytes_FromStringAndSize (nullptr, map.get_size ());
+		if (bytes == nullptr) return -1;
+		Py_BEGIN_ALLOW_THREADS;
+		memcpy (PyBytes_AsString (bytes), map.get_data (), map.get_size ());
+		map.close ();
+		Py_END_ALLOW_THREADS;
+		result = py_spr_set_load (self, bytes);
+		Py_DECREF (bytes);
+		if (!result) return -1;
+	} else if (data != nullptr && PyObject_TypeCheck (data, pytype_farc_file)) {
+		PyObject *bytes = py_farc_file_get_bytes ((pyobject_farc_file *)data);
+		if (bytes == nullptr) return -1;
+		bool result = bytes != Py_None && py_spr_set_load (self, bytes);
+		if (bytes == Py_None) PyErr_SetString (PyExc_RuntimeError, "farc_file has no data");
+		Py_DECREF (bytes);
+		if (!result) return -1;
+	} else if (data != nullptr && PyBytes_Check (data)) {
+		if (!py_spr_set_load (self, data)) return -1;
+	} else if (data != nullptr) {
+		PyErr_SetString (PyExc_TypeError, "Data must be bytes or farc_file");
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+py_spr_set_finalize (pyobject_spr_set *self) {
+	if (self->real.sprinfo != nullptr) free (self->real.sprinfo);
+	if (self->real.texname != nullptr) {
+		for (i32 i = 0; i < self->real.num_of_texture; i++)
+			free ((void *)self->real.texname[i]);
+		free (self->real.texname);
+	}
+	if (self->real.sprname != nullptr) {
+		for (i32 i = 0; i < self->real.num_of_sprite; i++)
+			free ((void *)self->real.sprname[i]);
+		free (self->real.sprname);
+	}
+	if (self->real.sprdata != nullptr) free (self->real.sprdata);
+	Py_CLEAR (self->txp);
+}
+
+// Mirrors the texture names of the shared txp_set, which may have gained textures since it was assigned
+static void
+py_spr_set_update_texname (pyobject_spr_set *self) {
+	if (self->real.texname != nullptr) {
+		for (i32 i = 0; i < self->real.num_of_texture; i++)
+			free ((void *)self->real.texname[i]);
+		free (self->real.texname);
+	}
+
+	self->real.num_of_texture = self->txp->real->textures.size ();
+	self->real.texname        = (const char **)malloc (sizeof (char *) * self->txp->names->size ());
+	for (u64 i = 0; i < self->txp->names->size (); i++) {
+		self->real.texname[i] = (const char *)calloc (self->txp->names->at (i).size () + 1, sizeof (char));
+		strcpy ((char *)self->real.texname[i], self->txp->names->at (i).c_str ());
+	}
 }
 
 static PyObject *
-py_sprite_info_name_get (pyobject_sprite_info *self, void *closure) {
-	return PyUnicode_FromString (self->name->c_str ());
+py_spr_set_txp_get (pyobject_spr_set *self, void *closure) {
+	if (self->txp == nullptr) Py_RETURN_NONE;
+
+	Py_INCREF (self->txp);
+	return (PyObject *)self->txp;
 }
 
 static int
-py_sprite_info_name_set (pyobject_sprite_info *self, PyObject *value, void *closure) {
-	if (value == nullptr || !PyUnicode_Check (value)) {
-		PyErr_SetString (PyExc_TypeError, "Name must be string");
+py_spr_set_txp_set (pyobject_spr_set *self, PyObject *value, void *closure) {
+	if (value == nullptr || !PyObject_TypeCheck (value, pytype_txp_set)) {
+		PyErr_SetString (PyExc_TypeError, "txp must be KKdLib.txp_set");
 		return -1;
 	}
 
-	PyObject *bytes = PyUnicode_AsUTF8String (value);
-	self->name->assign (PyBytes_AsString (bytes));
-	Py_DECREF (bytes);
+	pyobject_txp_set *txp = (pyobject_txp_set *)value;
+	if (txp->real->textures.size () == 0) {
+		PyErr_SetString (PyExc_TypeError, "txp must have textures");
+		return -1;
+	}
+
+	// O(1), the spr_set keeps the txp_set alive and packs its textures in place
+	pyobject_txp_set *old = self->txp;
+	Py_INCREF (txp);
+	self->txp      = txp;
+	self->real.txp = txp->real;
+	Py_XDECREF (old);
+	py_spr_set_update_texname (self);
 
 	return 0;
 }
 
+// Makes room for count sprites, at least doubling the arrays so adding one sprite at a time stays linear
+static void
+py_spr_set_reserve (pyobject_spr_set *self, u64 count) {
+	if (count <= self->sprite_capacity) return;
+
+	u64 capacity          = std::max<u64> (count, (u64)self->sprite_capacity * 2);
+	self->real.sprinfo    = (spr::SprInfo *)realloc (self->real.sprinfo, sizeof (spr::SprInfo) * capacity);
+	self->real.sprname    = (const char **)realloc (self->real.sprname, sizeof (char *) * capacity);
+	self->real.sprdata    = (SpriteData *)realloc (self->real.sprdata, sizeof (SpriteData) * capacity);
+	self->sprite_capacity = capacity;
+}
+
+static void
+py_spr_set_append (pyobject_spr_set *self, pyobject_sprite_info *sprite_info) {
+	py_spr_set_reserve (self, (u64)self->real.num_of_sprite + 1);
+
+	u32 index                 = self->real.num_of_sprite;
+	self->real.sprinfo[index] = sprite_info->spr_info;
+	self->real.sprname[index] = (const char *)calloc (sprite_info->name->size () + 1, sizeof (char));
+	strcpy ((char *)self->real.sprname[index], sprite_info->name->c_str ());
+	self->real.sprdata[index] = sprite_info->spr_data;
+	self->real.num_of_sprite++;
+}
+
+static u32
+py_spr_set_load_u32 (const u8 *data) {
+	u32 value;
+	memcpy (&value, data, 4);
+	return value;
+}
+
+// Texture set of a classic little endian sprite set, which starts with the flags, the offset of the texture set
+// and the texture count. Only padding may follow the texture set, everything else has to come before it.
+static bool
+py_spr_set_find_textures (const u8 *data, u64 size, std::vector<texture_pack_entry> *textures, u64 *offset) {
+	if (size < 0x10 || memcmp (data, "SPRC", 4) == 0) return false;
+
+	u64 end;
+	*offset = py_spr_set_load_u32 (data + 0x04);
+	if (*offset < 0x10 || *offset > size || !texture_pack_parse (data + *offset, size - *offset, textures, &end)) return false;
+	if (textures->size () != py_spr_set_load_u32 (data + 0x08) || size - *offset - end >= 0x10) return false;
+
+	for (u64 i = *offset + end; i < size; i++)
+		if (data[i] != 0) return false;
+	return true;
+}
+
+// Takes the sprites and textures of a packed set held by the bytes object source.
+// Classic sets have their mipmaps borrowed from source, KKdLib only unpacks the sprites in front of them,
+// so textures nobody touches go back out through pack without being copied. Mipmaps of other sets are moved
+// into the new txp_set as KKdLib unpacked them. Either way they stay encoded.
+static bool
+py_spr_set_load (pyobject_spr_set *self, PyObject *source) {
+	const u8 *data = (const u8 *)PyBytes_AsString (source);
+	u64 size       = PyBytes_Size (source);
+
+	pyobject_txp_set *txp = (pyobject_txp_set *)PyObject_CallNoArgs ((PyObject *)pytype_txp_set);
+	if (txp == nullptr) return false;
+
+	bool result;
+	bool borrowed = false;
+	Py_BEGIN_ALLOW_THREADS;
+	prj::shared_ptr<prj::stack_allocator> alloc (new prj::stack_allocator);
+	spr_set classic;
+	spr_set whole;
+	spr_set *loaded = &classic;
+
+	// The sprites followed by an empty texture set where the real one starts
+	std::vector<texture_pack_entry> textures;
+	std::vector<u8> sprites;
+	u64 offset;
+	if (py_spr_set_find_textures (data, size, &textures, &offset)) {
+		sprites.resize (offset + 0x0C);
+		memcpy (sprites.data (), data, offset);
+		texture_pack (sprites.data () + offset, {});
+		classic.unpack_file (alloc, sprites.data (), sprites.size (), false);
+		borrowed = classic.ready && classic.txp != nullptr && classic.txp->textures.empty () && classic.num_of_texture == textures.size ();
+	}
+	if (!borrowed) {
+		whole.unpack_file (alloc, data, size, size >= 4 && memcmp (data, "SPRC", 4) == 0);
+		loaded = &whole;
+	}
+
+	result = loaded->ready && loaded->txp != nullptr;
+	if (result) {
+		self->real.modern     = loaded->modern;
+		self->real.big_endian = loaded->big_endian;
+		self->real.is_x       = loaded->is_x;
+		self->real.flag       = loaded->flag;
+
+		if (borrowed) {
+			for (const texture_pack_entry &entry : textures) {
+				::txp &texture        = txp->real->textures.emplace_back ();
+				texture.has_cube_map  = entry.cube_map;
+				texture.array_size    = entry.array_size;
+				texture.mipmaps_count = entry.mipmaps_count;
+				for (const texture_pack_mipmap &mipmap : entry.mipmaps) {
+					txp_mipmap &header = texture.mipmaps.emplace_back ();
+					header.width       = mipmap.width;
+					header.height      = mipmap.height;
+					header.format      = (txp_format)mipmap.format;
+					header.size        = mipmap.size;
+				}
+			}
+			*txp->borrowed = std::move (textures);
+		} else {
+			txp->real->textures = std::move (loaded->txp->textures);
+		}
+		for (u32 i = 0; i < txp->real->textures.size (); i++)
+			py_txp_set_add_name (txp, i < loaded->num_of_texture ? loaded->texname[i] : "");
+
+		py_spr_set_reserve (self, loaded->num_of_sprite);
+		for (u32 i = 0; i < loaded->num_of_sprite; i++) {
+			self->real.sprinfo[i] = loaded->sprinfo[i];
+			self->real.sprdata[i] = loaded->sprdata[i];
+			self->real.sprname[i] = (const char *)calloc (strlen (loaded->sprname[i]) + 1, sizeof (char));
+			strcpy ((char *)self->real.sprname[i], loaded->sprname[i]);
+		}
+		self->real.num_of_sprite = loaded->num_of_sprite;
+	}
+	Py_END_ALLOW_THREADS;
+	if (!result) {
+		Py_DECREF (txp);
+		PyErr_SetString (PyExc_RuntimeError, "Could not read sprite set");
+		return false;
+	}
+
+	if (borrowed) {
+		Py_INCREF (source);
+		txp->source = source;
+	}
+	self->txp      = txp;
+	self->real.txp = txp->real;
+	py_spr_set_update_texname (self);
+	return true;
+}
+
 static PyObject *
-py_sprite_info_resolution_mode_get (pyobject_sprite_info *self, void *closure) {
-	switch ((i32)self->spr_data.resolution_mode) {
-	case 0x00: return PyUnicode_FromString ("QVGA");
-	case 0x01: return PyUnicode_FromString ("VGA");
-	case 0x02: return PyUnicode_FromString ("SVGA");
-	case 0x03: return PyUnicode_FromString ("XGA");
-	case 0x04: return PyUnicode_FromString ("SXGA");
-	case 0x05: return PyUnicode_FromString ("SXGAPlus");
-	case 0x06: return PyUnicode_FromString ("UXGA");
-	case 0x07: return PyUnicode_FromString ("WVGA");
-	case 0x08: return PyUnicode_FromString ("WSVGA");
-	case 0x09: return PyUnicode_FromString ("WXGA");
-	case 0x0A: return PyUnicode_FromString ("FWXGA");
-	case 0x0B: return PyUnicode_FromString ("WUXGA");
-	case 0x0C: return PyUnicode_FromString ("WQXGA");
-	case 0x0D: return PyUnicode_FromString ("HD");
-	case 0x0E: return PyUnicode_FromString ("FHD");
-	case 0x0F: return PyUnicode_FromString ("UHD");
-	case 0x10: return PyUnicode_FromString ("3KatUHD");
-	case 0x11: return PyUnicode_FromString ("3K");
-	case 0x12: return PyUnicode_FromString ("QHD");
-	case 0x13: return PyUnicode_FromString ("WQVGA");
-	case 0x14: return PyUnicode_FromString ("qHD");
-	case 0x15: return PyUnicode_FromString ("XGAPlus");
-	case 0x16: return PyUnicode_FromString ("1176x664");
-	case 0x17: return PyUnicode_FromString ("1200x960");
-	case 0x18: return PyUnicode_FromString ("WXGA1280x900");
-	case 0x19: return PyUnicode_FromString ("SXGAMinus");
-	case 0x1A: return PyUnicode_FromString ("FWXGA1366x768");
-	case 0x1B: return PyUnicode_FromString ("WXGAPlus");
-	case 0x1C: return PyUnicode_FromString ("HDPlus");
-	case 0x1D: return PyUnicode_FromString ("WSXGA");
-	case 0x1E: return PyUnicode_FromString ("WSXGAPlus");
-	case 0x1F: return PyUnicode_FromString ("1920x1440");
-	case 0x20: return PyUnicode_FromString ("QWXGA");
-	default: {
-		PyErr_SetString (PyExc_TypeError, "Unknnown Resolution mode");
+py_spr_set_add_sprite (pyobject_spr_set *self, PyObject *args) {
+	pyobject_sprite_info *sprite_info;
+	if (!PyArg_ParseTuple (args, "O!", pytype_sprite_info, &sprite_info)) return nullptr;
+
+	py_spr_set_append (self, sprite_info);
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_spr_set_add_sprites (pyobject_spr_set *self, PyObject *args) {
+	PyObject *sprites;
+	if (!PyArg_ParseTuple (args, "O", &sprites)) return nullptr;
+
+	PyObject *iter = PyObject_GetIter (sprites);
+	if (iter == nullptr) return nullptr;
+
+	// Sized iterables are reserved for at once, anything else grows as it goes
+	Py_ssize_t size = PyObject_Size (sprites);
+	if (size < 0) PyErr_Clear ();
+	else py_spr_set_reserve (self, (u64)self->real.num_of_sprite + size);
+
+	// Either every sprite is added or none
+	u32 start = self->real.num_of_sprite;
+	PyObject *item;
+	while ((item = PyIter_Next (iter)) != nullptr) {
+		if (!PyObject_TypeCheck (item, pytype_sprite_info)) {
+			PyErr_SetString (PyExc_TypeError, "Sprites must be KKdLib.sprite_info");
+			Py_DECREF (item);
+			break;
+		}
+		py_spr_set_append (self, (pyobject_sprite_info *)item);
+		Py_DECREF (item);
+	}
+	Py_DECREF (iter);
+
+	if (PyErr_Occurred ()) {
+		for (u32 i = start; i < self->real.num_of_sprite; i++)
+			free ((void *)self->real.sprname[i]);
+		self->real.num_of_sprite = start;
 		return nullptr;
-	}; break;
 	}
+
+	Py_RETURN_NONE;
+}
+
+// Packed sprite set. KKdLib packs the sprites in front of an empty texture set with the GIL held,
+// the textures are packed after that on the thread pool without it.
+struct py_spr_set_packed {
+	// malloc'd output of spr_set::pack_file, size bytes of it are used
+	void *data;
+	u64 size;
+	// Borrowed from the txp_set. Empty when KKdLib did not put the textures last, data then holds the whole set.
+	std::vector<texture_pack_entry> textures;
+
+	py_spr_set_packed () : data (nullptr), size (0) {}
+	~py_spr_set_packed () { free (data); }
+
+	u64 get_size () const { return size + (textures.empty () ? 0 : texture_pack_get_size (textures)); }
+
+	// Packs everything into dest, which holds get_size bytes
+	void pack (u8 *dest) const {
+		memcpy (dest, data, size);
+		if (!textures.empty ()) texture_pack (dest + size, textures);
+	}
+
+	bool write (FILE *file) const {
+		if (fwrite (data, 1, size, file) != size) return false;
+		return textures.empty () || texture_pack (textures, [&] (const u8 *data, u64 size) { return fwrite (data, 1, size, file) == size; });
+	}
+};
+
+// Packs the sprites and borrows the textures, false with an exception set when there is nothing to pack.
+// The GIL stays held, the sprites and the txp_set may be shared with other threads.
+static bool
+py_spr_set_pack_data (pyobject_spr_set *self, py_spr_set_packed *packed) {
+	if (self->txp == nullptr || self->real.num_of_sprite == 0) {
+		PyErr_SetString (PyExc_TypeError, "Must set txp and sprites");
+		return false;
+	}
+	py_spr_set_update_texname (self);
+
+	for (i32 i = 0; i < self->real.num_of_sprite; i++) {
+		const txp &texture       = self->real.txp->textures.at (self->real.sprinfo[i].texid);
+		self->real.sprinfo[i].su = self->real.sprinfo[i].px / texture.mipmaps[0].width;
+		self->real.sprinfo[i].sv = self->real.sprinfo[i].py / texture.mipmaps[0].height;
+		self->real.sprinfo[i].eu = (self->real.sprinfo[i].px + self->real.sprinfo[i].width) / texture.mipmaps[0].width;
+		self->real.sprinfo[i].ev = (self->real.sprinfo[i].py + self->real.sprinfo[i].height) / texture.mipmaps[0].height;
+	}
+
+	txp_set empty;
+	empty.ready    = true;
+	self->real.txp = &empty;
+	size_t size    = 0;
+	self->real.pack_file (&packed->data, &size);
+	self->real.txp = self->txp->real;
+	packed->size   = size;
+
+	// Classic little endian sets start with the flags, the offset of the texture set and the texture and sprite counts.
+	// The empty texture set has to be the last thing in the file for the real one to take its place.
+	std::vector<texture_pack_entry> textures = py_txp_set_get_pack_entries (self->txp);
+	u8 tail[0x0C];
+	texture_pack (tail, {});
+	const u8 *data = (const u8 *)packed->data;
+	if (data != nullptr && !self->real.modern && !self->real.big_endian && size >= 0x10 + sizeof (tail) &&
+	    memcmp (data + size - sizeof (tail), tail, sizeof (tail)) == 0 && py_spr_set_load_u32 (data + 0x04) == size - sizeof (tail) &&
+	    py_spr_set_load_u32 (data + 0x08) == textures.size () && py_spr_set_load_u32 (data + 0x0C) == self->real.num_of_sprite) {
+		packed->size    -= sizeof (tail);
+		packed->textures = std::move (textures);
+		return true;
+	}
+
+	free (packed->data);
+	packed->data = nullptr;
+	size         = 0;
+	py_txp_set_materialize (self->txp);
+	self->real.pack_file (&packed->data, &size);
+	packed->size = size;
+	if (packed->data == nullptr) {
+		PyErr_SetString (PyExc_RuntimeError, "Could not pack sprite set");
+		return false;
+	}
+	return true;
+}
+
+// New bytes object holding the packed set, written straight into it without the GIL
+static PyObject *
+py_spr_set_packed_to_bytes (const py_spr_set_packed &packed) {
+	PyObject *result = PyBytes_FromStringAndSize (nullptr, packed.get_size ());
+	if (result == nullptr) return nullptr;
+
+	u8 *data = (u8 *)PyBytes_AsString (result);
+	Py_BEGIN_ALLOW_THREADS;
+	packed.pack (data);
+	Py_END_ALLOW_THREADS;
+	return result;
+}
+
+static PyObject *
+py_spr_set_pack (pyobject_spr_set *self, PyObject *args) {
+	py_spr_set_packed packed;
+	if (!py_spr_set_pack_data (self, &packed)) return nullptr;
+
+	return py_spr_set_packed_to_bytes (packed);
+}
+
+static PyObject *
+py_spr_set_write (pyobject_spr_set *self, PyObject *args) {
+	const char *path;
+	if (!PyArg_ParseTuple (args, "s", &path)) return nullptr;
+
+	py_spr_set_packed packed;
+	if (!py_spr_set_pack_data (self, &packed)) return nullptr;
+
+	// Sprites first, then the textures as they are packed, the whole set is never in memory at once
+	bool result;
+	Py_BEGIN_ALLOW_THREADS;
+	FILE *file = fopen (path, "wb");
+	result     = file != nullptr && packed.write (file);
+	if (file != nullptr) result = fclose (file) == 0 && result;
+	Py_END_ALLOW_THREADS;
+	if (!result) {
+		PyErr_Format (PyExc_RuntimeError, "Could not write %s", path);
+		return nullptr;
+	}
+
+	Py_RETURN_NONE;
+}
+
+// Packs straight into an archive entry. A farc_writer takes over a buffer the set is packed into once,
+// a farc gets a single bytes object, replacing the entry called name when there is one.
+static PyObject *
+py_spr_set_pack_into (pyobject_spr_set *self, PyObject *args) {
+	PyObject *archive;
+	const char *name;
+	PyObject *value = Py_None;
+	if (!PyArg_ParseTuple (args, "Os|O", &archive, &name, &value)) return nullptr;
+
+	i32 level;
+	if (!py_farc_parse_level (value, true, &level)) return nullptr;
+	if (!PyObject_TypeCheck (archive, pytype_farc) && !PyObject_TypeCheck (archive, pytype_farc_writer)) {
+		PyErr_SetString (PyExc_TypeError, "Archive must be farc or farc_writer");
+		return nullptr;
+	}
+	if (PyObject_TypeCheck (archive, pytype_farc_writer) && !py_farc_writer_check ((pyobject_farc_writer *)archive)) return nullptr;
+
+	py_spr_set_packed packed;
+	if (!py_spr_set_pack_data (self, &packed)) return nullptr;
+
+	if (PyObject_TypeCheck (archive, pytype_farc_writer)) {
+		pyobject_farc_writer *writer = (pyobject_farc_writer *)archive;
+		farc_file entry;
+		entry.name.assign (name);
+		entry.compressed = (writer->settings->flags & FARC_GZIP) != 0;
+		entry.encrypted  = (writer->settings->flags & FARC_AES) != 0;
+		entry.size       = packed.get_size ();
+
+		// Buffers of sets KKdLib packed whole are handed over as they are
+		if (packed.textures.empty ()) {
+			entry.data  = packed.data;
+			packed.data = nullptr;
+		} else {
+			bool allocated;
+			Py_BEGIN_ALLOW_THREADS;
+			entry.data = malloc (entry.size);
+			allocated  = entry.data != nullptr;
+			if (allocated) packed.pack ((u8 *)entry.data);
+			Py_END_ALLOW_THREADS;
+			if (!allocated) return PyErr_NoMemory ();
+		}
+
+		bool result;
+		if (!py_farc_writer_run (writer, &result, [&] (farc_stream_writer *real) { return real->add_owned (entry, level); })) {
+			free (entry.data);
+			entry.data = nullptr;
+			return nullptr;
+		}
+		if (!result) {
+			PyErr_SetString (PyExc_RuntimeError, "Could not write farc");
+			return nullptr;
+		}
+
+		Py_RETURN_NONE;
+	}
+
+	PyObject *bytes = py_spr_set_packed_to_bytes (packed);
+	if (bytes == nullptr) return nullptr;
+
+	pyobject_farc_file *file = (pyobject_farc_file *)PyObject_CallFunction ((PyObject *)pytype_farc_file, "sN", name, bytes);
+	if (file == nullptr) return nullptr;
+	file->level = level;
+
+	pyobject_farc *farc = (pyobject_farc *)archive;
+	bool result         = py_farc_set_file (farc, file, py_farc_find_file (farc, name));
+	Py_DECREF (file);
+	if (!result) return nullptr;
+
+	Py_RETURN_NONE;
+}
+
+// Copies of the sprites, edits go back in through set_sprite
+static PyObject *
+py_spr_set_sprites_get (pyobject_spr_set *self, void *closure) {
+	PyObject *list = PyList_New (self->real.num_of_sprite);
+	if (list == nullptr) return nullptr;
+
+	for (u32 i = 0; i < self->real.num_of_sprite; i++) {
+		pyobject_sprite_info *info = (pyobject_sprite_info *)PyObject_CallNoArgs ((PyObject *)pytype_sprite_info);
+		if (info == nullptr) {
+			Py_DECREF (list);
+			return nullptr;
+		}
+
+		info->spr_info = self->real.sprinfo[i];
+		info->spr_data = self->real.sprdata[i];
+		info->name->assign (self->real.sprname[i]);
+		PyList_SetItem (list, i, (PyObject *)info);
+	}
+
+	return list;
 }
 
-static int
-py_sprite_info_resolution_mode_set (pyobject_sprite_info *self, PyObject *value, void *closure) {
-	if (value == nullptr || !PyUnicode_Check (value)) {
-		PyErr_SetString (PyExc_TypeError, "Resolution mode must be string");
-		return -1;
+static PyObject *
+py_spr_set_set_sprite (pyobject_spr_set *self, PyObject *args) {
+	u32 index;
+	pyobject_sprite_info *sprite_info;
+	if (!PyArg_ParseTuple (args, "IO!", &index, pytype_sprite_info, &sprite_info)) return nullptr;
+	if (index >= self->real.num_of_sprite) {
+		PyErr_SetString (PyExc_IndexError, "Sprite index out of range");
+		return nullptr;
 	}
 
-	PyObject *bytes    = PyUnicode_AsUTF8String (value);
-	const char *string = PyBytes_AsString (bytes);
-	if (strcmp (string, "QVGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x00;
-	else if (strcmp (string, "VGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x01;
-	else if (strcmp (string, "SVGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x02;
-	else if (strcmp (string, "XGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x03;
-	else if (strcmp (string, "SXGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x04;
-	else if (strcmp (string, "SXGAPlus") == 0) self->spr_data.resolution_mode = (resolution_mode)0x05;
-	else if (strcmp (string, "UXGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x06;
-	else if (strcmp (string, "WVGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x07;
-	else if (strcmp (string, "WSVGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x08;
-	else if (strcmp (string, "WXGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x09;
-	else if (strcmp (string, "FWXGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0A;
-	else if (strcmp (string, "WUXGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0B;
-	else if (strcmp (string, "WQXGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0C;
-	else if (strcmp (string, "HD") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0D;
-	else if (strcmp (string, "HDTV720") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0D;
-	else if (strcmp (string, "FHD") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0E;
-	else if (strcmp (string, "HDTV1080") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0E;
-	else if (strcmp (string, "UHD") == 0) self->spr_data.resolution_mode = (resolution_mode)0x0F;
-	else if (strcmp (string, "3KatUHD") == 0) self->spr_data.resolution_mode = (resolution_mode)0x10;
-	else if (strcmp (string, "3K") == 0) self->spr_data.resolution_mode = (resolution_mode)0x11;
-	else if (strcmp (string, "QHD") == 0) self->spr_data.resolution_mode = (resolution_mode)0x12;
-	else if (strcmp (string, "WQVGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x13;
-	else if (strcmp (string, "qHD") == 0) self->spr_data.resolution_mode = (resolution_mode)0x14;
-	else if (strcmp (string, "XGAPlus") == 0) self->spr_data.resolution_mode = (resolution_mode)0x15;
-	else if (strcmp (string, "1176x664") == 0) self->spr_data.resolution_mode = (resolution_mode)0x16;
-	else if (strcmp (string, "1200x960") == 0) self->spr_data.resolution_mode = (resolution_mode)0x17;
-	else if (strcmp (string, "WXGA1280x900") == 0) self->spr_data.resolution_mode = (resolution_mode)0x18;
-	else if (strcmp (string, "SXGAMinus") == 0) self->spr_data.resolution_mode = (resolution_mode)0x19;
-	else if (strcmp (string, "FXWGA1366x768") == 0) self->spr_data.resolution_mode = (resolution_mode)0x1A;
-	else if (strcmp (string, "WXGAPlus") == 0) self->spr_data.resolution_mode = (resolution_mode)0x1B;
-	else if (strcmp (string, "HDPlus") == 0) self->spr_data.resolution_mode = (resolution_mode)0x1C;
-	else if (strcmp (string, "WSXGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x1D;
-	else if (strcmp (string, "WSXGAPLus") == 0) self->spr_data.resolution_mode = (resolution_mode)0x1E;
-	else if (strcmp (string, "1920x1440") == 0) self->spr_data.resolution_mode = (resolution_mode)0x1F;
-	else if (strcmp (string, "QXWGA") == 0) self->spr_data.resolution_mode = (resolution_mode)0x20;
-	else {
-		PyErr_SetString (PyExc_TypeError, "Unknown resolution mode");
-		return -1;
-	}
-	Py_DECREF (bytes);
+	free ((void *)self->real.sprname[index]);
+	self->real.sprinfo[index] = sprite_info->spr_info;
+	self->real.sprname[index] = (const char *)calloc (sprite_info->name->size () + 1, sizeof (char));
+	strcpy ((char *)self->real.sprname[index], sprite_info->name->c_str ());
+	self->real.sprdata[index] = sprite_info->spr_data;
 
-	return 0;
+	Py_RETURN_NONE;
 }
 
-static PyGetSetDef pygetsets_sprite_info[] = {
-    {"name", (getter)py_sprite_info_name_get, (setter)py_sprite_info_name_set, nullptr, nullptr},
-    {"resolution_mode", (getter)py_sprite_info_resolution_mode_get, (setter)py_sprite_info_resolution_mode_set, nullptr, nullptr},
-    {nullptr}};
+static PyGetSetDef pygetsets_spr_set[] = {
+    {"txp", (getter)py_spr_set_txp_get, (setter)py_spr_set_txp_set, "Texture set, shared with the assigned txp_set", nullptr},
+    {"sprites", (getter)py_spr_set_sprites_get, nullptr, "Copies of the sprites in the set", nullptr},
+    {nullptr},
+};
 
-static PyMemberDef pymembers_sprite_info[] = {
-    {"texid", T_UINT, offsetof (pyobject_sprite_info, spr_info) + offsetof (spr::SprInfo, texid), 0, nullptr},
-    {"rotate", T_INT, offsetof (pyobject_sprite_info, spr_info) + offsetof (spr::SprInfo, rotate), 0, nullptr},
-    {"x", T_FLOAT, offsetof (pyobject_sprite_info, spr_info) + offsetof (spr::SprInfo, px), 0, nullptr},
-    {"y", T_FLOAT, offsetof (pyobject_sprite_info, spr_info) + offsetof (spr::SprInfo, py), 0, nullptr},
-    {"width", T_FLOAT, offsetof (pyobject_sprite_info, spr_info) + offsetof (spr::SprInfo, width), 0, nullptr},
-    {"height", T_FLOAT, offsetof (pyobject_sprite_info, spr_info) + offsetof (spr::SprInfo, height), 0, nullptr},
-    {"attr", T_UINT, offsetof (pyobject_sprite_info, spr_data) + offsetof (SpriteData, attr), 0, nullptr},
-    {nullptr}};
+static PyMethodDef pymethods_spr_set[] = {{"add_sprite", (PyCFunction)py_spr_set_add_sprite, METH_VARARGS, "Add sprite to set (spite_info)"},
+                                          {"add_sprites", (PyCFunction)py_spr_set_add_sprites, METH_VARARGS,
+                                           "Add every sprite of an iterable to set (iterable of sprite_info)"},
+                                          {"set_sprite", (PyCFunction)py_spr_set_set_sprite, METH_VARARGS,
+                                           "Replace the sprite at index (index, sprite_info)"},
+                                          {"pack", (PyCFunction)py_spr_set_pack, METH_VARARGS, "Pack sprite set to bytes ()"},
+                                          {"write", (PyCFunction)py_spr_set_write, METH_VARARGS, "Pack sprite set to a file (path)"},
+                                          {"pack_into", (PyCFunction)py_spr_set_pack_into, METH_VARARGS,
+                                           "Pack sprite set as an archive entry (farc or farc_writer, name, compression_level=None)"},
+                                          {0}};
 
-static PyType_Slot pyslots_sprite_info[] = {{Py_tp_init, (void *)py_sprite_info_init},
-                                            {Py_tp_finalize, (void *)py_sprite_info_finalize},
-                                            {Py_tp_getset, pygetsets_sprite_info},
-                                            {Py_tp_members, pymembers_sprite_info},
-                                            {0}};
+static PyType_Slot pyslots_spr_set[] = {{Py_tp_init, (void *)py_spr_set_init},
+                                        {Py_tp_finalize, (void *)py_spr_set_finalize},
+                                        {Py_tp_getset, pygetsets_spr_set},
+                                        {Py_tp_methods, pymethods_spr_set},
+                                        {0}};
 
-PYTHON_TYPE_DEF (sprite_info);
+PYTHON_TYPE_DEF (spr_set);
 
-struct pyobject_spr_set {
+// spr_db. Sets and the sprites and textures in them are indexed by name and id as they are added,
+// so looking up references stays constant time however many sets there are.
+struct pyobject_sprite_database {
 	PyObject_HEAD;
-	spr_set real;
+	sprite_database_file *real;
+	std::unordered_map<std::string, u32> *set_names;
+	std::unordered_map<u32, u32> *set_ids;
+	// Set index in the upper and entry index in the lower 32 bits
+	std::unordered_map<std::string, u64> *sprite_names;
+	std::unordered_map<u32, u64> *sprite_ids;
+	u32 next_set_id;
+	u32 next_sprite_id;
 };
 
+// Adds the set at index to the lookups, earlier entries win over later ones of the same name or id
+static void
+py_sprite_database_index_set (pyobject_sprite_database *self, u32 index) {
+	const spr_db_spr_set_file &set = self->real->sprite_set[index];
+	self->set_names->try_emplace (set.name, index);
+	self->set_ids->try_emplace (set.id, index);
+	self->next_set_id = std::max (self->next_set_id, set.id + 1);
+
+	for (u32 i = 0; i < set.sprite.size (); i++) {
+		self->sprite_names->try_emplace (set.sprite[i].name, (u64)index << 32 | i);
+		self->sprite_ids->try_emplace (set.sprite[i].id, (u64)index << 32 | i);
+		self->next_sprite_id = std::max (self->next_sprite_id, set.sprite[i].id + 1);
+	}
+}
+
+// Drops the sets from count on and the lookups that point at them, entries listed earlier under the same names keep theirs
+static void
+py_sprite_database_truncate (pyobject_sprite_database *self, u32 count) {
+	for (u32 i = count; i < self->real->sprite_set.size (); i++) {
+		const spr_db_spr_set_file &set = self->real->sprite_set[i];
+		auto set_name                  = self->set_names->find (set.name);
+		if (set_name != self->set_names->end () && set_name->second == i) self->set_names->erase (set_name);
+		auto set_id = self->set_ids->find (set.id);
+		if (set_id != self->set_ids->end () && set_id->second == i) self->set_ids->erase (set_id);
+
+		for (u32 j = 0; j < set.sprite.size (); j++) {
+			auto name = self->sprite_names->find (set.sprite[j].name);
+			if (name != self->sprite_names->end () && name->second == ((u64)i << 32 | j)) self->sprite_names->erase (name);
+			auto id = self->sprite_ids->find (set.sprite[j].id);
+			if (id != self->sprite_ids->end () && id->second == ((u64)i << 32 | j)) self->sprite_ids->erase (id);
+		}
+	}
+	self->real->sprite_set.erase (self->real->sprite_set.begin () + count, self->real->sprite_set.end ());
+}
+
 static int
-py_spr_set_init (pyobject_spr_set *self, PyObject *args, PyObject *kwds) {
-	self->real.ready      = true;
-	self->real.modern     = false;
-	self->real.big_endian = false;
-	self->real.is_x       = false;
+py_sprite_database_init (pyobject_sprite_database *self, PyObject *args, PyObject *kwds) {
+	const char *path = nullptr;
+	PyObject *data   = nullptr;
+	char *kwlist[]   = {"path", "data", nullptr};
+	if (!PyArg_ParseTupleAndKeywords (args, kwds, "|zO!", kwlist, &path, &PyBytes_Type, &data)) return -1;
+
+	self->real           = new sprite_database_file;
+	self->set_names      = new std::unordered_map<std::string, u32>;
+	self->set_ids        = new std::unordered_map<u32, u32>;
+	self->sprite_names   = new std::unordered_map<std::string, u64>;
+	self->sprite_ids     = new std::unordered_map<u32, u64>;
+	self->next_set_id    = 0;
+	self->next_sprite_id = 0;
+	if (path == nullptr && data == nullptr) {
+		// An empty database is complete, KKdLib only writes databases that are ready
+		self->real->ready = true;
+		return 0;
+	}
 
-	self->real.flag           = 0;
-	self->real.num_of_texture = 0;
-	self->real.num_of_sprite  = 0;
-	self->real.sprinfo        = nullptr;
-	self->real.texname        = nullptr;
-	self->real.sprname        = nullptr;
-	self->real.sprdata        = nullptr;
-	self->real.txp            = nullptr;
+	Py_BEGIN_ALLOW_THREADS;
+	if (path != nullptr) self->real->read (path, false);
+	else self->real->read (PyBytes_AsString (data), PyBytes_Size (data), false);
+	Py_END_ALLOW_THREADS;
+	if (!self->real->ready) {
+		PyErr_SetString (PyExc_RuntimeError, "Could not read sprite database");
+		return -1;
+	}
+
+	for (u32 i = 0; i < self->real->sprite_set.size (); i++)
+		py_sprite_database_index_set (self, i);
 
 	return 0;
 }
 
 void
-py_spr_set_finalize (pyobject_spr_set *self) {
-	if (self->real.sprinfo != nullptr) free (self->real.sprinfo);
-	if (self->real.texname != nullptr) {
-		for (i32 i = 0; i < self->real.num_of_texture; i++)
-			free ((void *)self->real.texname[i]);
-		free (self->real.texname);
+py_sprite_database_finalize (pyobject_sprite_database *self) {
+	delete self->real;
+	delete self->set_names;
+	delete self->set_ids;
+	delete self->sprite_names;
+	delete self->sprite_ids;
+}
+
+// Lists a spr_set under name with the next free ids. Entries are named prefix followed by the sprite or texture name,
+// the prefix defaults to the set name without SPR_, textures get SPRTEX_ in front of it. file_name defaults to the lowercase name.
+static PyObject *
+py_sprite_database_add_set (pyobject_sprite_database *self, PyObject *args, PyObject *kwds) {
+	pyobject_spr_set *spr;
+	const char *name;
+	const char *file_name = nullptr;
+	const char *prefix    = nullptr;
+	char *kwlist[]        = {"spr_set", "name", "file_name", "prefix", nullptr};
+	if (!PyArg_ParseTupleAndKeywords (args, kwds, "O!s|zz", kwlist, pytype_spr_set, &spr, &name, &file_name, &prefix)) return nullptr;
+
+	spr_db_spr_set_file set;
+	set.id    = self->next_set_id;
+	set.name  = name;
+	set.index = self->real->sprite_set.size ();
+	if (file_name != nullptr) {
+		set.file_name = file_name;
+	} else {
+		set.file_name = set.name + ".bin";
+		for (char &c : set.file_name)
+			c = tolower (c);
 	}
-	if (self->real.sprname != nullptr) {
-		for (i32 i = 0; i < self->real.num_of_sprite; i++)
-			free ((void *)self->real.sprname[i]);
-		free (self->real.sprname);
+
+	std::string sprite_prefix = prefix != nullptr ? prefix : (set.name.starts_with ("SPR_") ? set.name.substr (4) : set.name) + "_";
+	u32 texture_count         = spr->txp != nullptr ? spr->txp->names->size () : 0;
+	set.sprite.resize (texture_count + spr->real.num_of_sprite);
+	for (u32 i = 0; i < set.sprite.size (); i++) {
+		spr_db_spr_file &sprite = set.sprite[i];
+		sprite.id               = self->next_sprite_id + i;
+		sprite.texture          = i < texture_count;
+		sprite.index            = sprite.texture ? i : i - texture_count;
+		sprite.name = sprite.texture ? "SPRTEX_" + sprite_prefix + spr->txp->names->at (i) : sprite_prefix + spr->real.sprname[i - texture_count];
 	}
-	if (self->real.sprdata != nullptr) free (self->real.sprdata);
-	if (self->real.txp != nullptr) delete self->real.txp;
+
+	// References have to stay unambiguous, so nothing is added when a name is taken, by the database or within the set
+	if (self->set_names->contains (set.name)) {
+		PyErr_Format (PyExc_ValueError, "Sprite set %s already in database", name);
+		return nullptr;
+	}
+	std::unordered_set<std::string> names;
+	for (const auto &sprite : set.sprite) {
+		if (self->sprite_names->contains (sprite.name)) {
+			PyErr_Format (PyExc_ValueError, "Sprite %s already in database", sprite.name.c_str ());
+			return nullptr;
+		}
+		if (!names.insert (sprite.name).second) {
+			PyErr_Format (PyExc_ValueError, "Sprite %s appears twice in set %s", sprite.name.c_str (), name);
+			return nullptr;
+		}
+	}
+
+	self->real->sprite_set.push_back (std::move (set));
+	py_sprite_database_index_set (self, self->real->sprite_set.size () - 1);
+
+	return PyLong_FromUnsignedLong (self->real->sprite_set.back ().id);
 }
 
-static int
-py_spr_set_txp_set (pyobject_spr_set *self, PyObject *value, void *closure) {
-	if (!PyObject_TypeCheck (value, pytype_txp_set)) {
-		PyErr_SetString (PyExc_TypeError, "txp must be KKdLib.txp_set");
-		return -1;
+// Same as add_set for every (spr_set, name, ...) tuple of an iterable, returns the set ids. Either every set is added or none.
+static PyObject *
+py_sprite_database_add_sets (pyobject_sprite_database *self, PyObject *args) {
+	PyObject *sets;
+	if (!PyArg_ParseTuple (args, "O", &sets)) return nullptr;
+
+	PyObject *iter = PyObject_GetIter (sets);
+	if (iter == nullptr) return nullptr;
+
+	Py_ssize_t size = PyObject_Size (sets);
+	if (size < 0) PyErr_Clear ();
+	else self->real->sprite_set.reserve (self->real->sprite_set.size () + size);
+
+	u32 start          = self->real->sprite_set.size ();
+	u32 next_set_id    = self->next_set_id;
+	u32 next_sprite_id = self->next_sprite_id;
+	PyObject *ids      = PyList_New (0);
+	PyObject *item;
+	while (ids != nullptr && (item = PyIter_Next (iter)) != nullptr) {
+		PyObject *id = PyTuple_Check (item) ? py_sprite_database_add_set (self, item, nullptr) : nullptr;
+		if (!PyTuple_Check (item)) PyErr_SetString (PyExc_TypeError, "Sets must be tuples of (spr_set, name, ...)");
+		Py_DECREF (item);
+		if (id == nullptr || PyList_Append (ids, id) < 0) {
+			Py_XDECREF (id);
+			Py_CLEAR (ids);
+			break;
+		}
+		Py_DECREF (id);
 	}
+	Py_DECREF (iter);
 
-	pyobject_txp_set *txp = (pyobject_txp_set *)value;
-	if (txp->real->textures.size () == 0) {
-		PyErr_SetString (PyExc_TypeError, "txp must have textures");
-		return -1;
+	if (PyErr_Occurred ()) {
+		Py_CLEAR (ids);
+		py_sprite_database_truncate (self, start);
+		self->next_set_id    = next_set_id;
+		self->next_sprite_id = next_sprite_id;
 	}
 
-	if (self->real.texname != nullptr) {
-		for (i32 i = 0; i < self->real.num_of_texture; i++)
-			free ((void *)self->real.texname[i]);
-		free (self->real.texname);
+	return ids;
+}
+
+// Name or id a lookup key stands for, name is null for ids. False with an error set when it is neither.
+static bool
+py_sprite_database_parse_key (PyObject *key, const char **name, u32 *id) {
+	*name = nullptr;
+	if (PyUnicode_Check (key)) {
+		*name = PyUnicode_AsUTF8AndSize (key, nullptr);
+		return *name != nullptr;
 	}
-	if (self->real.txp != nullptr) free (self->real.txp);
 
-	self->real.num_of_texture = txp->real->textures.size ();
-	self->real.texname        = (const char **)malloc (sizeof (char *) * txp->names->size ());
-	for (u64 i = 0; i < txp->names->size (); i++) {
-		self->real.texname[i] = (const char *)calloc (txp->names->at (i).size () + 1, sizeof (char));
-		strcpy ((char *)self->real.texname[i], txp->names->at (i).c_str ());
+	unsigned long long value = PyLong_AsUnsignedLongLong (key);
+	if (PyErr_Occurred ()) return false;
+	if (value > UINT32_MAX) {
+		PyErr_SetString (PyExc_OverflowError, "Id must fit in 32 bits");
+		return false;
 	}
+	*id = (u32)value;
+	return true;
+}
 
-	self->real.txp  = new txp_set ();
-	*self->real.txp = *txp->real;
+// Index in sprite_set of a set name or id, -1 when there is none or with an error set when the key is invalid
+static i64
+py_sprite_database_find_set_index (pyobject_sprite_database *self, PyObject *key) {
+	const char *name;
+	u32 id;
+	if (!py_sprite_database_parse_key (key, &name, &id)) return -1;
+	if (name != nullptr) {
+		auto it = self->set_names->find (name);
+		return it != self->set_names->end () ? (i64)it->second : -1;
+	}
+	auto it = self->set_ids->find (id);
+	return it != self->set_ids->end () ? (i64)it->second : -1;
+}
 
-	return 0;
+// Set and entry index of a sprite or texture name or id, -1 when there is none or with an error set when the key is invalid
+static i64
+py_sprite_database_find_sprite_index (pyobject_sprite_database *self, PyObject *key) {
+	const char *name;
+	u32 id;
+	if (!py_sprite_database_parse_key (key, &name, &id)) return -1;
+	if (name != nullptr) {
+		auto it = self->sprite_names->find (name);
+		return it != self->sprite_names->end () ? (i64)it->second : -1;
+	}
+	auto it = self->sprite_ids->find (id);
+	return it != self->sprite_ids->end () ? (i64)it->second : -1;
+}
+
+static bool
+py_sprite_database_check_key (PyObject *key) {
+	if (PyUnicode_Check (key) || PyLong_Check (key)) return true;
+	PyErr_SetString (PyExc_TypeError, "Key must be a name or an id");
+	return false;
 }
 
 static PyObject *
-py_spr_set_add_sprite (pyobject_spr_set *self, PyObject *args) {
-	pyobject_sprite_info *sprite_info;
-	if (!PyArg_ParseTuple (args, "O!", pytype_sprite_info, &sprite_info)) return nullptr;
+py_sprite_database_find_set (pyobject_sprite_database *self, PyObject *args) {
+	PyObject *key;
+	if (!PyArg_ParseTuple (args, "O", &key)) return nullptr;
+	if (!py_sprite_database_check_key (key)) return nullptr;
 
-	if (self->real.num_of_sprite == 0) {
-		self->real.sprinfo    = (spr::SprInfo *)malloc (sizeof (spr::SprInfo));
-		self->real.sprinfo[0] = sprite_info->spr_info;
+	i64 index = py_sprite_database_find_set_index (self, key);
+	if (PyErr_Occurred ()) return nullptr;
+	if (index < 0) Py_RETURN_NONE;
 
-		self->real.sprname    = (const char **)malloc (sizeof (char *));
-		self->real.sprname[0] = (const char *)calloc (sprite_info->name->size () + 1, sizeof (char));
-		strcpy ((char *)self->real.sprname[0], sprite_info->name->c_str ());
+	const spr_db_spr_set_file &set = self->real->sprite_set[index];
+	return Py_BuildValue ("(IssI)", set.id, set.name.c_str (), set.file_name.c_str (), set.index);
+}
 
-		self->real.sprdata    = (SpriteData *)malloc (sizeof (SpriteData));
-		self->real.sprdata[0] = sprite_info->spr_data;
-	} else {
-		spr::SprInfo *new_sprinfo = (spr::SprInfo *)malloc (sizeof (spr::SprInfo) * (self->real.num_of_sprite + 1));
-		memcpy (new_sprinfo, self->real.sprinfo, sizeof (spr::SprInfo) * self->real.num_of_sprite);
-		new_sprinfo[self->real.num_of_sprite] = sprite_info->spr_info;
-		free (self->real.sprinfo);
-		self->real.sprinfo = new_sprinfo;
-
-		const char **new_sprname = (const char **)malloc (sizeof (char *) * (self->real.num_of_sprite + 1));
-		memcpy (new_sprname, self->real.sprname, sizeof (char *) * self->real.num_of_sprite);
-		new_sprname[self->real.num_of_sprite] = (const char *)calloc (sprite_info->name->size () + 1, sizeof (char));
-		strcpy ((char *)new_sprname[self->real.num_of_sprite], sprite_info->name->c_str ());
-		free (self->real.sprname);
-		self->real.sprname = new_sprname;
+static PyObject *
+py_sprite_database_find_sprite (pyobject_sprite_database *self, PyObject *args) {
+	PyObject *key;
+	if (!PyArg_ParseTuple (args, "O", &key)) return nullptr;
+	if (!py_sprite_database_check_key (key)) return nullptr;
+
+	i64 index = py_sprite_database_find_sprite_index (self, key);
+	if (PyErr_Occurred ()) return nullptr;
+	if (index < 0) Py_RETURN_NONE;
+
+	const spr_db_spr_set_file &set = self->real->sprite_set[index >> 32];
+	const spr_db_spr_file &sprite  = set.sprite[index & 0xFFFFFFFF];
+	return Py_BuildValue ("(IsIHO)", sprite.id, sprite.name.c_str (), set.id, sprite.index, sprite.texture ? Py_True : Py_False);
+}
 
-		SpriteData *new_sprdata = (SpriteData *)malloc (sizeof (SpriteData) * (self->real.num_of_sprite + 1));
-		memcpy (new_sprdata, self->real.sprdata, sizeof (SpriteData) * self->real.num_of_sprite);
-		new_sprdata[self->real.num_of_sprite] = sprite_info->spr_data;
-		free (self->real.sprdata);
-		self->real.sprdata = new_sprdata;
+// Every sprite name or id of an iterable that is not in the database, for checking the references of a whole mod at once
+static PyObject *
+py_sprite_database_missing (pyobject_sprite_database *self, PyObject *args) {
+	PyObject *keys;
+	if (!PyArg_ParseTuple (args, "O", &keys)) return nullptr;
+
+	PyObject *iter = PyObject_GetIter (keys);
+	if (iter == nullptr) return nullptr;
+
+	PyObject *missing = PyList_New (0);
+	PyObject *item;
+	while (missing != nullptr && (item = PyIter_Next (iter)) != nullptr) {
+		bool failed = !py_sprite_database_check_key (item);
+		if (!failed && py_sprite_database_find_sprite_index (self, item) < 0) failed = PyErr_Occurred () || PyList_Append (missing, item) < 0;
+		Py_DECREF (item);
+		if (failed) break;
 	}
+	Py_DECREF (iter);
+	if (PyErr_Occurred ()) Py_CLEAR (missing);
 
-	self->real.num_of_sprite++;
-
-	Py_RETURN_NONE;
+	return missing;
 }
 
 static PyObject *
-py_spr_set_pack (pyobject_spr_set *self, PyObject *args) {
-	if (self->real.num_of_texture == 0 || self->real.num_of_sprite == 0) {
-		PyErr_SetString (PyExc_TypeError, "Must set txp and sprites");
+py_sprite_database_write (pyobject_sprite_database *self, PyObject *args) {
+	const char *path;
+	if (!PyArg_ParseTuple (args, "s", &path)) return nullptr;
+
+	// Writing to a path does not say whether it worked, so the database goes through a buffer like to_bytes.
+	// The GIL stays held while it is serialised, other threads may add sets.
+	void *data = nullptr;
+	size_t size;
+	self->real->write (&data, &size);
+	if (data == nullptr) {
+		PyErr_SetString (PyExc_RuntimeError, "Could not write sprite database");
 		return nullptr;
 	}
 
-	for (i32 i = 0; i < self->real.num_of_sprite; i++) {
-		txp texture              = self->real.txp->textures.at (self->real.sprinfo[i].texid);
-		self->real.sprinfo[i].su = self->real.sprinfo[i].px / texture.mipmaps[0].width;
-		self->real.sprinfo[i].sv = self->real.sprinfo[i].py / texture.mipmaps[0].height;
-		self->real.sprinfo[i].eu = (self->real.sprinfo[i].px + self->real.sprinfo[i].width) / texture.mipmaps[0].width;
-		self->real.sprinfo[i].ev = (self->real.sprinfo[i].py + self->real.sprinfo[i].height) / texture.mipmaps[0].height;
+	bool result;
+	Py_BEGIN_ALLOW_THREADS;
+	result = py_write_file (path, data, size);
+	Py_END_ALLOW_THREADS;
+	if (!result) {
+		PyErr_Format (PyExc_RuntimeError, "Could not write %s", path);
+		return nullptr;
 	}
 
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_sprite_database_to_bytes (pyobject_sprite_database *self, PyObject *args) {
 	void *data = nullptr;
 	size_t size;
-	self->real.pack_file (&data, &size);
+	self->real->write (&data, &size);
+	if (data == nullptr) {
+		PyErr_SetString (PyExc_RuntimeError, "Could not write sprite database");
+		return nullptr;
+	}
 
-	return PyBytes_FromStringAndSize ((const char *)data, size);
+	PyObject *result = PyBytes_FromStringAndSize ((const char *)data, size);
+	free (data);
+	return result;
 }
 
-static PyGetSetDef pygetsets_spr_set[] = {
-    {"txp", nullptr, (setter)py_spr_set_txp_set, nullptr, nullptr},
+static Py_ssize_t
+py_sprite_database_length (pyobject_sprite_database *self) {
+	return self->real->sprite_set.size ();
+}
+
+static PyMethodDef pymethods_sprite_database[] = {
+    {"add_set", (PyCFunction)py_sprite_database_add_set, METH_VARARGS | METH_KEYWORDS,
+     "List a sprite set and its sprites and textures, returns the set id (spr_set, name, file_name=None, prefix=None)"},
+    {"add_sets", (PyCFunction)py_sprite_database_add_sets, METH_VARARGS, "add_set for every tuple of an iterable, returns the set ids (iterable)"},
+    {"find_set", (PyCFunction)py_sprite_database_find_set, METH_VARARGS, "(id, name, file_name, index) of a set or None (name or id)"},
+    {"find_sprite", (PyCFunction)py_sprite_database_find_sprite, METH_VARARGS,
+     "(id, name, set_id, index, texture) of a sprite or texture or None (name or id)"},
+    {"missing", (PyCFunction)py_sprite_database_missing, METH_VARARGS, "Sprite names and ids that are not in the database (iterable)"},
+    {"write", (PyCFunction)py_sprite_database_write, METH_VARARGS, "Write database to path (path)"},
+    {"to_bytes", (PyCFunction)py_sprite_database_to_bytes, METH_NOARGS, "Write database to bytes ()"},
     {nullptr},
 };
 
-static PyMethodDef pymethods_spr_set[] = {{"add_sprite", (PyCFunction)py_spr_set_add_sprite, METH_VARARGS, "Add sprite to set (spite_info)"},
-                                          {"pack", (PyCFunction)py_spr_set_pack, METH_VARARGS, "Pack sprite set to bytes ()"},
-                                          {0}};
-
-static PyType_Slot pyslots_spr_set[] = {{Py_tp_init, (void *)py_spr_set_init},
-                                        {Py_tp_finalize, (void *)py_spr_set_finalize},
-                                        {Py_tp_getset, pygetsets_spr_set},
-                                        {Py_tp_methods, pymethods_spr_set},
-                                        {0}};
+static PyType_Slot pyslots_sprite_database[] = {
+    {Py_tp_init, (void *)py_sprite_database_init},
+    {Py_tp_finalize, (void *)py_sprite_database_finalize},
+    {Py_tp_methods, pymethods_sprite_database},
+    {Py_sq_length, (void *)py_sprite_database_length},
+    {0},
+};
 
-PYTHON_TYPE_DEF (spr_set);
+PYTHON_TYPE_DEF (sprite_database);
 
 static int
 KKdLib_module_exec (PyObject *m) {
 	PYTHON_TYPE_INIT (farc);
 	PYTHON_TYPE_INIT (farc_file);
+	PYTHON_TYPE_INIT (farc_files);
+	PYTHON_TYPE_INIT (farc_writer);
 
 	PYTHON_TYPE_INIT (txp_set);
 	PYTHON_TYPE_INIT (sprite_info);
 	PYTHON_TYPE_INIT (spr_set);
+	PYTHON_TYPE_INIT (sprite_database);
 
 	return 0;
 }
 
+static PyObject *
+py_set_huge_pages (PyObject *self, PyObject *args) {
+	bool value;
+	if (!PyArg_ParseTuple (args, "b", &value)) return nullptr;
+
+	scratch_arena::set_huge_pages (value);
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+py_build_atlas (PyObject *self, PyObject *args, PyObject *kwds) {
+	PyObject *sprites;
+	const char *format = "ATI2";
+	u32 max_size       = 2048;
+	u32 padding        = 2;
+	bool rotate        = false;
+	const char *name   = "MERGE";
+	char *kwlist[]     = {"sprites", "format", "max_size", "padding", "rotate", "name", nullptr};
+	if (!PyArg_ParseTupleAndKeywords (args, kwds, "O|sIIbs", kwlist, &sprites, &format, &max_size, &padding, &rotate, &name)) return nullptr;
+
+	texture_encoding encoding;
+	if (!py_texture_get_encoding (format, &encoding)) return nullptr;
+
+	PyObject *iter = PyObject_GetIter (sprites);
+	if (iter == nullptr) return nullptr;
+
+	scratch_scope scope;
+	std::vector<std::string> names;
+	std::vector<atlas_rect> rects;
+	std::vector<const u8 *> images;
+	bool has_alpha = false;
+	PyObject *item;
+	while ((item = PyIter_Next (iter)) != nullptr) {
+		const char *sprite_name;
+		PyObject *image;
+		if (!PyArg_ParseTuple (item, "sO", &sprite_name, &image)) {
+			Py_DECREF (item);
+			break;
+		}
+
+		i32 width;
+		i32 height;
+		bool image_has_alpha;
+		const u8 *rgba = py_pillow_read_rgba (image, &width, &height, &image_has_alpha);
+		if (rgba != nullptr) {
+			names.emplace_back (sprite_name);
+			rects.push_back ({(u32)width, (u32)height, 0, 0, 0, false});
+			images.push_back (rgba);
+			has_alpha |= image_has_alpha;
+		}
+		Py_DECREF (item);
+		if (rgba == nullptr) break;
+	}
+	Py_DECREF (iter);
+	if (PyErr_Occurred ()) return nullptr;
+
+	// Block compressed sprites start on a block so they never share one, the half size CbCr plane of BC5 needs twice that
+	u32 align = encoding == TEXTURE_ENCODING_BC5_YCBCR ? 8 : encoding == TEXTURE_ENCODING_RGB ? 1 : 4;
+	if (encoding == TEXTURE_ENCODING_RGB && has_alpha) encoding = TEXTURE_ENCODING_RGBA;
+	if (max_size < align || (max_size & (max_size - 1)) != 0) {
+		PyErr_Format (PyExc_ValueError, "max_size must be a power of two of at least %u", align);
+		return nullptr;
+	}
+
+	pyobject_txp_set *set = (pyobject_txp_set *)PyObject_CallNoArgs ((PyObject *)pytype_txp_set);
+	if (set == nullptr) return nullptr;
+
+	bool result;
+	Py_BEGIN_ALLOW_THREADS;
+	std::vector<atlas_page> pages;
+	result = atlas_pack (rects, pages, max_size, padding, align, rotate);
+	if (result) {
+		std::vector<u8 *> buffers (pages.size ());
+		for (size_t i = 0; i < pages.size (); i++) {
+			buffers[i] = scope.arena.allocate<u8> ((u64)pages[i].width * pages[i].height * 4);
+			memset (buffers[i], 0, (u64)pages[i].width * pages[i].height * 4);
+		}
+
+		// Rects never overlap, so every sprite is copied on its own
+		thread_pool::get ().parallel_for (rects.size (),
+		                                  [&] (size_t i) { atlas_blit (buffers[rects[i].page], pages[rects[i].page].width, images[i], rects[i]); });
+
+		for (size_t i = 0; i < pages.size (); i++) {
+			txp texture;
+			texture_encode (&texture, &buffers[i], 1, pages[i].width, pages[i].height, encoding, 1);
+			set->real->textures.push_back (texture);
+			py_txp_set_add_name (set, std::string (name) + "_" + std::to_string (i));
+		}
+	}
+	Py_END_ALLOW_THREADS;
+	if (!result) {
+		Py_DECREF (set);
+		PyErr_Format (PyExc_RuntimeError, "Sprites must fit in %u x %u", max_size, max_size);
+		return nullptr;
+	}
+
+	PyObject *list = PyList_New (rects.size ());
+	if (list == nullptr) {
+		Py_DECREF (set);
+		return nullptr;
+	}
+	for (size_t i = 0; i < rects.size (); i++) {
+		pyobject_sprite_info *info = (pyobject_sprite_info *)PyObject_CallNoArgs ((PyObject *)pytype_sprite_info);
+		if (info == nullptr) {
+			Py_DECREF (set);
+			Py_DECREF (list);
+			return nullptr;
+		}
+
+		// The rectangle as it lies on the page, rotated sprites are turned clockwise
+		info->name->assign (names[i]);
+		info->spr_info.texid  = rects[i].page;
+		info->spr_info.rotate = rects[i].rotated ? 1 : 0;
+		info->spr_info.px     = rects[i].x;
+		info->spr_info.py     = rects[i].y;
+		info->spr_info.width  = rects[i].rotated ? rects[i].height : rects[i].width;
+		info->spr_info.height = rects[i].rotated ? rects[i].width : rects[i].height;
+		PyList_SetItem (list, i, (PyObject *)info);
+	}
+
+	return Py_BuildValue ("(NN)", set, list);
+}
+
+static PyObject *
+py_set_farc_cache (PyObject *self, PyObject *args) {
+	const char *path;
+	if (!PyArg_ParseTuple (args, "z", &path)) return nullptr;
+
+	farc_cache::set (path);
+
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef KKdLib_module_methods[] = {
+    {"set_huge_pages", (PyCFunction)py_set_huge_pages, METH_VARARGS, "Back encoder scratch memory with transparent huge pages (enable)"},
+    {"build_atlas", (PyCFunction)py_build_atlas, METH_VARARGS | METH_KEYWORDS,
+     "Pack pillow images onto power of two pages, returns the txp_set and a sprite_info per image (sprites: iterable of (name, image), "
+     "format, max_size, padding, rotate, name)"},
+    {"set_farc_cache", (PyCFunction)py_set_farc_cache, METH_VARARGS,
+     "Keep compressed farc entries in an existing directory and reuse them in later writes, None to stop. Nothing is evicted, "
+     "files can be deleted from it at any time (path)"},
+    {nullptr}};
+
 static PyModuleDef_Slot KKdLib_module_slots[] = {{Py_mod_exec, (void *)KKdLib_module_exec}, {0, nullptr}};
 
 static PyModuleDef KKdLib_module = {
-    .m_base  = PyModuleDef_HEAD_INIT,
-    .m_name  = "KorenKonder diva Library",
-    .m_doc   = PyDoc_STR ("KKdLib python wrapper"),
-    .m_size  = 0,
-    .m_slots = KKdLib_module_slots,
+    .m_base    = PyModuleDef_HEAD_INIT,
+    .m_name    = "KorenKonder diva Library",
+    .m_doc     = PyDoc_STR ("KKdLib python wrapper"),
+    .m_size    = 0,
+    .m_methods = KKdLib_module_methods,
+    .m_slots   = KKdLib_module_slots,
 };
 
 PyMODINIT_FUNC
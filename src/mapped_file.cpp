@@ -0,0 +1,133 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+static std::wstring
+mapped_file_widen (const char *path) {
+	std::wstring wpath (MultiByteToWideChar (CP_UTF8, 0, path, -1, nullptr, 0), L'\0');
+	MultiByteToWideChar (CP_UTF8, 0, path, -1, wpath.data (), (int)wpath.size ());
+	return wpath;
+}
+#endif
+
+mapped_file::mapped_file () : data (nullptr), size (0) {
+#ifdef _WIN32
+	file    = INVALID_HANDLE_VALUE;
+	mapping = nullptr;
+#else
+	device = 0;
+	inode  = 0;
+#endif
+}
+
+mapped_file::~mapped_file () {
+	close ();
+}
+
+bool
+mapped_file::open (const char *path) {
+	close ();
+
+#ifdef _WIN32
+	// Archives are patched in place while they are mapped, and renamed or deleted by other programs
+	file = CreateFileW (mapped_file_widen (path).c_str (), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+	                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx (file, &file_size)) {
+		close ();
+		return false;
+	}
+	size = file_size.QuadPart;
+	if (size == 0) return true;
+
+	mapping = CreateFileMappingW (file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping == nullptr) {
+		close ();
+		return false;
+	}
+
+	data = (const u8 *)MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == nullptr) {
+		close ();
+		return false;
+	}
+#else
+	int fd = ::open (path, O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat (fd, &st) != 0) {
+		::close (fd);
+		return false;
+	}
+	size   = st.st_size;
+	device = st.st_dev;
+	inode  = st.st_ino;
+	if (size == 0) {
+		::close (fd);
+		return true;
+	}
+
+	void *map = mmap (nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close (fd);
+	if (map == MAP_FAILED) {
+		size   = 0;
+		device = 0;
+		inode  = 0;
+		return false;
+	}
+	data = (const u8 *)map;
+#endif
+
+	return true;
+}
+
+void
+mapped_file::close () {
+#ifdef _WIN32
+	if (data != nullptr) UnmapViewOfFile (data);
+	if (mapping != nullptr) CloseHandle (mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle (file);
+	mapping = nullptr;
+	file    = INVALID_HANDLE_VALUE;
+#else
+	if (data != nullptr) munmap ((void *)data, size);
+	device = 0;
+	inode  = 0;
+#endif
+
+	data = nullptr;
+	size = 0;
+}
+
+bool
+mapped_file::is_file (const char *path) const {
+#ifdef _WIN32
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	HANDLE other = CreateFileW (mapped_file_widen (path).c_str (), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+	                            FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (other == INVALID_HANDLE_VALUE) return false;
+
+	BY_HANDLE_FILE_INFORMATION a;
+	BY_HANDLE_FILE_INFORMATION b;
+	bool result = GetFileInformationByHandle (file, &a) && GetFileInformationByHandle (other, &b) &&
+	              a.dwVolumeSerialNumber == b.dwVolumeSerialNumber && a.nFileIndexHigh == b.nFileIndexHigh && a.nFileIndexLow == b.nFileIndexLow;
+	CloseHandle (other);
+	return result;
+#else
+	struct stat st;
+	return inode != 0 && stat (path, &st) == 0 && (u64)st.st_dev == device && (u64)st.st_ino == inode;
+#endif
+}
@@ -0,0 +1,36 @@
+#ifndef _MAPPED_FILE_H
+#define _MAPPED_FILE_H
+
+#include "helpers.h"
+
+// Read only memory mapping of a whole file
+class mapped_file {
+public:
+	mapped_file ();
+	~mapped_file ();
+
+	mapped_file (const mapped_file &)            = delete;
+	mapped_file &operator= (const mapped_file &) = delete;
+
+	bool open (const char *path);
+	void close ();
+
+	// Whether path names the mapped file, under any name it has
+	bool is_file (const char *path) const;
+
+	const u8 *get_data () const { return data; }
+	u64 get_size () const { return size; }
+
+private:
+	const u8 *data;
+	u64 size;
+#ifdef _WIN32
+	void *file;
+	void *mapping;
+#else
+	u64 device;
+	u64 inode;
+#endif
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "scratch_arena.h"
+
+#include <atomic>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#define SCRATCH_CHUNK_MIN_SIZE  (0x400000ull)
+#define SCRATCH_HUGE_PAGE_SIZE  (0x200000ull)
+
+static std::atomic<bool> scratch_huge_pages = false;
+
+scratch_arena::scratch_arena () : current (0) {}
+
+scratch_arena::~scratch_arena () {
+	for (auto &c : chunks)
+		chunk_free (c);
+}
+
+scratch_arena &
+scratch_arena::get () {
+	static thread_local scratch_arena arena;
+	return arena;
+}
+
+void
+scratch_arena::set_huge_pages (bool value) {
+	scratch_huge_pages = value;
+}
+
+void *
+scratch_arena::allocate (size_t size, size_t align) {
+	if (chunks.empty ()) {
+		chunks.push_back (chunk_alloc (size + align));
+		current = 0;
+	}
+
+	while (true) {
+		chunk &c = chunks[current];
+
+		uintptr_t ptr = ((uintptr_t)(c.data + c.used) + align - 1) & ~(uintptr_t)(align - 1);
+		if (ptr + size <= (uintptr_t)(c.data + c.size)) {
+			c.used = ptr + size - (uintptr_t)c.data;
+			return (void *)ptr;
+		}
+
+		// Chunks past the current one are leftovers of an earlier rewind and may be reused
+		if (++current == chunks.size ()) chunks.push_back (chunk_alloc (std::max (size + align, c.size * 2)));
+		chunks[current].used = 0;
+	}
+}
+
+void
+scratch_arena::reset (mark m) {
+	if (chunks.empty ()) return;
+
+	current              = m.chunk;
+	chunks[current].used = m.used;
+}
+
+void
+scratch_arena::reset () {
+	current = 0;
+	if (chunks.empty ()) return;
+
+	// Fold everything into one chunk so the next texture of the same size needs a single block
+	if (chunks.size () > 1) {
+		size_t total = 0;
+		for (auto &c : chunks) {
+			total += c.size;
+			chunk_free (c);
+		}
+		chunks.clear ();
+		chunks.push_back (chunk_alloc (total));
+	}
+
+	chunks[0].used = 0;
+}
+
+scratch_arena::chunk
+scratch_arena::chunk_alloc (size_t size) {
+	size = std::max<size_t> (size, SCRATCH_CHUNK_MIN_SIZE);
+
+#ifdef __linux__
+	if (scratch_huge_pages) {
+		size       = (size + SCRATCH_HUGE_PAGE_SIZE - 1) & ~(SCRATCH_HUGE_PAGE_SIZE - 1);
+		void *data = mmap (nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (data != MAP_FAILED) {
+			madvise (data, size, MADV_HUGEPAGE);
+			return {(u8 *)data, size, 0, true};
+		}
+	}
+#endif
+
+	return {(u8 *)malloc (size), size, 0, false};
+}
+
+void
+scratch_arena::chunk_free (chunk &c) {
+#ifdef __linux__
+	if (c.huge) {
+		munmap (c.data, c.size);
+		return;
+	}
+#endif
+
+	free (c.data);
+}
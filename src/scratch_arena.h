@@ -0,0 +1,65 @@
+#ifndef _SCRATCH_ARENA_H
+#define _SCRATCH_ARENA_H
+
+#include "helpers.h"
+
+// Per thread bump allocator for encoder temporaries.
+// Chunks are kept after a reset so repeated encodes reuse the same memory instead of growing the heap.
+class scratch_arena {
+public:
+	struct mark {
+		size_t chunk;
+		size_t used;
+	};
+
+	scratch_arena ();
+	~scratch_arena ();
+
+	scratch_arena (const scratch_arena &)            = delete;
+	scratch_arena &operator= (const scratch_arena &) = delete;
+
+	// Arena of the calling thread
+	static scratch_arena &get ();
+
+	// Back new chunks with transparent huge pages where the platform has them
+	static void set_huge_pages (bool value);
+
+	void *allocate (size_t size, size_t align = 64);
+
+	template <typename T>
+	T *allocate (size_t count) {
+		return (T *)allocate (sizeof (T) * count, std::max<size_t> (alignof (T), 64));
+	}
+
+	mark get_mark () const { return {current, chunks.empty () ? 0 : chunks[current].used}; }
+	void reset (mark m);
+	void reset ();
+
+private:
+	struct chunk {
+		u8 *data;
+		size_t size;
+		size_t used;
+		bool huge;
+	};
+
+	static chunk chunk_alloc (size_t size);
+	static void chunk_free (chunk &c);
+
+	std::vector<chunk> chunks;
+	size_t current;
+};
+
+// Rewinds the arena of the calling thread to where it was when the scope was entered
+struct scratch_scope {
+	scratch_arena &arena;
+	scratch_arena::mark start;
+
+	scratch_scope () : arena (scratch_arena::get ()), start (arena.get_mark ()) {}
+	~scratch_scope () { start.chunk == 0 && start.used == 0 ? arena.reset () : arena.reset (start); }
+
+	scratch_scope (const scratch_scope &)            = delete;
+	scratch_scope &operator= (const scratch_scope &) = delete;
+};
+
+#endif
@@ -0,0 +1,577 @@
+#include "texture.h"
+#include "BC.h"
+#include "scratch_arena.h"
+#include "thread_pool.h"
+
+enum texture_job_type {
+	TEXTURE_JOB_COPY_RGB,
+	TEXTURE_JOB_COPY_RGBA,
+	TEXTURE_JOB_BC3,
+	TEXTURE_JOB_BC5,
+	TEXTURE_JOB_BC5_HALF,
+	TEXTURE_JOB_BC7,
+};
+
+// One level worth of work, split into rows of blocks so every level of a chain can be encoded at the same time
+struct texture_job {
+	texture_job_type type;
+	const u8 *src;
+	i32 width;
+	i32 height;
+	txp_mipmap *mipmap;
+
+	i32 get_block_size () const { return type == TEXTURE_JOB_BC5_HALF ? 8 : 4; }
+
+	i32 get_rows () const { return (height + get_block_size () - 1) / get_block_size (); }
+};
+
+i32
+texture_get_mipmaps_count (i32 width, i32 height) {
+	i32 count = 1;
+	for (i32 size = std::max (width, height); size > 1; size >>= 1)
+		count++;
+	return count;
+}
+
+void
+texture_downsample (u8 *dest, const u8 *src, i32 width, i32 height) {
+	i32 dest_width  = std::max (width >> 1, 1);
+	i32 dest_height = std::max (height >> 1, 1);
+
+	for (i32 y = 0; y < dest_height; y++) {
+		const u8 *row0 = src + (u64)std::min (y * 2 + 0, height - 1) * width * 4;
+		const u8 *row1 = src + (u64)std::min (y * 2 + 1, height - 1) * width * 4;
+		u8 *out        = dest + (u64)y * dest_width * 4;
+
+		i32 x = 0;
+#ifdef __x86_64__
+		if (width > 1) {
+			const __m128i zero  = _mm_setzero_si128 ();
+			const __m128i round = _mm_set1_epi16 (2);
+			for (; x + 4 <= dest_width; x += 4) {
+				__m128 a0 = _mm_castsi128_ps (_mm_loadu_si128 ((const __m128i *)(row0 + x * 8)));
+				__m128 b0 = _mm_castsi128_ps (_mm_loadu_si128 ((const __m128i *)(row0 + x * 8 + 16)));
+				__m128 a1 = _mm_castsi128_ps (_mm_loadu_si128 ((const __m128i *)(row1 + x * 8)));
+				__m128 b1 = _mm_castsi128_ps (_mm_loadu_si128 ((const __m128i *)(row1 + x * 8 + 16)));
+
+				// Split even and odd source pixels so lane n holds both halves of output pixel n
+				__m128i even0 = _mm_castps_si128 (_mm_shuffle_ps (a0, b0, _MM_SHUFFLE (2, 0, 2, 0)));
+				__m128i odd0  = _mm_castps_si128 (_mm_shuffle_ps (a0, b0, _MM_SHUFFLE (3, 1, 3, 1)));
+				__m128i even1 = _mm_castps_si128 (_mm_shuffle_ps (a1, b1, _MM_SHUFFLE (2, 0, 2, 0)));
+				__m128i odd1  = _mm_castps_si128 (_mm_shuffle_ps (a1, b1, _MM_SHUFFLE (3, 1, 3, 1)));
+
+				__m128i lo = _mm_add_epi16 (_mm_add_epi16 (_mm_unpacklo_epi8 (even0, zero), _mm_unpacklo_epi8 (odd0, zero)),
+				                            _mm_add_epi16 (_mm_unpacklo_epi8 (even1, zero), _mm_unpacklo_epi8 (odd1, zero)));
+				__m128i hi = _mm_add_epi16 (_mm_add_epi16 (_mm_unpackhi_epi8 (even0, zero), _mm_unpackhi_epi8 (odd0, zero)),
+				                            _mm_add_epi16 (_mm_unpackhi_epi8 (even1, zero), _mm_unpackhi_epi8 (odd1, zero)));
+				lo         = _mm_srli_epi16 (_mm_add_epi16 (lo, round), 2);
+				hi         = _mm_srli_epi16 (_mm_add_epi16 (hi, round), 2);
+
+				_mm_storeu_si128 ((__m128i *)(out + x * 4), _mm_packus_epi16 (lo, hi));
+			}
+		}
+#endif
+
+		for (; x < dest_width; x++) {
+			i32 x0 = std::min (x * 2 + 0, width - 1) * 4;
+			i32 x1 = std::min (x * 2 + 1, width - 1) * 4;
+			for (i32 c = 0; c < 4; c++)
+				out[x * 4 + c] = (u8)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2);
+		}
+	}
+}
+
+#define YCBCR_ADD 128.5019f
+#define YCBCR_DIV (256.0001f / 255.0f)
+
+// Every kernel sums as (r * R + g * G) + (b * B + add) with each product rounded on its own, the order of the SSE code
+// this replaced. Truncation to u8 turns a one ulp difference into a different byte, so nothing here may use FMA and
+// meson.build builds with -ffp-contract=off to keep the compiler from fusing the multiplies and adds by itself.
+static void
+texture_convert_ycbcr_scalar (u8 *ya_data, u8 *cbcr_data, const u8 *rgba, u64 count) {
+	for (u64 i = 0; i < count; i++) {
+		f32 r = rgba[i * 4 + 0];
+		f32 g = rgba[i * 4 + 1];
+		f32 b = rgba[i * 4 + 2];
+		u8 a  = rgba[i * 4 + 3];
+
+		f32 y  = r * 0.212593317f + g * 0.715214610f + b * 0.0721921176f;
+		f32 cb = (r * -0.114568502f + g * -0.385435730f + (b * 0.5000042320f + YCBCR_ADD)) / YCBCR_DIV;
+		f32 cr = (r * 0.500004232f + g * -0.454162151f + (b * -0.0458420813f + YCBCR_ADD)) / YCBCR_DIV;
+
+		ya_data[i * 2 + 0]   = y;
+		ya_data[i * 2 + 1]   = a;
+		cbcr_data[i * 2 + 0] = cb;
+		cbcr_data[i * 2 + 1] = cr;
+	}
+}
+
+#ifdef __x86_64__
+// 8 pixels per iteration: deinterleave RGBA8 into float planes, multiply by the matrix rows,
+// truncate and pack with saturation back into the interleaved Y/A and Cb/Cr planes
+__attribute__ ((target ("avx2"))) static void
+texture_convert_ycbcr_avx2 (u8 *ya_data, u8 *cbcr_data, const u8 *rgba, u64 count) {
+	const __m256i mask = _mm256_set1_epi32 (0xFF);
+	const __m256 add   = _mm256_set1_ps (YCBCR_ADD);
+	const __m256 div   = _mm256_set1_ps (YCBCR_DIV);
+
+	u64 i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i px = _mm256_loadu_si256 ((const __m256i *)(rgba + i * 4));
+		__m256 r   = _mm256_cvtepi32_ps (_mm256_and_si256 (px, mask));
+		__m256 g   = _mm256_cvtepi32_ps (_mm256_and_si256 (_mm256_srli_epi32 (px, 8), mask));
+		__m256 b   = _mm256_cvtepi32_ps (_mm256_and_si256 (_mm256_srli_epi32 (px, 16), mask));
+		__m256i a  = _mm256_srli_epi32 (px, 24);
+
+		__m256 y  = _mm256_add_ps (_mm256_add_ps (_mm256_mul_ps (r, _mm256_set1_ps (0.212593317f)), _mm256_mul_ps (g, _mm256_set1_ps (0.715214610f))),
+		                          _mm256_mul_ps (b, _mm256_set1_ps (0.0721921176f)));
+		__m256 cb = _mm256_add_ps (_mm256_add_ps (_mm256_mul_ps (r, _mm256_set1_ps (-0.114568502f)), _mm256_mul_ps (g, _mm256_set1_ps (-0.385435730f))),
+		                          _mm256_add_ps (_mm256_mul_ps (b, _mm256_set1_ps (0.5000042320f)), add));
+		__m256 cr = _mm256_add_ps (_mm256_add_ps (_mm256_mul_ps (r, _mm256_set1_ps (0.500004232f)), _mm256_mul_ps (g, _mm256_set1_ps (-0.454162151f))),
+		                          _mm256_add_ps (_mm256_mul_ps (b, _mm256_set1_ps (-0.0458420813f)), add));
+		cb        = _mm256_div_ps (cb, div);
+		cr        = _mm256_div_ps (cr, div);
+
+		__m256i yi  = _mm256_min_epi32 (_mm256_max_epi32 (_mm256_cvttps_epi32 (y), _mm256_setzero_si256 ()), mask);
+		__m256i cbi = _mm256_min_epi32 (_mm256_max_epi32 (_mm256_cvttps_epi32 (cb), _mm256_setzero_si256 ()), mask);
+		__m256i cri = _mm256_min_epi32 (_mm256_max_epi32 (_mm256_cvttps_epi32 (cr), _mm256_setzero_si256 ()), mask);
+
+		__m256i ya   = _mm256_or_si256 (yi, _mm256_slli_epi32 (a, 8));
+		__m256i cbcr = _mm256_or_si256 (cbi, _mm256_slli_epi32 (cri, 8));
+
+		_mm_storeu_si128 ((__m128i *)(ya_data + i * 2),
+		                  _mm_packus_epi32 (_mm256_castsi256_si128 (ya), _mm256_extracti128_si256 (ya, 1)));
+		_mm_storeu_si128 ((__m128i *)(cbcr_data + i * 2),
+		                  _mm_packus_epi32 (_mm256_castsi256_si128 (cbcr), _mm256_extracti128_si256 (cbcr, 1)));
+	}
+
+	texture_convert_ycbcr_scalar (ya_data + i * 2, cbcr_data + i * 2, rgba + i * 4, count - i);
+}
+
+// Same as the AVX2 kernel with 16 pixels per iteration
+__attribute__ ((target ("avx512f"))) static void
+texture_convert_ycbcr_avx512 (u8 *ya_data, u8 *cbcr_data, const u8 *rgba, u64 count) {
+	const __m512i mask = _mm512_set1_epi32 (0xFF);
+	const __m512 add   = _mm512_set1_ps (YCBCR_ADD);
+	const __m512 div   = _mm512_set1_ps (YCBCR_DIV);
+
+	u64 i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m512i px = _mm512_loadu_si512 ((const void *)(rgba + i * 4));
+		__m512 r   = _mm512_cvtepi32_ps (_mm512_and_si512 (px, mask));
+		__m512 g   = _mm512_cvtepi32_ps (_mm512_and_si512 (_mm512_srli_epi32 (px, 8), mask));
+		__m512 b   = _mm512_cvtepi32_ps (_mm512_and_si512 (_mm512_srli_epi32 (px, 16), mask));
+		__m512i a  = _mm512_srli_epi32 (px, 24);
+
+		__m512 y  = _mm512_add_ps (_mm512_add_ps (_mm512_mul_ps (r, _mm512_set1_ps (0.212593317f)), _mm512_mul_ps (g, _mm512_set1_ps (0.715214610f))),
+		                          _mm512_mul_ps (b, _mm512_set1_ps (0.0721921176f)));
+		__m512 cb = _mm512_add_ps (_mm512_add_ps (_mm512_mul_ps (r, _mm512_set1_ps (-0.114568502f)), _mm512_mul_ps (g, _mm512_set1_ps (-0.385435730f))),
+		                          _mm512_add_ps (_mm512_mul_ps (b, _mm512_set1_ps (0.5000042320f)), add));
+		__m512 cr = _mm512_add_ps (_mm512_add_ps (_mm512_mul_ps (r, _mm512_set1_ps (0.500004232f)), _mm512_mul_ps (g, _mm512_set1_ps (-0.454162151f))),
+		                          _mm512_add_ps (_mm512_mul_ps (b, _mm512_set1_ps (-0.0458420813f)), add));
+		cb        = _mm512_div_ps (cb, div);
+		cr        = _mm512_div_ps (cr, div);
+
+		__m512i yi  = _mm512_min_epi32 (_mm512_max_epi32 (_mm512_cvttps_epi32 (y), _mm512_setzero_si512 ()), mask);
+		__m512i cbi = _mm512_min_epi32 (_mm512_max_epi32 (_mm512_cvttps_epi32 (cb), _mm512_setzero_si512 ()), mask);
+		__m512i cri = _mm512_min_epi32 (_mm512_max_epi32 (_mm512_cvttps_epi32 (cr), _mm512_setzero_si512 ()), mask);
+
+		_mm256_storeu_si256 ((__m256i *)(ya_data + i * 2), _mm512_cvtepi32_epi16 (_mm512_or_si512 (yi, _mm512_slli_epi32 (a, 8))));
+		_mm256_storeu_si256 ((__m256i *)(cbcr_data + i * 2), _mm512_cvtepi32_epi16 (_mm512_or_si512 (cbi, _mm512_slli_epi32 (cri, 8))));
+	}
+
+	texture_convert_ycbcr_scalar (ya_data + i * 2, cbcr_data + i * 2, rgba + i * 4, count - i);
+}
+#endif
+
+void
+texture_convert_ycbcr (u8 *ya_data, u8 *cbcr_data, const u8 *rgba, u64 count) {
+	typedef void (*convert_func) (u8 *ya_data, u8 *cbcr_data, const u8 *rgba, u64 count);
+
+	static const convert_func convert = [] () -> convert_func {
+#ifdef __x86_64__
+		if (__builtin_cpu_supports ("avx512f")) return texture_convert_ycbcr_avx512;
+		if (__builtin_cpu_supports ("avx2")) return texture_convert_ycbcr_avx2;
+#endif
+		return texture_convert_ycbcr_scalar;
+	}();
+
+	// Split into chunks of whole kernel iterations so the conversion runs on the pool alongside everything else
+	const u64 chunk = 0x10000;
+	thread_pool::get ().parallel_for ((count + chunk - 1) / chunk, [&] (size_t i) {
+		u64 offset = i * chunk;
+		convert (ya_data + offset * 2, cbcr_data + offset * 2, rgba + offset * 4, std::min (chunk, count - offset));
+	});
+}
+
+static void
+texture_job_run_row (const texture_job &job, i32 row) {
+	i32 block_size = job.get_block_size ();
+	i32 i          = row * block_size;
+	i32 blocks     = (job.width + block_size - 1) / block_size;
+	u8 *dest       = job.mipmap->data.data () + (u64)row * blocks * 16;
+
+	switch (job.type) {
+	case TEXTURE_JOB_COPY_RGB:
+	case TEXTURE_JOB_COPY_RGBA: {
+		i32 remainHeight = std::min<i32> (4, job.height - i);
+		if (job.type == TEXTURE_JOB_COPY_RGBA) {
+			memcpy (job.mipmap->data.data () + (u64)i * job.width * 4, job.src + (u64)i * job.width * 4, (u64)remainHeight * job.width * 4);
+			break;
+		}
+
+		u8 *out       = job.mipmap->data.data () + (u64)i * job.width * 3;
+		const u8 *src = job.src + (u64)i * job.width * 4;
+		for (u64 p = 0; p < (u64)remainHeight * job.width; p++) {
+			out[p * 3 + 0] = src[p * 4 + 0];
+			out[p * 3 + 1] = src[p * 4 + 1];
+			out[p * 3 + 2] = src[p * 4 + 2];
+		}
+	} break;
+	case TEXTURE_JOB_BC3:
+	case TEXTURE_JOB_BC7: {
+		i32 remainHeight = std::min<i32> (4, job.height - i);
+		for (i32 j = 0; j < job.width; j += 4) {
+			i32 remainWidth = std::min<i32> (4, job.width - j);
+
+			HDRColorA color[16] = {};
+			for (i32 h = 0; h < remainHeight; h++) {
+				for (i32 w = 0; w < remainWidth; w++) {
+					u64 pxOffset       = ((u64)(i + h) * job.width + j + w) * 4;
+					color[h * 4 + w].r = (f32)(*(u8 *)(job.src + pxOffset + 0)) / 255.0;
+					color[h * 4 + w].g = (f32)(*(u8 *)(job.src + pxOffset + 1)) / 255.0;
+					color[h * 4 + w].b = (f32)(*(u8 *)(job.src + pxOffset + 2)) / 255.0;
+					color[h * 4 + w].a = (f32)(*(u8 *)(job.src + pxOffset + 3)) / 255.0;
+				}
+			}
+
+			if (job.type == TEXTURE_JOB_BC3) D3DXEncodeBC3 (dest, color, BC_FLAGS_DITHER_RGB | BC_FLAGS_DITHER_A);
+			else D3DXEncodeBC7 (dest, color, 0);
+			dest += 16;
+		}
+	} break;
+	case TEXTURE_JOB_BC5: {
+		i32 remainHeight = std::min<i32> (4, job.height - i);
+		for (i32 j = 0; j < job.width; j += 4) {
+			i32 remainWidth = std::min<i32> (4, job.width - j);
+
+			XMFLOAT2 color[16] = {0.0};
+			for (i32 h = 0; h < remainHeight; h++) {
+				for (i32 w = 0; w < remainWidth; w++) {
+					u64 pxOffset       = ((u64)(i + h) * job.width + j + w) * 2;
+					color[h * 4 + w].x = (f32)(*(u8 *)(job.src + pxOffset + 0)) / 255.0;
+					color[h * 4 + w].y = (f32)(*(u8 *)(job.src + pxOffset + 1)) / 255.0;
+				}
+			}
+
+			D3DXEncodeBC5U (dest, color);
+			dest += 16;
+		}
+	} break;
+	case TEXTURE_JOB_BC5_HALF: {
+		i32 remainHeight = std::min<i32> (8, job.height - i);
+		for (i32 j = 0; j < job.width; j += 8) {
+			i32 remainWidth = std::min<i32> (8, job.width - j);
+
+			f32 color[8][8][2] = {0.5};
+			for (i32 h = 0; h < remainHeight; h++) {
+				for (i32 w = 0; w < remainWidth; w++) {
+					u64 pxOffset   = ((u64)(i + h) * job.width + j + w) * 2;
+					color[h][w][0] = (f32)(*(u8 *)(job.src + pxOffset + 0)) / 255.0;
+					color[h][w][1] = (f32)(*(u8 *)(job.src + pxOffset + 1)) / 255.0;
+				}
+			}
+
+			XMFLOAT2 temp[16];
+			for (i32 h = 0; h < 4; h++) {
+				for (i32 w = 0; w < 4; w++) {
+					temp[h * 4 + w].x =
+					    (color[h * 2][w * 2][0] + color[h * 2][w * 2 + 1][0] + color[h * 2 + 1][w * 2][0] + color[h * 2 + 1][w * 2 + 1][0]) / 4.0;
+					temp[h * 4 + w].y =
+					    (color[h * 2][w * 2][1] + color[h * 2][w * 2 + 1][1] + color[h * 2 + 1][w * 2][1] + color[h * 2 + 1][w * 2 + 1][1]) / 4.0;
+				}
+			}
+			D3DXEncodeBC5U (dest, temp);
+			dest += 16;
+		}
+	} break;
+	}
+}
+
+static void
+texture_jobs_run (const std::vector<texture_job> &jobs) {
+	size_t count = 0;
+	for (auto &job : jobs)
+		count += job.get_rows ();
+
+	scratch_scope scope;
+	std::pair<u32, i32> *rows = scope.arena.allocate<std::pair<u32, i32>> (count);
+	for (u32 i = 0, k = 0; i < jobs.size (); i++)
+		for (i32 j = 0; j < jobs[i].get_rows (); j++)
+			rows[k++] = {i, j};
+
+	thread_pool::get ().parallel_for (count, [&] (size_t i) { texture_job_run_row (jobs[rows[i].first], rows[i].second); });
+}
+
+void
+texture_encode (txp *texture, const u8 *const *layers, i32 layers_count, i32 width, i32 height, texture_encoding encoding, i32 mipmaps_count,
+                bool cube_map) {
+	texture->has_cube_map = cube_map;
+	texture->array_size   = layers_count;
+
+	std::vector<texture_job> jobs;
+	scratch_scope scope;
+	scratch_arena &arena = scope.arena;
+
+	if (encoding == TEXTURE_ENCODING_BC5_YCBCR) {
+		texture->mipmaps_count = 2;
+		texture->mipmaps.resize (layers_count * 2);
+
+		for (i32 i = 0; i < layers_count; i++) {
+			u8 *ya_data   = arena.allocate<u8> ((u64)width * height * 2);
+			u8 *cbcr_data = arena.allocate<u8> ((u64)width * height * 2);
+			texture_convert_ycbcr (ya_data, cbcr_data, layers[i], (u64)width * height);
+
+			txp_mipmap &ya_mipmap   = texture->mipmaps[i * 2 + 0];
+			txp_mipmap &cbcr_mipmap = texture->mipmaps[i * 2 + 1];
+
+			ya_mipmap.width  = width;
+			ya_mipmap.height = height;
+			ya_mipmap.format = TXP_BC5;
+			ya_mipmap.size   = ya_mipmap.get_size ();
+			ya_mipmap.data.resize (ya_mipmap.size);
+
+			cbcr_mipmap.width  = width / 2;
+			cbcr_mipmap.height = height / 2;
+			cbcr_mipmap.format = TXP_BC5;
+			cbcr_mipmap.size   = cbcr_mipmap.get_size ();
+			cbcr_mipmap.data.resize (cbcr_mipmap.size);
+
+			jobs.push_back ({TEXTURE_JOB_BC5, ya_data, width, height, &ya_mipmap});
+			jobs.push_back ({TEXTURE_JOB_BC5_HALF, cbcr_data, width, height, &cbcr_mipmap});
+		}
+
+		texture_jobs_run (jobs);
+		return;
+	}
+
+	// The whole chain of every layer is built from its source once, each level feeding the next.
+	// Buffers come from the calling thread's arena so the layers can be filtered on the pool.
+	const u8 **level_data = arena.allocate<const u8 *> ((u64)layers_count * mipmaps_count);
+	for (i32 i = 0; i < layers_count; i++) {
+		level_data[i * mipmaps_count] = layers[i];
+		for (i32 j = 1; j < mipmaps_count; j++)
+			level_data[i * mipmaps_count + j] = arena.allocate<u8> ((u64)std::max (width >> j, 1) * std::max (height >> j, 1) * 4);
+	}
+
+	if (mipmaps_count > 1)
+		thread_pool::get ().parallel_for (layers_count, [&] (size_t i) {
+			for (i32 j = 1; j < mipmaps_count; j++)
+				texture_downsample ((u8 *)level_data[i * mipmaps_count + j], level_data[i * mipmaps_count + j - 1], std::max (width >> (j - 1), 1),
+				                    std::max (height >> (j - 1), 1));
+		});
+
+	texture->mipmaps_count = mipmaps_count;
+	texture->mipmaps.resize (layers_count * mipmaps_count);
+
+	// Mipmaps are stored layer by layer, jobs are queued level by level so the largest rows are picked up first
+	for (i32 j = 0; j < mipmaps_count; j++) {
+		for (i32 i = 0; i < layers_count; i++) {
+			txp_mipmap &mipmap = texture->mipmaps[i * mipmaps_count + j];
+			mipmap.width       = std::max (width >> j, 1);
+			mipmap.height      = std::max (height >> j, 1);
+
+			texture_job_type type;
+			switch (encoding) {
+			case TEXTURE_ENCODING_RGB:
+				type          = TEXTURE_JOB_COPY_RGB;
+				mipmap.format = TXP_RGB8;
+				mipmap.size   = mipmap.get_size ();
+				break;
+			case TEXTURE_ENCODING_RGBA:
+				type          = TEXTURE_JOB_COPY_RGBA;
+				mipmap.format = TXP_RGBA8;
+				mipmap.size   = mipmap.get_size ();
+				break;
+			case TEXTURE_ENCODING_BC3:
+				type          = TEXTURE_JOB_BC3;
+				mipmap.format = TXP_BC3;
+				mipmap.size   = mipmap.get_size ();
+				break;
+			default:
+				type          = TEXTURE_JOB_BC7;
+				mipmap.format = (txp_format)15; // BC7
+				mipmap.size   = ((mipmap.width + 3) / 4) * ((mipmap.height + 3) / 4) * 16;
+				break;
+			}
+			mipmap.data.resize (mipmap.size);
+
+			jobs.push_back ({type, level_data[i * mipmaps_count + j], mipmap.width, mipmap.height, &mipmap});
+		}
+	}
+
+	texture_jobs_run (jobs);
+}
+
+std::vector<texture_pack_entry>
+texture_pack_snapshot (const txp_set *set) {
+	std::vector<texture_pack_entry> textures (set->textures.size ());
+	for (size_t i = 0; i < textures.size (); i++) {
+		const txp &texture        = set->textures[i];
+		textures[i].cube_map      = texture.has_cube_map;
+		textures[i].array_size    = texture.array_size;
+		textures[i].mipmaps_count = texture.mipmaps_count;
+		textures[i].mipmaps.reserve (texture.mipmaps.size ());
+		for (const txp_mipmap &mipmap : texture.mipmaps)
+			textures[i].mipmaps.push_back ({mipmap.width, mipmap.height, (u32)mipmap.format, mipmap.data.data (), (u32)mipmap.data.size ()});
+	}
+	return textures;
+}
+
+static u32
+texture_load_u32 (const u8 *data) {
+	u32 value;
+	memcpy (&value, data, 4);
+	return value;
+}
+
+bool
+texture_pack_parse (const u8 *data, u64 size, std::vector<texture_pack_entry> *textures, u64 *end) {
+	if (size < 0x0C || texture_load_u32 (data) != 0x03505854) return false;
+
+	u64 count = texture_load_u32 (data + 0x04);
+	if (size < 0x0C + count * 4) return false;
+
+	textures->assign (count, {});
+	*end = 0x0C + count * 4;
+	for (u64 i = 0; i < count; i++) {
+		u64 offset = texture_load_u32 (data + 0x0C + i * 4);
+		if (offset > size || size - offset < 0x0C) return false;
+
+		const u8 *header = data + offset;
+		u32 signature    = texture_load_u32 (header);
+		if (signature != 0x04505854 && signature != 0x05505854) return false;
+
+		texture_pack_entry &texture = textures->at (i);
+		u64 mipmaps                 = texture_load_u32 (header + 0x04);
+		u32 info                    = texture_load_u32 (header + 0x08);
+		texture.cube_map            = signature == 0x05505854;
+		texture.mipmaps_count       = info & 0xFF;
+		texture.array_size          = (info >> 8) & 0xFF;
+		if (size - offset < 0x0C + mipmaps * 4) return false;
+		*end = std::max<u64> (*end, offset + 0x0C + mipmaps * 4);
+
+		texture.mipmaps.resize (mipmaps);
+		for (u64 j = 0; j < mipmaps; j++) {
+			u64 pos = offset + texture_load_u32 (header + 0x0C + j * 4);
+			if (pos > size || size - pos < 0x18 || texture_load_u32 (data + pos) != 0x02505854) return false;
+
+			texture_pack_mipmap &mipmap = texture.mipmaps[j];
+			mipmap.width                = (i32)texture_load_u32 (data + pos + 0x04);
+			mipmap.height               = (i32)texture_load_u32 (data + pos + 0x08);
+			mipmap.format               = texture_load_u32 (data + pos + 0x0C);
+			mipmap.size                 = texture_load_u32 (data + pos + 0x14);
+			mipmap.data                 = data + pos + 0x18;
+			if (size - pos - 0x18 < mipmap.size) return false;
+			*end = std::max<u64> (*end, pos + 0x18 + mipmap.size);
+		}
+	}
+	return true;
+}
+
+static void
+texture_store_u32 (u8 *dest, u32 value) {
+	memcpy (dest, &value, 4);
+}
+
+// Header and offsets of a texture, followed by a header and the data of every mipmap
+static u64
+texture_pack_get_texture_size (const texture_pack_entry &texture) {
+	u64 size = 0x0C + texture.mipmaps.size () * 4;
+	for (const texture_pack_mipmap &mipmap : texture.mipmaps)
+		size += 0x18 + mipmap.size;
+	return size;
+}
+
+u64
+texture_pack_get_size (const std::vector<texture_pack_entry> &textures) {
+	u64 size = 0x0C + textures.size () * 4;
+	for (const texture_pack_entry &texture : textures)
+		size += texture_pack_get_texture_size (texture);
+	return size;
+}
+
+// Header of the set with the offset of every texture
+static void
+texture_pack_header (u8 *dest, const std::vector<texture_pack_entry> &textures) {
+	u32 count = (u32)textures.size ();
+	texture_store_u32 (dest, 0x03505854); // TXP\x03
+	texture_store_u32 (dest + 0x04, count);
+	texture_store_u32 (dest + 0x08, count | 0x01010100);
+
+	u64 offset = 0x0C + (u64)count * 4;
+	for (u32 i = 0; i < count; i++) {
+		texture_store_u32 (dest + 0x0C + i * 4, (u32)offset);
+		offset += texture_pack_get_texture_size (textures[i]);
+	}
+}
+
+static void
+texture_pack_texture (u8 *dest, const texture_pack_entry &texture) {
+	u32 mipmaps = (u32)texture.mipmaps.size ();
+	texture_store_u32 (dest, texture.cube_map ? 0x05505854 : 0x04505854); // TXP\x05, TXP\x04
+	texture_store_u32 (dest + 0x04, mipmaps);
+	texture_store_u32 (dest + 0x08, texture.mipmaps_count | (texture.array_size << 8) | 0x01010000);
+
+	u64 pos = 0x0C + (u64)mipmaps * 4;
+	for (u32 i = 0; i < mipmaps; i++) {
+		const texture_pack_mipmap &mipmap = texture.mipmaps[i];
+		texture_store_u32 (dest + 0x0C + i * 4, (u32)pos);
+
+		u8 *header = dest + pos;
+		texture_store_u32 (header, 0x02505854); // TXP\x02
+		texture_store_u32 (header + 0x04, mipmap.width);
+		texture_store_u32 (header + 0x08, mipmap.height);
+		texture_store_u32 (header + 0x0C, mipmap.format);
+		texture_store_u32 (header + 0x10, i);
+		texture_store_u32 (header + 0x14, mipmap.size);
+		memcpy (header + 0x18, mipmap.data, mipmap.size);
+		pos += 0x18 + mipmap.size;
+	}
+}
+
+void
+texture_pack (u8 *dest, const std::vector<texture_pack_entry> &textures) {
+	texture_pack_header (dest, textures);
+
+	std::vector<u64> offsets (textures.size ());
+	u64 offset = 0x0C + textures.size () * 4;
+	for (size_t i = 0; i < textures.size (); i++) {
+		offsets[i]  = offset;
+		offset     += texture_pack_get_texture_size (textures[i]);
+	}
+
+	// Textures do not depend on each other once their offsets are known
+	thread_pool::get ().parallel_for (textures.size (), [&] (size_t i) { texture_pack_texture (dest + offsets[i], textures[i]); });
+}
+
+bool
+texture_pack (const std::vector<texture_pack_entry> &textures, const std::function<bool (const u8 *, u64)> &write) {
+	std::vector<u8> header (0x0C + textures.size () * 4);
+	texture_pack_header (header.data (), textures);
+	if (!write (header.data (), header.size ())) return false;
+
+	// One texture per thread at a time, each into its own buffer, written in order once the batch is done
+	u64 batch = thread_pool::get ().get_concurrency ();
+	std::vector<std::vector<u8>> buffers (batch);
+	for (size_t start = 0; start < textures.size (); start += batch) {
+		u64 count = std::min<u64> (batch, textures.size () - start);
+		thread_pool::get ().parallel_for (count, [&] (size_t i) {
+			buffers[i].resize (texture_pack_get_texture_size (textures[start + i]));
+			texture_pack_texture (buffers[i].data (), textures[start + i]);
+		});
+		for (u64 i = 0; i < count; i++)
+			if (!write (buffers[i].data (), buffers[i].size ())) return false;
+	}
+	return true;
+}
@@ -0,0 +1,66 @@
+#ifndef _TEXTURE_H
+#define _TEXTURE_H
+
+#include "helpers.h"
+
+#include <functional>
+
+enum texture_encoding {
+	TEXTURE_ENCODING_RGB,
+	TEXTURE_ENCODING_RGBA,
+	TEXTURE_ENCODING_BC3,
+	TEXTURE_ENCODING_BC5_YCBCR,
+	TEXTURE_ENCODING_BC7,
+};
+
+// Number of levels in a full chain down to 1x1
+i32 texture_get_mipmaps_count (i32 width, i32 height);
+
+// 2x2 box filter of an RGBA8 image into max (width / 2, 1) x max (height / 2, 1)
+void texture_downsample (u8 *dest, const u8 *src, i32 width, i32 height);
+
+// Splits count RGBA8 pixels into the interleaved Y/A and Cb/Cr planes BC5_YCBCR encodes, large inputs run on the thread pool
+void texture_convert_ycbcr (u8 *ya_data, u8 *cbcr_data, const u8 *rgba, u64 count);
+
+// Builds mipmaps_count levels for each RGBA8 layer (array element or cube face, all width x height)
+// and encodes every level of every layer at once on the thread pool.
+// BC5_YCBCR always produces its Y/CbCr pair per layer and ignores mipmaps_count.
+void texture_encode (txp *texture, const u8 *const *layers, i32 layers_count, i32 width, i32 height, texture_encoding encoding, i32 mipmaps_count,
+                     bool cube_map = false);
+
+// Mipmap as it is packed, the data is borrowed
+struct texture_pack_mipmap {
+	i32 width;
+	i32 height;
+	u32 format;
+	const u8 *data;
+	u32 size;
+};
+
+// Texture of a set as it is packed
+struct texture_pack_entry {
+	bool cube_map;
+	u32 array_size;
+	u32 mipmaps_count;
+	std::vector<texture_pack_mipmap> mipmaps;
+};
+
+// Borrows the textures of set. Appending textures moves them without moving their mipmaps,
+// so the entries stay valid as long as existing textures are left alone.
+std::vector<texture_pack_entry> texture_pack_snapshot (const txp_set *set);
+
+// Reads a little endian TXP set of size bytes at most, the entries point into data.
+// end is set to where the set ends. False when it is not a TXP set or runs past size.
+bool texture_pack_parse (const u8 *data, u64 size, std::vector<texture_pack_entry> *textures, u64 *end);
+
+// Size of the textures packed as a little endian TXP set
+u64 texture_pack_get_size (const std::vector<texture_pack_entry> &textures);
+
+// Packs the textures into dest, which holds texture_pack_get_size bytes. Textures are written on the thread pool.
+void texture_pack (u8 *dest, const std::vector<texture_pack_entry> &textures);
+
+// Packs the textures in order through write, false as soon as a write fails.
+// A batch of textures is packed on the thread pool at a time, each into its own buffer.
+bool texture_pack (const std::vector<texture_pack_entry> &textures, const std::function<bool (const u8 *, u64)> &write);
+
+#endif
@@ -0,0 +1,104 @@
+#include "thread_pool.h"
+
+struct parallel_for_state {
+	std::atomic<size_t> next;
+	std::atomic<size_t> done;
+	size_t count;
+	const std::function<void (size_t)> *func;
+	std::mutex mutex;
+	std::condition_variable cond;
+
+	// Takes items until none are left, returns true if this call finished the last one
+	bool run () {
+		size_t finished = 0;
+		for (size_t i = next.fetch_add (1); i < count; i = next.fetch_add (1)) {
+			(*func) (i);
+			finished++;
+		}
+
+		if (finished == 0) return false;
+		return done.fetch_add (finished) + finished == count;
+	}
+};
+
+thread_pool::thread_pool (u32 count) : stop (false) {
+	for (u32 i = 0; i < count; i++)
+		workers.push_back (std::thread (&thread_pool::worker_main, this));
+}
+
+thread_pool::~thread_pool () {
+	{
+		std::lock_guard<std::mutex> lock (mutex);
+		stop = true;
+	}
+	cond.notify_all ();
+
+	for (auto &t : workers)
+		t.join ();
+}
+
+thread_pool &
+thread_pool::get () {
+	static thread_pool pool (std::max<u32> (std::thread::hardware_concurrency (), 2) - 1);
+	return pool;
+}
+
+void
+thread_pool::parallel_for (size_t count, const std::function<void (size_t)> &func) {
+	if (count == 0) return;
+	if (count == 1 || workers.empty ()) {
+		for (size_t i = 0; i < count; i++)
+			func (i);
+		return;
+	}
+
+	auto state   = std::make_shared<parallel_for_state> ();
+	state->next  = 0;
+	state->done  = 0;
+	state->count = count;
+	state->func  = &func;
+
+	size_t helpers = std::min<size_t> (count - 1, workers.size ());
+	{
+		std::lock_guard<std::mutex> lock (mutex);
+		for (size_t i = 0; i < helpers; i++)
+			tasks.push_back ([state] () {
+				if (state->run ()) {
+					std::lock_guard<std::mutex> lock (state->mutex);
+					state->cond.notify_all ();
+				}
+			});
+	}
+	cond.notify_all ();
+
+	state->run ();
+
+	std::unique_lock<std::mutex> lock (state->mutex);
+	state->cond.wait (lock, [&state] () { return state->done.load () == state->count; });
+}
+
+void
+thread_pool::enqueue (std::function<void ()> task) {
+	{
+		std::lock_guard<std::mutex> lock (mutex);
+		tasks.push_back (std::move (task));
+	}
+	cond.notify_one ();
+}
+
+void
+thread_pool::worker_main () {
+	while (true) {
+		std::function<void ()> task;
+		{
+			std::unique_lock<std::mutex> lock (mutex);
+			cond.wait (lock, [this] () { return stop || !tasks.empty (); });
+			if (stop && tasks.empty ()) return;
+
+			task = std::move (tasks.front ());
+			tasks.pop_front ();
+		}
+
+		task ();
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include "helpers.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+// Process wide worker pool, sized to the hardware thread count and shared by every encoder
+class thread_pool {
+public:
+	thread_pool (u32 count);
+	~thread_pool ();
+
+	thread_pool (const thread_pool &)            = delete;
+	thread_pool &operator= (const thread_pool &) = delete;
+
+	static thread_pool &get ();
+
+	// Number of threads that can run work at once, including the caller of parallel_for
+	u32 get_concurrency () const { return (u32)workers.size () + 1; }
+
+	// Calls func (i) for every i in [0, count) and returns once all calls finished.
+	// The calling thread takes items too, so nesting from inside a worker cannot deadlock.
+	void parallel_for (size_t count, const std::function<void (size_t)> &func);
+
+	// Runs task on a worker thread some time later
+	void enqueue (std::function<void ()> task);
+
+private:
+	void worker_main ();
+
+	std::vector<std::thread> workers;
+	std::deque<std::function<void ()>> tasks;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool stop;
+};
+
+#endif
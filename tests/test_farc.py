@@ -0,0 +1,250 @@
+import gc
+import os
+import random
+import shutil
+import struct
+import tempfile
+import unittest
+
+import KKdLib
+
+SIGNATURES = [("FArc", False), ("FArC", False), ("FARC", False), ("FARC", True)]
+
+
+def make_payloads():
+	rng = random.Random(1)
+	return {
+		"empty.bin": b"",
+		"small.bin": b"abc",
+		"text.txt": b"farc round trip " * 4000,
+		"random.bin": rng.randbytes(50000),
+		"mixed.bin": b"".join(rng.choice([b"abcd", b"efgh", rng.randbytes(4)]) for _ in range(5000)),
+	}
+
+
+def read_table(path):
+	"""Entries of a FArC archive as name: (offset, compressed size, size), and where its table ends"""
+	with open(path, "rb") as file:
+		data = file.read()
+	assert data[:4] == b"FArC"
+	(header_size,) = struct.unpack_from(">I", data, 4)
+	pos = 0x0C
+	end = header_size + 0x08
+	entries = {}
+	while pos < end:
+		name_end = data.index(b"\0", pos)
+		name = data[pos:name_end].decode()
+		entries[name] = struct.unpack_from(">III", data, name_end + 1)
+		pos = name_end + 1 + 12
+	return entries, end
+
+
+class FarcTest(unittest.TestCase):
+	def setUp(self):
+		self.dir = tempfile.mkdtemp()
+		# Archives stay mapped until their farc objects are gone, Windows cannot delete them before that
+		self.addCleanup(shutil.rmtree, self.dir, True)
+		self.addCleanup(gc.collect)
+
+	def path(self, name):
+		return os.path.join(self.dir, name)
+
+	def build(self, payloads, signature="FArC", ft=False, **kwargs):
+		archive = KKdLib.farc(signature=signature, ft=ft, **kwargs)
+		for name, data in payloads.items():
+			archive.add_file(KKdLib.farc_file(name, data))
+		return archive
+
+	def assert_contents(self, path, payloads):
+		archive = KKdLib.farc(path=path)
+		self.assertEqual([file.name for file in archive.files], list(payloads))
+		for name, data in payloads.items():
+			self.assertEqual(archive.read_file(name), data, name)
+			self.assertEqual(bytes(archive.get(name).data), data, name)
+
+	def test_round_trip(self):
+		payloads = make_payloads()
+		for signature, ft in SIGNATURES:
+			with self.subTest(signature=signature, ft=ft):
+				path = self.path("%s_%d.farc" % (signature, ft))
+				self.build(payloads, signature, ft).write(path)
+				self.assert_contents(path, payloads)
+
+				# Entries of an opened archive are copied as stored
+				copy = self.path("%s_%d_copy.farc" % (signature, ft))
+				KKdLib.farc(path=path).write(copy)
+				self.assert_contents(copy, payloads)
+
+				in_memory = self.path("%s_%d_bytes.farc" % (signature, ft))
+				with open(in_memory, "wb") as file:
+					file.write(self.build(payloads, signature, ft).to_bytes())
+				self.assert_contents(in_memory, payloads)
+
+				streamed = self.path("%s_%d_stream.farc" % (signature, ft))
+				with KKdLib.farc_writer(streamed, signature=signature, ft=ft) as writer:
+					for name, data in payloads.items():
+						writer.add_file(KKdLib.farc_file(name, data))
+				self.assert_contents(streamed, payloads)
+
+	def test_dedup_offsets(self):
+		blob = random.Random(2).randbytes(20000)
+		payloads = {"a.bin": blob, "other.bin": b"other" * 1000, "b.bin": blob, "c.bin": blob}
+		path = self.path("dedup.farc")
+		self.build(payloads).write(path)
+
+		table, _ = read_table(path)
+		self.assertEqual(table["a.bin"], table["b.bin"])
+		self.assertEqual(table["a.bin"], table["c.bin"])
+		self.assertNotEqual(table["a.bin"][0], table["other.bin"][0])
+		self.assertLess(os.path.getsize(path), 2 * len(blob))
+		self.assert_contents(path, payloads)
+
+		# Same payload at another level is its own entry
+		archive = KKdLib.farc(compression_level=12)
+		archive.add_file(KKdLib.farc_file("packed", b"z" * 10000))
+		archive.add_file(KKdLib.farc_file("raw", b"z" * 10000, compression_level=0))
+		archive.write(path)
+		table, _ = read_table(path)
+		self.assertNotEqual(table["packed"][0], table["raw"][0])
+		self.assertEqual(table["raw"][1], 10000)
+
+	def test_update_append(self):
+		payloads = make_payloads()
+		path = self.path("append.farc")
+		self.build(payloads).write(path)
+		before, _ = read_table(path)
+		size = os.path.getsize(path)
+
+		archive = KKdLib.farc(path=path)
+		payloads["new.bin"] = b"appended " * 500
+		archive.add_file(KKdLib.farc_file("new.bin", payloads["new.bin"]))
+		archive.update()
+		del archive
+
+		# Old entries stay where they were unless the grown table covers them, those and the new one go past the old end
+		after, end = read_table(path)
+		kept = [name for name in before if before[name][0] >= end]
+		self.assertGreaterEqual(len(kept), 3)
+		for name in before:
+			if name in kept:
+				self.assertEqual(after[name], before[name], name)
+			else:
+				self.assertGreaterEqual(after[name][0], size, name)
+		self.assertGreaterEqual(after["new.bin"][0], size)
+		self.assert_contents(path, payloads)
+
+	def test_update_compaction(self):
+		payloads = make_payloads()
+		path = self.path("compact.farc")
+		self.build(payloads).write(path)
+
+		archive = KKdLib.farc(path=path)
+		for name in ("text.txt", "random.bin", "mixed.bin"):
+			payloads[name] = name.encode() * 10
+			archive.replace_file(KKdLib.farc_file(name, payloads[name]))
+		archive.update(max_waste=0.0)
+		del archive
+
+		# Replaced entries leave no gaps, the archive is as large as a fresh one
+		fresh = self.path("fresh.farc")
+		self.build(payloads).write(fresh)
+		self.assertEqual(os.path.getsize(path), os.path.getsize(fresh))
+		self.assert_contents(path, payloads)
+
+	def test_write_own_path(self):
+		payloads = make_payloads()
+		path = self.path("own.farc")
+		self.build(payloads).write(path)
+
+		# The archive replaces itself and the farc reads entries from the new one afterwards
+		archive = KKdLib.farc(path=path)
+		payloads["new.bin"] = b"own path " * 500
+		archive.add_file(KKdLib.farc_file("new.bin", payloads["new.bin"]))
+		archive.remove_file("small.bin")
+		del payloads["small.bin"]
+		archive.write(path)
+		for name, data in payloads.items():
+			self.assertEqual(archive.read_file(name), data, name)
+		self.assert_contents(path, payloads)
+
+		payloads["later.bin"] = b"later " * 100
+		archive.add_file(KKdLib.farc_file("later.bin", payloads["later.bin"]))
+		archive.update()
+		del archive
+		self.assert_contents(path, payloads)
+
+	def test_update_rewrite(self):
+		payloads = make_payloads()
+		path = self.path("rewrite.farc")
+		self.build(payloads).write(path)
+
+		archive = KKdLib.farc(path=path)
+		payloads["text.txt"] = b"rewritten " * 300
+		archive.replace_file(KKdLib.farc_file("text.txt", payloads["text.txt"]))
+		archive.update(max_waste=-1.0)
+		for name, data in payloads.items():
+			self.assertEqual(archive.read_file(name), data, name)
+		del archive
+		self.assert_contents(path, payloads)
+
+	def test_update_with_views(self):
+		payloads = make_payloads()
+		path = self.path("views.farc")
+		self.build(payloads, "FArc").write(path)
+
+		archive = KKdLib.farc(path=path)
+		view = archive.get("random.bin").data
+		archive.add_file(KKdLib.farc_file("new.bin", b"viewed " * 100))
+		if os.name == "nt":
+			# A mapped file cannot be replaced on Windows, the archive stays as it was
+			with self.assertRaises(RuntimeError):
+				archive.update()
+			self.assertEqual(bytes(view), payloads["random.bin"])
+			del view
+			archive.update()
+		else:
+			# The views keep the old file, the archive is written again next to them
+			archive.update()
+			self.assertEqual(bytes(view), payloads["random.bin"])
+			del view
+		payloads["new.bin"] = b"viewed " * 100
+		del archive
+		self.assert_contents(path, payloads)
+
+	def test_cache_hits(self):
+		cache = self.path("cache")
+		os.mkdir(cache)
+		payloads = {"text%d.txt" % i: (b"cached entry %d " % i) * 2000 for i in range(4)}
+		KKdLib.set_farc_cache(cache)
+		self.addCleanup(KKdLib.set_farc_cache, None)
+
+		first = self.path("first.farc")
+		self.build(payloads, compression_level=12).write(first)
+		entries = {name: os.stat(os.path.join(cache, name)) for name in os.listdir(cache)}
+		self.assertEqual(len(entries), len(payloads))
+
+		# Hits reuse the files, misses would put new ones in their place
+		second = self.path("second.farc")
+		self.build(payloads, compression_level=12).write(second)
+		for name, stat in entries.items():
+			now = os.stat(os.path.join(cache, name))
+			self.assertEqual((now.st_ino, now.st_mtime_ns), (stat.st_ino, stat.st_mtime_ns), name)
+		with open(first, "rb") as a, open(second, "rb") as b:
+			self.assertEqual(a.read(), b.read())
+
+		# A damaged entry is a miss and is replaced
+		damaged = os.path.join(cache, next(iter(entries)))
+		with open(damaged, "r+b") as file:
+			file.seek(-1, os.SEEK_END)
+			last = file.read(1)
+			file.seek(-1, os.SEEK_END)
+			file.write(bytes([last[0] ^ 0xFF]))
+		third = self.path("third.farc")
+		self.build(payloads, compression_level=12).write(third)
+		self.assert_contents(third, payloads)
+		self.assertEqual(len(os.listdir(cache)), len(payloads))
+		self.assertNotEqual(os.stat(damaged).st_ino, entries[os.path.basename(damaged)].st_ino)
+
+
+if __name__ == "__main__":
+	unittest.main()
@@ -0,0 +1,85 @@
+import os
+import shutil
+import tempfile
+import unittest
+
+import KKdLib
+
+
+class SprTest(unittest.TestCase):
+	def setUp(self):
+		self.dir = tempfile.mkdtemp()
+		self.addCleanup(shutil.rmtree, self.dir, True)
+
+	def build(self, count):
+		textures = KKdLib.txp_set()
+		pixels = []
+		for i in range(count):
+			data = bytes([i]) * (8 + i * 4) * 8 * 4
+			textures.add_texture_data("tex%d" % i, 8 + i * 4, 8, "RGBA", data)
+			pixels.append(data)
+
+		sprites = KKdLib.spr_set()
+		sprites.txp = textures
+		for i in range(count):
+			info = KKdLib.sprite_info()
+			info.name = "spr%d" % i
+			info.texid = i
+			info.width = 8
+			info.height = 8
+			info.attr = 0
+			info.resolution_mode = "HDTV1080"
+			sprites.add_sprite(info)
+		return sprites, pixels
+
+	def test_pack_outputs(self):
+		# More textures than threads so the file is written in several batches
+		sprites, pixels = self.build(os.cpu_count() * 2 + 3)
+		data = sprites.pack()
+		for texture in pixels:
+			self.assertIn(texture, data)
+
+		path = os.path.join(self.dir, "set.spr")
+		sprites.write(path)
+		with open(path, "rb") as file:
+			self.assertEqual(file.read(), data)
+
+		archive = KKdLib.farc()
+		sprites.pack_into(archive, "set.spr")
+		self.assertEqual(archive.read_file("set.spr"), data)
+
+		path = os.path.join(self.dir, "set.farc")
+		with KKdLib.farc_writer(path) as writer:
+			sprites.pack_into(writer, "set.spr")
+		self.assertEqual(KKdLib.farc(path=path).read_file("set.spr"), data)
+
+	def test_load_round_trip(self):
+		sprites, pixels = self.build(5)
+		data = sprites.pack()
+		path = os.path.join(self.dir, "set.spr")
+		sprites.write(path)
+		archive = KKdLib.farc()
+		archive.add_file(KKdLib.farc_file("set.spr", data))
+
+		# Textures of a loaded set are packed again as they were
+		for loaded in (KKdLib.spr_set(data=data), KKdLib.spr_set(path=path), KKdLib.spr_set(data=archive.get("set.spr"))):
+			self.assertEqual([sprite.name for sprite in loaded.sprites], ["spr%d" % i for i in range(5)])
+			self.assertEqual(loaded.pack(), data)
+			self.assertEqual(loaded.txp.to_bytes(), sprites.txp.to_bytes())
+
+		# The file a set was loaded from can be written over while its textures are still in use
+		loaded = KKdLib.spr_set(path=path)
+		info = loaded.sprites[0]
+		info.x = 2
+		loaded.set_sprite(0, info)
+		loaded.write(path)
+		with open(path, "rb") as file:
+			written = file.read()
+		self.assertNotEqual(written, data)
+		self.assertEqual(KKdLib.spr_set(data=written).pack(), written)
+		for texture in pixels:
+			self.assertIn(texture, written)
+
+
+if __name__ == "__main__":
+	unittest.main()
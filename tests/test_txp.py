@@ -0,0 +1,73 @@
+import os
+import shutil
+import struct
+import tempfile
+import threading
+import unittest
+
+import KKdLib
+
+
+def read_set(data):
+	"""Textures of a packed TXP set as lists of (width, height, format, id, data) per mipmap"""
+	signature, count, info = struct.unpack_from("<III", data, 0)
+	assert signature == 0x03505854 and info == count | 0x01010100
+	textures = []
+	for offset in struct.unpack_from("<%dI" % count, data, 0x0C):
+		signature, mipmaps, info = struct.unpack_from("<III", data, offset)
+		assert signature in (0x04505854, 0x05505854) and (info & 0xFF) * ((info >> 8) & 0xFF) == mipmaps
+		texture = []
+		for mipmap in struct.unpack_from("<%dI" % mipmaps, data, offset + 0x0C):
+			signature, width, height, format, id, size = struct.unpack_from("<IiiIII", data, offset + mipmap)
+			assert signature == 0x02505854
+			start = offset + mipmap + 0x18
+			texture.append((width, height, format, id, data[start : start + size]))
+		textures.append(texture)
+	return textures
+
+
+class TxpTest(unittest.TestCase):
+	def setUp(self):
+		self.dir = tempfile.mkdtemp()
+		self.addCleanup(shutil.rmtree, self.dir, True)
+
+	def test_layout(self):
+		textures = KKdLib.txp_set()
+		with self.assertRaises(TypeError):
+			textures.to_bytes()
+
+		rgba = bytes(range(256)) * 4
+		rgb = bytes(range(48))
+		textures.add_texture_data("rgba", 16, 16, "RGBA", rgba)
+		textures.add_texture_data("rgb", 4, 4, "RGB", rgb)
+
+		data = textures.to_bytes()
+		self.assertEqual(read_set(data), [[(16, 16, 2, 0, rgba)], [(4, 4, 1, 0, rgb)]])
+
+		path = os.path.join(self.dir, "set.txp")
+		textures.write(path)
+		with open(path, "rb") as file:
+			self.assertEqual(file.read(), data)
+
+	def test_pack_while_adding(self):
+		textures = KKdLib.txp_set()
+		textures.add_texture_data("first", 64, 64, "RGBA", b"\x01" * 64 * 64 * 4)
+
+		# Textures added while a pack runs are either in it whole or left out
+		def add():
+			for i in range(200):
+				textures.add_texture_data("tex%d" % i, 8, 8, "RGBA", bytes([i]) * 256)
+
+		thread = threading.Thread(target=add)
+		thread.start()
+		packed = [read_set(textures.to_bytes()) for _ in range(50)]
+		thread.join()
+		for result in packed:
+			self.assertEqual(result[0][0][4], b"\x01" * 64 * 64 * 4)
+			for i, texture in enumerate(result[1:]):
+				self.assertEqual(texture[0][4], bytes([i]) * 256)
+		self.assertEqual(len(read_set(textures.to_bytes())), 201)
+
+
+if __name__ == "__main__":
+	unittest.main()